@@ -27,9 +27,10 @@ echo 7
 echo 1 > /sys/devices/system/cpu/cpu3/online
 chmod 444 /sys/devices/system/cpu/cpu3/online
 echo 8
-echo performance > /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor
+# GOVERNOR=interactive demo.sh offline_asr zh_cn low_power
+echo ${GOVERNOR:-performance} > /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor
 chmod 444 /sys/devices/system/cpu/cpu0/cpufreq/scaling_governor
 echo 9
 sleep 1
 echo 10
-/system/bin/qualcomm_online_demo /sdcard/
+/system/bin/qualcomm_online_demo /sdcard/ "$@"
@@ -1,7 +1,10 @@
 // Copyright 2018 Mobvoi Inc. All Rights Reserved.
 
+#include <assert.h>
 #include <pthread.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <strings.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -13,11 +16,24 @@
 
 #include "qualcomm_demo/online_demo.h"
 #include "third_party/picojson/picojson.h"
+#include "utils/TimeUtils.h"
 
 namespace mobvoi {
 namespace sds {
 namespace {
 
+// Upper bound for the player to finish the queued TTS audio.
+static const int kTtsDrainTimeoutMs = 2000;
+// TTS audio synthesized ahead of the player, at most / before it starts.
+static const int kTtsQueueMs = 2000;
+static const int kTtsPrebufferMs = 160;
+// 16k mono 16 bit.
+static const int kTtsBytesPerMs = 16 * 2;
+// Raw capture kept for the retro replay; covers the greeting.
+static const int kHistoryMs = 4000;
+// Synthesized fixed prompts, under the base dir.
+static const char kPromptCacheDir[] = "prompt_cache";
+
 class Resource {
  public:
   static void SetLanguage(const std::string& lang) {
@@ -67,6 +83,27 @@ class Resource {
     return "";
   }
 
+  // Every fixed reply in the current language, greeting first.
+  static std::vector<std::string> GetPrompts() {
+    static const int error_codes[] = {
+      MOBVOI_SDS_ERR_NETWORK_ERROR, MOBVOI_SDS_ERR_SERVER_ERROR,
+      MOBVOI_SDS_ERR_NO_SPEECH, MOBVOI_SDS_ERR_GARBAGE,
+      MOBVOI_SDS_ERR_LICENSE_DENIED,
+    };
+
+    std::vector<std::string> prompts;
+    prompts.push_back(GetGreetingText());
+    prompts.push_back(NoSpeech());
+    prompts.push_back(NoSupport());
+    prompts.push_back(ErrorParsingMsg());
+    for (int ec : error_codes) {
+      prompts.push_back(GetErrorDesc(ec));
+    }
+    prompts.erase(std::remove(prompts.begin(), prompts.end(), ""),
+                  prompts.end());
+    return prompts;
+  }
+
   static std::string GetHotword() {
     static struct {
       std::string lang;
@@ -295,29 +332,51 @@ class SdsDemo::EventHandler : public CallBackBase {
 };
 
 SdsDemo::SdsDemo()
-    : speech_target_(kToNowhere),
+    : replay_batcher_("replay", FeedAsr, this, 1, 16 * kMaxFrameMs),
+      replay_silence_(16 * kMaxFrameMs),
+      hotword_batcher_("hotword", FeedHotword, this, kOutNum,
+                       16 * kMaxFrameMs),
+      asr_batcher_("asr", FeedAsr, this, 1, 16 * kMaxFrameMs),
+      // The replay looks up the echo flag of every frame it replays.
+      meta_history_(std::max(kEnergyWinLen, kHistoryMs / kMinFrameMs)),
+      tts_mutex_(PTHREAD_MUTEX_INITIALIZER),
+      tts_queue_(kTtsQueueMs * kTtsBytesPerMs),
+      tts_prebuffer_ms_(kTtsPrebufferMs),
+      speech_target_(kToNowhere),
       mutex_(PTHREAD_MUTEX_INITIALIZER),
       cond_(PTHREAD_COND_INITIALIZER) {
   sds_ = SpeechSDS::MakeInstance();
   event_handler_ = new EventHandler(this);
-  dsp_ = new MobPipeline(SpeechCallback, (void*)this);
+  MobPipelineConfig config;
+  config.historyMs = kHistoryMs;
+  dsp_ = new MobPipeline(config, SpeechCallback, (void*)this);
+  replay_ = new HistoryReplay(&dsp_->micHistory(), dsp_->frameSamples(),
+                              FeedReplay, this);
+  subset_beams_.resize(kOutNum * 16 * kMaxFrameMs);
   audio_player_ = new AudioPlayer(STREAMING);
   audio_player_->createStreamingAudioPlayer(16000, 1, 16 * 2 * 80);
+  audio_player_->setEchoReference(&echo_ref_);
+  dsp_->setEchoReference(&echo_ref_);
 }
 
 SdsDemo::~SdsDemo() {
+  prompt_cache_.stopPrewarm();
+  pthread_mutex_destroy(&tts_mutex_);
   pthread_mutex_destroy(&mutex_);
   pthread_cond_destroy(&cond_);
   SpeechSDS::DestroyInstance(sds_);
   delete event_handler_;
+  delete replay_;
   delete dsp_;
   audio_player_->destoryAudioPlayer();
   delete audio_player_;
 }
 
-void SdsDemo::SpeechCallback(void* inst, char* buffer, int length) {
+void SdsDemo::SpeechCallback(void* inst, const BeamFrame& frame,
+                             const FrameMeta& meta) {
   SdsDemo* demo = (SdsDemo*) inst;
-  demo->FeedSpeech(Buf(buffer, length));
+  demo->meta_history_.push(meta);
+  demo->FeedSpeech(frame, meta);
 }
 
 bool SdsDemo::Run(int argc, char* argv[]) {
@@ -405,9 +464,34 @@ bool SdsDemo::ParseCmdArgs(int argc, char* argv[]) {
   }
   Resource::SetLanguage(lang_);
 
-  if (argc > 4) {
-    if (0 == strcasecmp("solo", argv[4])) {
+  for (int i = 4; i < argc; i++) {
+    if (0 == strcasecmp("solo", argv[i])) {
       solo_ = true;
+    } else if (0 == strcasecmp("steer", argv[i])) {
+      steer_ = true;
+    } else if (0 == strcasecmp("retro", argv[i])) {
+      steer_ = true;
+      retro_ = true;
+    } else if (0 == strcasecmp("low_power", argv[i])) {
+      dsp_->setLowPower(true);
+    } else if (0 == strncasecmp("batch=", argv[i], 6)) {
+      batch_frames_ = atoi(argv[i] + 6);
+    } else if (0 == strncasecmp("batch_latency=", argv[i], 14)) {
+      batch_latency_ms_ = atoi(argv[i] + 14);
+    } else if (0 == strncasecmp("prebuffer=", argv[i], 10)) {
+      tts_prebuffer_ms_ = std::max(0, atoi(argv[i] + 10));
+    }
+  }
+  hotword_batcher_.Configure(batch_frames_, batch_latency_ms_);
+  asr_batcher_.Configure(batch_frames_, batch_latency_ms_);
+  replay_batcher_.Configure(batch_frames_, batch_latency_ms_);
+
+  if (retro_) {
+    std::string weights =
+        dsp_->config().dspConfigDir + "/" + kSteerWeightFile;
+    if (replay_->load(weights.c_str()) != 0) {
+      std::cerr << "No retro replay without " << weights << std::endl;
+      retro_ = false;
     }
   }
 
@@ -438,6 +522,8 @@ bool SdsDemo::RunMainLoop() {
     return false;
   }
 
+  StartPromptCache();
+
   dsp_->start();
 
   if (!StartHotword()) {
@@ -445,24 +531,57 @@ bool SdsDemo::RunMainLoop() {
   }
 
   while (!exit_app_) {
-    ShowPrompt();
-    WaitOnHotwordDetectedFlag();
+    // Barged in on the last answer: that hotword opens this dialog.
+    if (!barged_in_.exchange(false)) {
+      ShowPrompt();
+      WaitOnHotwordDetectedFlag();
+    }
+    // Keep the chain running through the dialog, the user may pause.
+    dsp_->holdAwake(true);
+    // Steer right away: the live steered beam has to be settled when a
+    // retro replay hands over to it.
+    steered_ = asr_ != nullptr && steer_ && doa_angle_ >= 0 &&
+               dsp_->steerBeam(doa_angle_) >= 0;
     PlayTtsAudio(Resource::GetGreetingText());
+    // Talking over the greeting only cuts it short.
+    barged_in_ = false;
 
     if (asr_ != nullptr) {
+      // ASR only hears doa_index_'s beam, or the steered one replacing it,
+      // and the hotword is not fed meanwhile (FeedSpeech). The DSP still
+      // computes every beam, the phase only splits its stats.
+      dsp_->markAsrPhase(true);
       if (!StartAsr()) {
         return false;
       }
 
       WaitOnStoppedFlag();
+      replay_->stop();
 
       if (!StopAsr()) {
         return false;
       }
+      dsp_->markAsrPhase(false);
 
       PlayTtsAudio(GetTtsText());
     }
+    if (steered_) {
+      dsp_->steerBeam(-1);
+      steered_ = false;
+    }
 
+    dsp_->holdAwake(false);
+    hotword_batcher_.DumpStats();
+    asr_batcher_.DumpStats();
+    audio_player_->dumpStats();
+    prompt_cache_.dumpStats();
+    if (retro_) {
+      replay_batcher_.DumpStats();
+      replay_->dumpStats();
+      std::cout << "Replay: " << replay_echo_frames_
+                << " echo frames silenced" << std::endl;
+    }
+    dsp_->dumpStageStats();
     ClearResult();
   }
 
@@ -471,6 +590,8 @@ bool SdsDemo::RunMainLoop() {
   }
 
   dsp_->stop();
+  // The services go away next.
+  prompt_cache_.stopPrewarm();
 
   return true;
 }
@@ -550,14 +671,18 @@ bool SdsDemo::SetTtsServiceParam() {
   Parameter tts_param(MOBVOI_SDS_SET_PARAM);
 
   if ("zh_cn" == lang_) {
-    tts_param[MOBVOI_SDS_LANGUAGE] = "Mandarin";
-    tts_param[MOBVOI_SDS_SPEAKER]  = "cissy";
+    tts_language_ = "Mandarin";
+    tts_speaker_  = "cissy";
   } else if ("zh_hk" == lang_) {
-    tts_param[MOBVOI_SDS_LANGUAGE] = "Cantonese";
-    tts_param[MOBVOI_SDS_SPEAKER]  = "dora";
+    tts_language_ = "Cantonese";
+    tts_speaker_  = "dora";
   } else if ("en_us" == lang_) {
-    tts_param[MOBVOI_SDS_LANGUAGE] = "English";
-    tts_param[MOBVOI_SDS_SPEAKER]  = "angela";
+    tts_language_ = "English";
+    tts_speaker_  = "angela";
+  }
+  if (!tts_language_.empty()) {
+    tts_param[MOBVOI_SDS_LANGUAGE] = tts_language_;
+    tts_param[MOBVOI_SDS_SPEAKER]  = tts_speaker_;
   }
 
   Parameter result = tts_->Invoke(tts_param);
@@ -583,6 +708,7 @@ bool SdsDemo::StartHotword() {
   Parameter params(MOBVOI_SDS_START);
   Parameter result = hotword_->Invoke(params);
   HANDLE_PARAM_ERROR(result, "starting hotword detection", false);
+  meta_history_.resetFed();
 
   return true;
 }
@@ -602,6 +728,17 @@ bool SdsDemo::StartAsr() {
   Parameter result = asr_->Invoke(start_asr);
   HANDLE_PARAM_ERROR(result, "starting ASR", false);
 
+  // Replay from the hotword on; live frames wait until it has caught up.
+  // Started before the target switches, so no live frame overtakes it.
+  // The worker has replay_batcher_ to itself, the DSP thread takes it
+  // over only once live() says the replay handed over.
+  if (retro_ && steered_) {
+    replay_batcher_.Reset();
+    replay_echo_frames_ = 0;
+    if (replay_->start(hotword_frame_ + 1, doa_angle_) != 0) {
+      std::cerr << "Retro replay failed to start" << std::endl;
+    }
+  }
   speech_target_ = kToAsr;
 
   return true;
@@ -635,44 +772,231 @@ void SdsDemo::WaitOnFlag(bool* flag) {
 }
 
 bool SdsDemo::PlayTtsAudio(const std::string& text) {
+  int64_t begin_us = monotonic_us();
+  barged_in_ = false;
+  playing_tts_ = true;
+  uint64_t key = 0;
+  bool prompt = IsPrompt(text);
+  if (prompt) {
+    key = PromptCache::key(text, tts_language_, tts_speaker_);
+    const PromptPcm* pcm = prompt_cache_.acquire(key);
+    if (pcm != nullptr) {
+      bool ret = PlayCachedAudio(pcm, begin_us);
+      prompt_cache_.release(pcm);
+      playing_tts_ = false;
+      return ret;
+    }
+  }
+
+  // TTS fills tts_queue_ on its own thread while this one feeds the player:
+  // a slow read no longer delays a buffer already synthesized, and a full
+  // player queue no longer holds synthesis back.
+  PlayerStats before;
+  audio_player_->getStats(&before);
+  tts_queue_.reset();
+  tts_text_ = text;
+  tts_record_ = prompt;
+  tts_ok_ = false;
+  pthread_t producer;
+  if (pthread_create(&producer, nullptr, TtsProducer, this) != 0) {
+    std::cerr << "Failed starting the TTS producer" << std::endl;
+    playing_tts_ = false;
+    return false;
+  }
+
+  audio_player_->start();
+  tts_queue_.prime(tts_prebuffer_ms_ * kTtsBytesPerMs);
+  int64_t ttfa_us = 0;
+  bool aborted = false;
+  while (true) {
+    char* lease = nullptr;
+    int capacity = barged_in_ ? 0 : audio_player_->lease(&lease, true);
+    if (capacity <= 0) {
+      tts_queue_.abort();
+      aborted = true;
+      break;
+    }
+    // Whole buffers while synthesis keeps up, the tail as it is.
+    int size = tts_queue_.read(lease, capacity, capacity);
+    audio_player_->commit(lease, size);
+    if (size == 0) {
+      break;
+    }
+    if (ttfa_us == 0) {
+      ttfa_us = monotonic_us() - begin_us;
+    }
+  }
+  pthread_join(producer, nullptr);
+
+  // Returns as soon as the tail has played, the caller listens right away.
+  // Cut off by a barge-in, what is queued is dropped.
+  if (!barged_in_) {
+    audio_player_->drain(kTtsDrainTimeoutMs);
+  }
+  audio_player_->stop();
+  playing_tts_ = false;
+
+  PlayerStats after;
+  audio_player_->getStats(&after);
+  PcmQueueStats queue;
+  tts_queue_.getStats(&queue);
+  printf("[tts] %lld ms of audio: first audio after %lld ms (prebuffer %d "
+         "ms), %u synthesis stalls %lld ms, %u underruns %lld ms\n",
+         (long long)(queue.readBytes / kTtsBytesPerMs),
+         (long long)(ttfa_us / 1000), tts_prebuffer_ms_, queue.stalls,
+         (long long)(queue.stallUs / 1000),
+         after.underruns - before.underruns,
+         (long long)((after.underrunUs - before.underrunUs) / 1000));
+  if (barged_in_) {
+    printf("[tts] barge-in after %lld ms\n",
+           (long long)((monotonic_us() - begin_us) / 1000));
+  }
+
+  // A prompt cut short is not cached.
+  if (tts_ok_ && prompt && !aborted) {
+    prompt_cache_.store(key, tts_pcm_.data(), tts_pcm_.size());
+  }
+  return tts_ok_;
+}
+
+// Producer side of PlayTtsAudio(): tts_text_ into tts_queue_.
+void* SdsDemo::TtsProducer(void* inst) {
+  SdsDemo* demo = (SdsDemo*) inst;
+  pthread_mutex_lock(&demo->tts_mutex_);
+  demo->tts_pcm_.clear();
+  demo->tts_ok_ = demo->SynthesizeTts(
+      demo->tts_text_, &demo->tts_queue_,
+      demo->tts_record_ ? &demo->tts_pcm_ : nullptr);
+  pthread_mutex_unlock(&demo->tts_mutex_);
+  // Also on error: the player gets what there is.
+  demo->tts_queue_.close();
+  return nullptr;
+}
+
+// Runs |text| through TTS, under tts_mutex_. With a |queue| the audio is
+// read straight into it; all of it is appended to |pcm| when given.
+bool SdsDemo::SynthesizeTts(const std::string& text, PcmQueue* queue,
+                            std::vector<char>* pcm) {
   // Start TTS service
   Parameter start(MOBVOI_SDS_START);
   Parameter result = tts_->Invoke(start);
   HANDLE_PARAM_ERROR(result, "starting TTS", false);
 
+  // Once started the service is stopped again, also when feeding or
+  // reading fails; otherwise the next START finds it busy.
+  bool ret = ReadTts(text, queue, pcm);
+
+  // Stop TTS
+  Parameter stop(MOBVOI_SDS_STOP);
+  tts_->Invoke(stop);
+
+  return ret;
+}
+
+// The part of SynthesizeTts() between START and STOP.
+bool SdsDemo::ReadTts(const std::string& text, PcmQueue* queue,
+                      std::vector<char>* pcm) {
   // Start TTS synthesis
   Parameter feed(MOBVOI_SDS_FEED_TEXT);
   feed[MOBVOI_SDS_TEXT] = text;
-  result = tts_->Invoke(feed);
+  Parameter result = tts_->Invoke(feed);
   HANDLE_PARAM_ERROR(result, "feeding text for TTS", false);
 
-  // Play TTS audio
   Parameter read(MOBVOI_SDS_READ);
-  char buf[640];
-  read[MOBVOI_SDS_AUDIO_BUF] = Buf(buf, sizeof(buf));
-  audio_player_->start();
+  char chunk[16 * 2 * 80];
   while (true) {
+    char* dst = chunk;
+    int room = sizeof(chunk);
+    if (queue != nullptr) {
+      room = queue->acquireWrite(&dst);
+      if (room <= 0) {  // Playback gave up
+        break;
+      }
+    }
+    read[MOBVOI_SDS_AUDIO_BUF] = Buf(dst, room);
     result = tts_->Invoke(read);
-    HANDLE_PARAM_ERROR(result, "reading TTS data", false);
-
     int size = result[MOBVOI_SDS_TTS_READ_SIZE].AsInt();
-    if (-1 == size) {  // End of TTS audio
+    if (result[MOBVOI_SDS_ERROR_CODE].AsInt() != MOBVOI_SDS_SUCCESS ||
+        -1 == size) {  // End of TTS audio
       break;
     }
 
-    audio_player_->write(buf, size, true);
+    if (pcm != nullptr) {
+      pcm->insert(pcm->end(), dst, dst + size);
+    }
+    if (queue != nullptr) {
+      queue->commitWrite(size);
+    }
+  }
+  HANDLE_PARAM_ERROR(result, "reading TTS data", false);
+
+  return true;
+}
+
+// Copies a cached prompt into the player; the first buffer is queued right
+// away, within a few milliseconds of |begin_us|.
+bool SdsDemo::PlayCachedAudio(const PromptPcm* pcm, int64_t begin_us) {
+  audio_player_->start();
+  int offset = 0;
+  while (offset < pcm->size) {
+    char* lease = nullptr;
+    int capacity = barged_in_ ? 0 : audio_player_->lease(&lease, true);
+    if (capacity <= 0) {
+      break;
+    }
+    int size = std::min(capacity, pcm->size - offset);
+    memcpy(lease, pcm->data + offset, size);
+    audio_player_->commit(lease, size);
+    if (offset == 0) {
+      prompt_cache_.recordStart(monotonic_us() - begin_us);
+    }
+    offset += size;
   }
 
+  if (!barged_in_) {
+    audio_player_->drain(kTtsDrainTimeoutMs);
+  }
   audio_player_->stop();
+  return offset == pcm->size;
+}
 
-  // Stop TTS
-  Parameter stop(MOBVOI_SDS_STOP);
-  tts_->Invoke(stop);
+// Opens the prompt cache and fills it in the background: prompts synthesized
+// by an earlier run are mapped from disk, the others synthesized once.
+bool SdsDemo::StartPromptCache() {
+  std::string dir = base_dir_ + "/" + kPromptCacheDir;
+  if (prompt_cache_.open(dir.c_str(), kPromptMemoryBytes,
+                         kPromptDiskBytes) != 0) {
+    std::cerr << "Prompt cache kept in memory only" << std::endl;
+  }
 
-  // Wait until TTS playback completes
-  // WaitTtsPlayComplete();
+  prompts_ = Resource::GetPrompts();
+  std::vector<uint64_t> keys;
+  for (const auto& prompt : prompts_) {
+    keys.push_back(PromptCache::key(prompt, tts_language_, tts_speaker_));
+  }
+  return keys.empty() ||
+         prompt_cache_.prewarm(keys.data(), keys.size(), SynthPrompt,
+                               this) == 0;
+}
 
-  return true;
+bool SdsDemo::IsPrompt(const std::string& text) const {
+  return std::find(prompts_.begin(), prompts_.end(), text) != prompts_.end();
+}
+
+// Prewarm thread: synthesizes prompts_[index] without playing it.
+int SdsDemo::SynthPrompt(void* inst, int index) {
+  SdsDemo* demo = (SdsDemo*) inst;
+  const std::string& text = demo->prompts_[index];
+  std::vector<char> pcm;
+  pthread_mutex_lock(&demo->tts_mutex_);
+  bool ret = demo->SynthesizeTts(text, nullptr, &pcm);
+  pthread_mutex_unlock(&demo->tts_mutex_);
+  if (!ret) {
+    return -1;
+  }
+  uint64_t key =
+      PromptCache::key(text, demo->tts_language_, demo->tts_speaker_);
+  return demo->prompt_cache_.store(key, pcm.data(), pcm.size());
 }
 
 std::string SdsDemo::GetTtsText() {
@@ -731,7 +1055,9 @@ void SdsDemo::ClearResult() {
 void SdsDemo::ShowUsage(const std::string& exe) {
   std::cerr << "Usage:\n"
                "\n"
-               "    " << exe << " <base dir> <type> [<language>] [solo]\n"
+               "    " << exe << " <base dir> <type> [<language>] [solo] [steer]"
+               " [retro] [low_power] [batch=<frames>] [batch_latency=<ms>]"
+               " [prebuffer=<ms>]\n"
                "\n"
                "Where <type>:\n"
                "\n"
@@ -754,6 +1080,11 @@ void SdsDemo::ShowUsage(const std::string& exe) {
                "    " << exe << " ../.. offline_asr zh_hk\n"
                "    " << exe << " ../.. offline_asr en_us\n"
                "    " << exe << " ../.. offline_asr zh_cn solo\n"
+               "    " << exe << " ../.. offline_asr zh_cn steer\n"
+               "    " << exe << " ../.. offline_asr zh_cn retro\n"
+               "    " << exe << " ../.. offline_asr zh_cn low_power\n"
+               "    " << exe << " ../.. offline_asr zh_cn batch=4\n"
+               "    " << exe << " ../.. offline_asr zh_cn prebuffer=240\n"
                "    " << exe << " ../.. online_onebox zh_cn\n"
                "    " << exe << " ../.. mixed\n";
 }
@@ -776,27 +1107,106 @@ void SdsDemo::ShowPrompt() {
   }
 }
 
-bool SdsDemo::FeedSpeech(const Buf& buf) {
-  Parameter params(MOBVOI_SDS_FEED_SPEECH);
+static Buf ToBuf(const BeamFrame& frame) {
+  assert(frame.contiguous());
+  return Buf(frame.bytes(), frame.byteSize());
+}
+
+bool SdsDemo::FeedSpeech(const BeamFrame& frame, const FrameMeta& meta) {
+  if (speech_target_ == kToAsr && asr_ != nullptr) {
+    // Nobody waits for a hotword while ASR listens, skip the detection.
+    // What it still had pending never reaches it either.
+    hotword_batcher_.Reset();
+    if (!replay_->live(meta.frameIndex)) {
+      // Still in the history, the replay gets to it.
+      return true;
+    }
+    // The replay handed over; what it still had batched comes first.
+    if (!replay_batcher_.Flush()) {
+      return false;
+    }
+    if (frame.channels() > kSteeredChannel) {
+      return asr_batcher_.Push(frame.channel(kSteeredChannel));
+    }
+    return asr_batcher_.Push(frame.channel(doa_index_));
+  }
+  // Audio batched for an ASR session that has ended is stale.
+  asr_batcher_.Reset();
+  // Mostly our own TTS coming back; the AEC residue only triggers false
+  // hotwords.
+  if (meta.echo) {
+    return hotword_batcher_.Poll();
+  }
+  // The hotword only ever listens to the DSP beams.
+  BeamFrame beams = frame.channels(0, kOutNum);
+
+  // Under overload the pipeline asks for fewer hotword beams. The service
+  // keeps its kOutNum beams, restarting it here would cost the DSP thread
+  // the time it is short of and cut off a wake word being spoken; the
+  // dropped beams are fed silence instead.
+  bool subset = meta.quality >= kQualityHotwordSubset;
+
+  bool ret;
   if (solo_) {
-    Buf soloBuf(buf.GetAddr(), buf.GetSize() / kOutNum);
-    params[MOBVOI_SDS_AUDIO_BUF] = soloBuf;  
+    ret = hotword_batcher_.Push(beams.channel(0));
+  } else if (!subset) {
+    ret = hotword_batcher_.Push(beams);
   } else {
-    params[MOBVOI_SDS_AUDIO_BUF] = buf;    
+    int bytes = frame.samples() * sizeof(short);
+    for (int i = 0; i < beams.channels(); i++) {
+      short* out = &subset_beams_[i * frame.samples()];
+      if (i % kSubsetStride == 0) {
+        memcpy(out, beams.channelData(i), bytes);
+      } else {
+        memset(out, 0, bytes);
+      }
+    }
+    BeamFrame kept(&subset_beams_[0], beams.channels(), frame.samples(),
+                   frame.samples(), frame.sampleRate(), frame.frameIndex());
+    ret = hotword_batcher_.Push(kept);
+  }
+  return ret;
+}
+
+bool SdsDemo::FeedHotword(void* inst, const BeamFrame& batch) {
+  SdsDemo* demo = (SdsDemo*) inst;
+  // Recorded first, a detection may be reported from within the feed.
+  const SpeechBatcher& batcher = demo->hotword_batcher_;
+  int count = batcher.fed_frames();
+  int frame_ms = batch.samples() * 1000 / (count * batch.sampleRate());
+  for (int i = 0; i < count; i++) {
+    demo->meta_history_.recordFed(batcher.fed_indices()[i], frame_ms);
   }
 
-  Parameter result;
-  result = hotword_->Invoke(params);
+  Parameter params(MOBVOI_SDS_FEED_SPEECH);
+  params[MOBVOI_SDS_AUDIO_BUF] = ToBuf(batch);
+  Parameter result = demo->hotword_->Invoke(params);
   HANDLE_PARAM_ERROR(result, "feeding speech for hotword detection", false);
+  return true;
+}
 
-  if (speech_target_ == kToAsr && asr_ != nullptr) {
-    Buf asrBuf(buf.GetAddr() + doa_index_ * buf.GetSize() / kOutNum,
-        buf.GetSize() / kOutNum);
-    params[MOBVOI_SDS_AUDIO_BUF] = asrBuf;
-    result = asr_->Invoke(params);
-    HANDLE_PARAM_ERROR(result, "feeding speech for ASR", false);
+bool SdsDemo::FeedReplay(void* inst, const BeamFrame& frame) {
+  SdsDemo* demo = (SdsDemo*) inst;
+  // The replayed beam has no AEC: where the pipeline flagged echo, it is
+  // mostly the greeting, which ASR would transcribe. Silence keeps the
+  // timing.
+  FrameMeta meta;
+  if (demo->meta_history_.get(frame.frameIndex(), &meta) && meta.echo) {
+    demo->replay_echo_frames_++;
+    BeamFrame silence(&demo->replay_silence_[0], 1, frame.samples(),
+                      frame.samples(), frame.sampleRate(),
+                      frame.frameIndex());
+    return demo->replay_batcher_.Push(silence);
   }
+  return demo->replay_batcher_.Push(frame);
+}
 
+bool SdsDemo::FeedAsr(void* inst, const BeamFrame& batch) {
+  SdsDemo* demo = (SdsDemo*) inst;
+  Parameter params(MOBVOI_SDS_FEED_SPEECH);
+  params[MOBVOI_SDS_AUDIO_BUF] = ToBuf(batch);
+  Parameter result = demo->asr_->Invoke(params);
+  HANDLE_PARAM_ERROR(result, "feeding speech for ASR", false);
   return true;
 }
 
@@ -813,6 +1223,9 @@ void SdsDemo::SetErrorCode(int ec) {
 }
 
 void SdsDemo::SetHotwordDetectedFlag() {
+  if (playing_tts_) {
+    barged_in_ = true;
+  }
   pthread_mutex_lock(&mutex_);
   hotword_detected_ = true;
   pthread_cond_signal(&cond_);
@@ -826,6 +1239,7 @@ static int BFs[] = {30, 90, 150, 210, 270, 330};
 #elif kOutNum == 8
 static int BFs[] = {0, 45, 90, 135, 180, 225, 270, 315};
 #endif
+static const int kBFsNum = sizeof(BFs) / sizeof(BFs[0]);
 
 void SdsDemo::SelectOneBF(DblVec frames) {
   // int sum = 0;
@@ -843,23 +1257,50 @@ void SdsDemo::SelectOneBF(DblVec frames) {
   //   hotword_index_ = sum / c;
   // }
 
-  doa_index_ = dsp_->GetHotwordAngle(frames);
+  // Hotword frame numbers count only what it was fed, back to ours.
+  for (size_t i = 0; i < frames.size(); i++) {
+    unsigned int frame = 0;
+    if (frames[i] != 0 &&
+        !meta_history_.fedFrame((unsigned int)frames[i], &frame)) {
+      std::cout << "SelectOneBF: frame " << frames[i] << " of beam " << i
+                << " not in the history" << std::endl;
+    }
+    frames[i] = frame;
+  }
 
-  // int angle = dsp_->GetHotwordAngle(frame);
+  int beam = meta_history_.selectBeam(frames);
+  if (beam < 0) {
+    std::cout << "SelectOneBF: no beam, keep " << doa_index_ << std::endl;
+    return;
+  }
+  dsp_->SetLed(beam);
+  std::cout << "SelectOneBF: max " << beam << std::endl;
+
+  // Prefer the DOA recorded with the frame the loudest beam fired on;
+  // without a DOA stage fall back to that beam.
+  hotword_frame_ = (unsigned int)frames[beam];
+  int angle = meta_history_.doaAt(hotword_frame_);
+  doa_angle_ = angle;
+  if (angle < 0) {
+    doa_index_ = beam;
+    std::cout << "SelectOneBF: no doa, beam " << doa_index_ << std::endl;
+    return;
+  }
 
-  // int half = (BFs[1] - BFs[0]) / 2;
-  // if ((angle >= (360 - half) && angle <= 360) || (angle >= 0 && angle < half)){
-  //   doa_index_ = 0;
-  // } else {
-  //   for (int i = 1; i < sizeof(BFs) / sizeof(BFs[0]); i++) {
-  //     if (angle >= (BFs[i] - half) && angle < (BFs[i] + half)) {
-  //       doa_index_ = i;
-  //       break;
-  //     }
-  //   }
-  // }
+  int half = (BFs[1] - BFs[0]) / 2;
+  if ((angle >= (360 - half) && angle <= 360) || (angle >= 0 && angle < half)){
+    doa_index_ = 0;
+  } else {
+    for (int i = 1; i < kBFsNum; i++) {
+      if (angle >= (BFs[i] - half) && angle < (BFs[i] + half)) {
+        doa_index_ = i;
+        break;
+      }
+    }
+  }
 
-  std::cout << "SelectOneBF: doa " << doa_index_ << std::endl;
+  std::cout << "SelectOneBF: doa " << angle << ", beam " << doa_index_
+            << std::endl;
             // << " hotword " << hotword_index_ << std::endl;
 }
 
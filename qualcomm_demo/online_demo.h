@@ -6,12 +6,19 @@
 
 #include <time.h>
 
+#include <atomic>
 #include <string>
 #include <vector>
 
+#include "qualcomm_demo/speech_batcher.h"
 #include "third_party/mobvoisds/include/speech_sds.h"
 #include "utils/AudioPlayer.h"
+#include "utils/EchoReference.h"
+#include "utils/FrameMetaHistory.h"
+#include "utils/HistoryReplay.h"
 #include "utils/MobPipeline.h"
+#include "utils/PcmQueue.h"
+#include "utils/PromptCache.h"
 
 namespace mobvoi {
 namespace sds {
@@ -40,7 +47,8 @@ class SdsDemo {
 
   bool Run(int argc, char* argv[]);
 
-  static void SpeechCallback(void* inst, char* buffer, int length);
+  static void SpeechCallback(void* inst, const BeamFrame& frame,
+                             const FrameMeta& meta);
 
  private:
   bool ParseCmdArgs(int argc, char* argv[]);
@@ -63,6 +71,15 @@ class SdsDemo {
   void WaitOnStoppedFlag();
   void WaitOnFlag(bool* flag);
   bool PlayTtsAudio(const std::string& text);
+  bool SynthesizeTts(const std::string& text, PcmQueue* queue,
+                     std::vector<char>* pcm);
+  bool ReadTts(const std::string& text, PcmQueue* queue,
+               std::vector<char>* pcm);
+  static void* TtsProducer(void* inst);
+  bool PlayCachedAudio(const PromptPcm* pcm, int64_t begin_us);
+  bool StartPromptCache();
+  bool IsPrompt(const std::string& text) const;
+  static int SynthPrompt(void* inst, int index);
   std::string GetTtsText();
   std::string ParseTtsText(const std::string& result);
   void ClearResult();
@@ -70,7 +87,10 @@ class SdsDemo {
   void ShowUsage(const std::string& exe);
   void ShowPrompt();
 
-  bool FeedSpeech(const Buf& buf);
+  bool FeedSpeech(const BeamFrame& frame, const FrameMeta& meta);
+  static bool FeedHotword(void* inst, const BeamFrame& batch);
+  static bool FeedAsr(void* inst, const BeamFrame& batch);
+  static bool FeedReplay(void* inst, const BeamFrame& frame);
   void SetFinalTrans(const std::string& final_trans);
   void SetResult(const std::string& result);
   void SetErrorCode(int ec);
@@ -95,19 +115,66 @@ class SdsDemo {
   std::string     asr_type_;
   std::string     lang_             = "zh_cn";
   bool            solo_             = false;
+  // ASR hears a beam steered at the exact DOA instead of the nearest
+  // fixed beam.
+  bool            steer_            = false;
+  bool            steered_          = false;
+  // ASR first gets what was said since the hotword, re-beamformed from the
+  // raw history, then the live stream.
+  bool            retro_            = false;
+  unsigned int    hotword_frame_    = 0;
+  HistoryReplay*  replay_           = nullptr;
+  // The replay worker batches into its own batcher, the live frames go to
+  // asr_batcher_ once it handed over. Frames flagged as echo (our own
+  // greeting) are replayed as replay_silence_.
+  SpeechBatcher   replay_batcher_;
+  std::vector<short> replay_silence_;
+  unsigned int    replay_echo_frames_ = 0;
 
   int             doa_index_        = 0;
+  int             doa_angle_        = -1;
   int             hotword_index_    = 0;
+  // kOutNum beams with all but every kSubsetStride-th silenced, fed to the
+  // hotword under kQualityHotwordSubset.
+  std::vector<short> subset_beams_;
+  // Frames are fed to the services batch_frames_ at a time.
+  int             batch_frames_     = 1;
+  int             batch_latency_ms_ = 40;
+  SpeechBatcher   hotword_batcher_;
+  SpeechBatcher   asr_batcher_;
   MobPipeline*    dsp_              = nullptr;
+  FrameMetaHistory meta_history_;
   SpeechSDS*      sds_              = nullptr;
   Service*        hotword_          = nullptr;
   Service*        asr_              = nullptr;
   Service*        tts_              = nullptr;
   AudioPlayer*    audio_player_     = nullptr;
+  // TTS voice, part of the prompt cache key.
+  std::string     tts_language_;
+  std::string     tts_speaker_;
+  // The TTS service is shared with the prompt prewarm thread.
+  pthread_mutex_t tts_mutex_;
+  // Synthesis runs ahead of playback on a producer thread, through
+  // tts_queue_; the player starts once tts_prebuffer_ms_ are queued.
+  PcmQueue        tts_queue_;
+  int             tts_prebuffer_ms_;
+  std::string     tts_text_;
+  bool            tts_record_       = false;
+  bool            tts_ok_           = false;
+  // Fixed replies (greeting, errors) are played from prompt_cache_.
+  PromptCache     prompt_cache_;
+  std::vector<std::string> prompts_;
+  std::vector<char> tts_pcm_;
+  // What the player renders, the pipeline's echo reference. A hotword
+  // while TTS plays (barged_in_) cuts it off and opens the next dialog.
+  EchoReference   echo_ref_;
+  std::atomic<bool> playing_tts_{false};
+  std::atomic<bool> barged_in_{false};
 
   EventHandler*   event_handler_    = nullptr;
 
-  SpeechTarget    speech_target_;
+  // Read by the DSP thread and, through the replay, its worker.
+  std::atomic<SpeechTarget> speech_target_;
 
   pthread_mutex_t mutex_;
   pthread_cond_t  cond_;
@@ -0,0 +1,134 @@
+// Copyright 2019 Mobvoi Inc. All Rights Reserved.
+// Author: ljliu@mobvoi.com (Lijie Liu)
+
+#include "qualcomm_demo/speech_batcher.h"
+
+#include <stdio.h>
+#include <string.h>
+
+#include "utils/TimeUtils.h"
+
+namespace mobvoi {
+namespace sds {
+
+SpeechBatcher::SpeechBatcher(const char* name, FeedFunc feed, void* ctx,
+                             int max_channels, int max_samples)
+    : name_(name),
+      feed_(feed),
+      ctx_(ctx),
+      max_channels_(max_channels),
+      max_samples_(max_samples),
+      buffer_(max_channels * max_samples * kMaxBatchFrames) {
+  ResetStats();
+}
+
+void SpeechBatcher::Configure(int batch_frames, int max_latency_ms) {
+  Flush();
+  if (batch_frames < 1) {
+    batch_frames = 1;
+  } else if (batch_frames > kMaxBatchFrames) {
+    batch_frames = kMaxBatchFrames;
+  }
+  batch_frames_ = batch_frames;
+  max_latency_us_ = max_latency_ms * 1000LL;
+}
+
+bool SpeechBatcher::Push(const BeamFrame& frame) {
+  if (frame.channels() > max_channels_ || frame.samples() > max_samples_) {
+    return false;
+  }
+
+  if (frames_ > 0 && (frame.channels() != channels_ ||
+                      frame.samples() != frame_samples_)) {
+    if (!Flush()) {
+      return false;
+    }
+  }
+
+  if (frames_ == 0) {
+    channels_ = frame.channels();
+    frame_samples_ = frame.samples();
+    sample_rate_ = frame.sampleRate();
+    stride_ = batch_frames_ * frame_samples_;
+    first_index_ = frame.frameIndex();
+    first_us_ = monotonic_us();
+  }
+
+  int offset = frames_ * frame_samples_;
+  for (int i = 0; i < channels_; i++) {
+    memcpy(&buffer_[i * stride_ + offset], frame.channelData(i),
+           frame_samples_ * sizeof(short));
+  }
+  indices_[frames_] = frame.frameIndex();
+  frames_++;
+  stats_.frames++;
+
+  if (frames_ >= batch_frames_) {
+    return Flush();
+  }
+  return Poll();
+}
+
+bool SpeechBatcher::Poll() {
+  if (frames_ > 0 && monotonic_us() - first_us_ >= max_latency_us_) {
+    return Flush();
+  }
+  return true;
+}
+
+bool SpeechBatcher::Flush() {
+  if (frames_ == 0) {
+    return true;
+  }
+
+  int samples = frames_ * frame_samples_;
+  if (samples != stride_) {
+    // Cut short by the latency cap, close the gaps between channels.
+    for (int i = 1; i < channels_; i++) {
+      memmove(&buffer_[i * samples], &buffer_[i * stride_],
+              samples * sizeof(short));
+    }
+  }
+  BeamFrame batch(&buffer_[0], channels_, samples, samples, sample_rate_,
+                  first_index_);
+  fed_frames_ = frames_;
+  frames_ = 0;
+
+  int64_t begin = monotonic_us();
+  bool ret = feed_(ctx_, batch);
+  int64_t end = monotonic_us();
+
+  stats_.feeds++;
+  stats_.feed_us += end - begin;
+  if (end - begin > stats_.max_feed_us) {
+    stats_.max_feed_us = end - begin;
+  }
+  if (begin - first_us_ > stats_.max_delay_us) {
+    stats_.max_delay_us = begin - first_us_;
+  }
+  return ret;
+}
+
+void SpeechBatcher::Reset() {
+  frames_ = 0;
+}
+
+void SpeechBatcher::ResetStats() {
+  memset(&stats_, 0, sizeof(stats_));
+}
+
+void SpeechBatcher::DumpStats() const {
+  Stats s = stats_;
+  if (s.feeds == 0) {
+    return;
+  }
+  printf("[batch] %s: %lld frames in %lld feeds, feed avg %lld us max %lld "
+         "us, %lld us per frame, max delay %lld us\n",
+         name_, (long long)s.frames, (long long)s.feeds,
+         (long long)(s.feed_us / s.feeds), (long long)s.max_feed_us,
+         (long long)(s.feed_us / (s.frames ? s.frames : 1)),
+         (long long)s.max_delay_us);
+}
+
+}  // namespace sds
+}  // namespace mobvoi
@@ -0,0 +1,93 @@
+// Copyright 2019 Mobvoi Inc. All Rights Reserved.
+// Author: ljliu@mobvoi.com (Lijie Liu)
+
+#ifndef QUALCOMM_DEMO_SPEECH_BATCHER_H_
+#define QUALCOMM_DEMO_SPEECH_BATCHER_H_
+
+#include <stdint.h>
+
+#include <vector>
+
+#include "utils/FrameView.h"
+
+namespace mobvoi {
+namespace sds {
+
+// Upper bound for SpeechBatcher::Configure(), sizes the batch buffer.
+static const int kMaxBatchFrames = 10;
+
+// Collects consecutive planar frames into one preallocated block so a
+// service is fed once per batch instead of once per frame. The batch keeps
+// the planar layout: all samples of channel 0, then channel 1, ...
+class SpeechBatcher {
+ public:
+  // Hands one batch to the service; returning false is passed back to the
+  // caller of Push() / Flush().
+  typedef bool (*FeedFunc)(void* ctx, const BeamFrame& batch);
+
+  struct Stats {
+    int64_t frames;
+    int64_t feeds;
+    int64_t feed_us;       // time spent in FeedFunc
+    int64_t max_feed_us;
+    int64_t max_delay_us;  // oldest frame of a batch to its feed
+  };
+
+  // |max_samples| is the per channel capacity of one frame.
+  SpeechBatcher(const char* name, FeedFunc feed, void* ctx,
+                int max_channels, int max_samples);
+
+  // Feed every |batch_frames| frames, or earlier once the oldest pending
+  // frame is |max_latency_ms| old. 1 feeds every frame.
+  void Configure(int batch_frames, int max_latency_ms);
+
+  // Appends |frame|. A frame with another channel count or length first
+  // flushes what is pending.
+  bool Push(const BeamFrame& frame);
+  // Feeds what is pending once its oldest frame is past the latency cap.
+  // For callbacks that push nothing, so gaps in the pushes (gated or
+  // skipped frames) do not hold audio back beyond the cap.
+  bool Poll();
+  bool Flush();
+  // Drops pending audio, e.g. when the service stopped listening.
+  void Reset();
+  int pending_frames() const { return frames_; }
+  // Pipeline frame index of each frame in the batch being fed, for the
+  // FeedFunc: frames skipped between pushes leave gaps.
+  const unsigned int* fed_indices() const { return indices_; }
+  int fed_frames() const { return fed_frames_; }
+
+  Stats GetStats() const { return stats_; }
+  void ResetStats();
+  void DumpStats() const;
+
+ private:
+  const char* name_;
+  FeedFunc feed_;
+  void* ctx_;
+  int max_channels_;
+  int max_samples_;
+  int batch_frames_ = 1;
+  int64_t max_latency_us_ = 0;
+
+  std::vector<short> buffer_;
+  int channels_ = 0;
+  int frame_samples_ = 0;
+  int sample_rate_ = 0;
+  int stride_ = 0;
+  int frames_ = 0;
+  unsigned int first_index_ = 0;
+  unsigned int indices_[kMaxBatchFrames];
+  int fed_frames_ = 0;
+  int64_t first_us_ = 0;
+
+  Stats stats_;
+
+  SpeechBatcher(const SpeechBatcher&);
+  void operator=(const SpeechBatcher&);
+};
+
+}  // namespace sds
+}  // namespace mobvoi
+
+#endif  // QUALCOMM_DEMO_SPEECH_BATCHER_H_
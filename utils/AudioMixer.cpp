@@ -0,0 +1,435 @@
+//
+// Created by ljliu on 19-3-21.
+//
+
+#include "utils/AudioMixer.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define MIX_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define MIX_SSE2
+#endif
+
+#define LOG_TAG "AudioMixer"
+#include "utils/LogUtils.h"
+#include "utils/TimeUtils.h"
+
+// Gain of ramp step |block| of |blocks|, reaching |to| with the last one.
+static inline int ramp_gain(int from, int to, int block, int blocks) {
+  return from == to ? to : from + (to - from) * (block + 1) / blocks;
+}
+
+// The vector paths compute exactly this: (in * gain) >> 15, rounded down,
+// then a saturating add.
+static inline short mix_sample(short out, short in, int gain) {
+  int scaled = gain >= kMixUnity ? in : (in * gain) >> 15;
+  int sum = out + scaled;
+  return sum > 32767 ? 32767 : (sum < -32768 ? -32768 : sum);
+}
+
+/*static*/ void AudioMixer::mixQ15Scalar(short* out, const short* in,
+                                         int samples, int gainFrom,
+                                         int gainTo)
+{
+  int blocks = (samples + kMixRampStep - 1) / kMixRampStep;
+  for (int b = 0; b < blocks; b++) {
+    int gain = ramp_gain(gainFrom, gainTo, b, blocks);
+    int end = (b + 1) * kMixRampStep < samples ? (b + 1) * kMixRampStep
+                                               : samples;
+    for (int i = b * kMixRampStep; i < end; i++) {
+      out[i] = mix_sample(out[i], in[i], gain);
+    }
+  }
+}
+
+/*static*/ void AudioMixer::mixQ15(short* out, const short* in, int samples,
+                                   int gainFrom, int gainTo)
+{
+#if defined(MIX_NEON) || defined(MIX_SSE2)
+  // One vector of 8 samples per ramp step.
+  int blocks = (samples + kMixRampStep - 1) / kMixRampStep;
+  for (int b = 0; b < blocks; b++) {
+    int gain = ramp_gain(gainFrom, gainTo, b, blocks);
+    int i = b * kMixRampStep;
+    if (i + 8 > samples) {
+      for (; i < samples; i++) {
+        out[i] = mix_sample(out[i], in[i], gain);
+      }
+      break;
+    }
+#ifdef MIX_NEON
+    int16x8_t x = vld1q_s16(in + i);
+    if (gain < kMixUnity) {
+      // (2 * x * gain) >> 16, the same as (x * gain) >> 15.
+      x = vqdmulhq_s16(x, vdupq_n_s16((short)gain));
+    }
+    vst1q_s16(out + i, vqaddq_s16(vld1q_s16(out + i), x));
+#else
+    __m128i x = _mm_loadu_si128((const __m128i*)(in + i));
+    if (gain < kMixUnity) {
+      // Bits 15..30 of the 32 bit product.
+      __m128i g = _mm_set1_epi16((short)gain);
+      __m128i hi = _mm_mulhi_epi16(x, g);
+      __m128i lo = _mm_mullo_epi16(x, g);
+      x = _mm_or_si128(_mm_slli_epi16(hi, 1), _mm_srli_epi16(lo, 15));
+    }
+    __m128i o = _mm_loadu_si128((const __m128i*)(out + i));
+    _mm_storeu_si128((__m128i*)(out + i), _mm_adds_epi16(o, x));
+#endif
+  }
+#else
+  mixQ15Scalar(out, in, samples, gainFrom, gainTo);
+#endif
+}
+
+/*static*/ int AudioMixer::toQ15(float gain)
+{
+  if (gain <= 0) {
+    return 0;
+  }
+  if (gain >= 1) {
+    return kMixUnity;
+  }
+  return (int)(gain * kMixUnity + 0.5f);
+}
+
+AudioMixer::AudioMixer(AudioPlayer* player) :
+    mPlayer(player),
+    mRunning(false),
+    mOpenStreams(0),
+    mStarted(false)
+{
+  pthread_mutex_init(&mLock, NULL);
+  pthread_cond_init(&mCond, NULL);
+  int queueBytes = player->bytesPerSecond() / 1000 * kMixStreamMs;
+  for (int i = 0; i < kMaxMixStreams; i++) {
+    Stream& stream = mStreams[i];
+    stream.state = kStreamFree;
+    stream.serial = 0;
+    stream.queue = new PcmQueue(queueBytes);
+    stream.queue->setNotify(&mLock, &mCond);
+    stream.gain = kMixUnity;
+    stream.ducking = false;
+    stream.curGain = kMixUnity;
+  }
+  mScratch = new char[player->bufferSize()];
+  memset(&mStats, 0, sizeof(mStats));
+}
+
+AudioMixer::~AudioMixer()
+{
+  stop();
+  for (int i = 0; i < kMaxMixStreams; i++) {
+    delete mStreams[i].queue;
+  }
+  delete [] mScratch;
+  pthread_cond_destroy(&mCond);
+  pthread_mutex_destroy(&mLock);
+}
+
+int AudioMixer::start()
+{
+  if (mRunning) {
+    return 0;
+  }
+
+  mRunning = true;
+  if (pthread_create(&mThread, NULL, run, this) != 0) {
+    ALOGE("can not create mixer thread");
+    mRunning = false;
+    return -1;
+  }
+  return 0;
+}
+
+// Producers blocked on a full stream and the mixer blocked on the player
+// are both woken; open streams are dropped.
+int AudioMixer::stop()
+{
+  if (!mRunning) {
+    return 0;
+  }
+
+  pthread_mutex_lock(&mLock);
+  mRunning = false;
+  pthread_cond_broadcast(&mCond);
+  pthread_mutex_unlock(&mLock);
+  // Outside mLock, abort() broadcasts mCond under it.
+  for (int i = 0; i < kMaxMixStreams; i++) {
+    if (mStreams[i].state == kStreamOpen) {
+      mStreams[i].queue->abort();
+    }
+  }
+
+  // Ends a lease() waiting for the player.
+  mPlayer->stop();
+  pthread_join(mThread, NULL);
+
+  for (int i = 0; i < kMaxMixStreams; i++) {
+    if (mStreams[i].state == kStreamOpen) {
+      endStream(&mStreams[i]);
+    }
+  }
+  return 0;
+}
+
+int AudioMixer::openStream(float gain, bool ducking)
+{
+  pthread_mutex_lock(&mLock);
+  int id = -1;
+  for (int i = 0; i < kMaxMixStreams; i++) {
+    Stream& stream = mStreams[i];
+    if (stream.state != kStreamFree) {
+      continue;
+    }
+
+    stream.queue->reset();
+    stream.serial = (stream.serial + 1) & 0xffffff;
+    stream.gain = toQ15(gain);
+    stream.ducking = ducking;
+    // No fade in, the stream starts at its gain.
+    stream.curGain = stream.gain;
+    stream.state = kStreamOpen;
+    id = stream.serial * kMaxMixStreams + i;
+
+    mOpenStreams++;
+    mStats.streams++;
+    if (mOpenStreams > mStats.maxStreams) {
+      mStats.maxStreams = mOpenStreams;
+    }
+    pthread_cond_broadcast(&mCond);
+    break;
+  }
+  pthread_mutex_unlock(&mLock);
+
+  if (id < 0) {
+    ALOGW("all %d streams taken", kMaxMixStreams);
+  }
+  return id;
+}
+
+AudioMixer::Stream* AudioMixer::lookup(int id)
+{
+  if (id < 0) {
+    return NULL;
+  }
+  Stream* stream = &mStreams[id % kMaxMixStreams];
+  if (stream->state != kStreamOpen ||
+      stream->serial != (unsigned int)(id / kMaxMixStreams)) {
+    return NULL;
+  }
+  return stream;
+}
+
+PcmQueue* AudioMixer::queue(int id)
+{
+  Stream* stream = lookup(id);
+  return stream != NULL ? stream->queue : NULL;
+}
+
+void AudioMixer::setGain(int id, float gain)
+{
+  Stream* stream = lookup(id);
+  if (stream != NULL) {
+    stream->gain = toQ15(gain);
+  }
+}
+
+void AudioMixer::abortStream(int id)
+{
+  Stream* stream = lookup(id);
+  if (stream != NULL) {
+    stream->queue->abort();
+  }
+}
+
+int AudioMixer::waitStream(int id, int timeoutMs)
+{
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeoutMs / 1000;
+  deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+  deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+  deadline.tv_nsec %= 1000000000L;
+
+  int ret = 0;
+  pthread_mutex_lock(&mLock);
+  while (lookup(id) != NULL) {
+    if (pthread_cond_timedwait(&mCond, &mLock, &deadline) == ETIMEDOUT) {
+      ret = -1;
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mLock);
+  return ret;
+}
+
+void AudioMixer::endStream(Stream* stream)
+{
+  pthread_mutex_lock(&mLock);
+  stream->state = kStreamFree;
+  mOpenStreams--;
+  pthread_cond_broadcast(&mCond);
+  pthread_mutex_unlock(&mLock);
+}
+
+/*static*/ void* AudioMixer::run(void* arg)
+{
+  AudioMixer* mixer = (AudioMixer*)arg;
+  mixer->doLoop();
+  return NULL;
+}
+
+// The player only runs while there are streams: idle, a dry queue would
+// count as underruns and the echo reference would see silence played.
+void AudioMixer::doLoop()
+{
+  pthread_mutex_lock(&mLock);
+  while (mRunning) {
+    if (mOpenStreams == 0) {
+      pthread_cond_wait(&mCond, &mLock);
+      continue;
+    }
+    pthread_mutex_unlock(&mLock);
+
+    mPlayer->start();
+    mStarted = false;
+    while (mRunning && mixBuffer()) {
+    }
+    if (mRunning) {
+      mPlayer->drain(kMixDrainTimeoutMs);
+    }
+    mPlayer->stop();
+
+    pthread_mutex_lock(&mLock);
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+// One player buffer, leased as soon as the player has one free. Returns
+// false once no stream is open any more.
+bool AudioMixer::mixBuffer()
+{
+  char* buffer = NULL;
+  int capacity = mPlayer->lease(&buffer, true);
+  if (capacity <= 0) {
+    return false;
+  }
+  if (!mRunning) {
+    mPlayer->commit(buffer, 0);
+    return false;
+  }
+
+  int64_t begin = monotonic_us();
+  short* out = (short*)buffer;
+  memset(out, 0, capacity);
+
+  bool ducked = false;
+  for (int i = 0; i < kMaxMixStreams; i++) {
+    if (mStreams[i].state == kStreamOpen && mStreams[i].ducking) {
+      ducked = true;
+    }
+  }
+  int duckGain = toQ15(kDuckGain);
+
+  bool open = false;
+  int mixes = 0;
+  int starved = 0;
+  for (int i = 0; i < kMaxMixStreams; i++) {
+    Stream& stream = mStreams[i];
+    if (stream.state != kStreamOpen) {
+      continue;
+    }
+
+    int size = stream.queue->tryRead(mScratch, capacity);
+    if (size < 0) {
+      endStream(&stream);
+      continue;
+    }
+    open = true;
+    if (size == 0) {
+      starved++;
+      continue;
+    }
+
+    int gain = stream.gain;
+    if (ducked && !stream.ducking) {
+      gain = gain * duckGain >> 15;
+    }
+    mixQ15(out, (const short*)mScratch, size / sizeof(short),
+           stream.curGain, gain);
+    stream.curGain = gain;
+    mixes++;
+  }
+
+  if (mixes == 0 && !mStarted && starved > 0) {
+    // Nothing played yet: silence would only delay the first audio by a
+    // buffer. Wait for some instead, from whichever stream.
+    mPlayer->commit(buffer, 0);
+    waitReadable();
+    return true;
+  }
+
+  int64_t us = monotonic_us() - begin;
+  // Starved streams are filled up with silence, the buffer goes out whole.
+  mPlayer->commit(buffer, open ? capacity : 0);
+  mStarted = mStarted || open;
+
+  pthread_mutex_lock(&mLock);
+  if (open) {
+    mStats.buffers++;
+  }
+  mStats.streamMixes += mixes;
+  mStats.starved += starved;
+  mStats.mixUs += us;
+  if (us > mStats.maxMixUs) {
+    mStats.maxMixUs = us;
+  }
+  pthread_mutex_unlock(&mLock);
+  return open;
+}
+
+// Until an open stream has data or ended, or the mixer stops.
+void AudioMixer::waitReadable()
+{
+  pthread_mutex_lock(&mLock);
+  while (mRunning && mOpenStreams > 0) {
+    bool readable = false;
+    for (int i = 0; i < kMaxMixStreams && !readable; i++) {
+      readable = mStreams[i].state == kStreamOpen &&
+                 mStreams[i].queue->readable();
+    }
+    if (readable) {
+      break;
+    }
+    pthread_cond_wait(&mCond, &mLock);
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+void AudioMixer::getStats(MixerStats* stats)
+{
+  pthread_mutex_lock(&mLock);
+  *stats = mStats;
+  pthread_mutex_unlock(&mLock);
+}
+
+void AudioMixer::dumpStats()
+{
+  MixerStats stats;
+  getStats(&stats);
+  printf("[mixer] %u streams (%d at once), %u buffers, %.2f streams per "
+         "buffer, %u starved, mix avg %lld us worst %lld us\n",
+         stats.streams, stats.maxStreams, stats.buffers,
+         stats.buffers > 0 ? (double)stats.streamMixes / stats.buffers : 0.0,
+         stats.starved,
+         (long long)(stats.buffers > 0 ? stats.mixUs / stats.buffers : 0),
+         (long long)stats.maxMixUs);
+}
@@ -0,0 +1,123 @@
+//
+// Created by ljliu on 19-3-21.
+//
+
+#ifndef UTILS_AUDIOMIXER_H
+#define UTILS_AUDIOMIXER_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+
+#include "utils/AudioPlayer.h"
+#include "utils/PcmQueue.h"
+
+// Input streams mixed at the same time.
+#define kMaxMixStreams 4
+// Audio each stream can queue ahead of the mixer.
+#define kMixStreamMs 2000
+// Gain of the other streams while a ducking stream is open.
+#define kDuckGain 0.25f
+// Q15 gain of 1.0; below it samples are scaled, at it only added.
+#define kMixUnity 32768
+// Gain changes ramp in steps of this many samples over one buffer.
+#define kMixRampStep 8
+// Upper bound for the tail to play out once the last stream ended.
+#define kMixDrainTimeoutMs 2000
+
+struct MixerStats {
+    unsigned int streams;      // opened
+    int maxStreams;            // open at the same time
+    unsigned int buffers;      // committed to the player
+    unsigned int streamMixes;  // stream buffers mixed into those
+    // An open stream had nothing for a buffer, silence went out instead.
+    unsigned int starved;
+    int64_t mixUs;             // reading and mixing, per buffer
+    int64_t maxMixUs;
+};
+
+// Several PCM streams through one streaming AudioPlayer, e.g. an earcon
+// over TTS, instead of one OpenSL player per stream. Each stream is a
+// PcmQueue its producer fills; a mixer thread leases each player buffer as
+// it frees up, mixes whatever every open stream has into it (Q15 gain,
+// saturating int16 adds, NEON or SSE2 where built for it) and commits it.
+// Once playing, a gap in an open stream is filled with silence; once the
+// last one ended the player drains and stops until the next opens.
+//
+// All streams are in the player's format.
+class AudioMixer {
+public:
+    // |player| is a created streaming player; from now on the mixer starts
+    // and stops it.
+    explicit AudioMixer(AudioPlayer* player);
+    ~AudioMixer();
+
+    int start();
+    int stop();
+
+    // A new stream at |gain| (0 to 1). A |ducking| stream turns every other
+    // stream down to kDuckGain while it is open. Returns its id, -1 when
+    // all kMaxMixStreams are taken.
+    int openStream(float gain, bool ducking);
+    // Producer side of stream |id|; close() it at the end. NULL once the
+    // stream ended.
+    PcmQueue* queue(int id);
+    // Ramps to |gain| over the next buffer.
+    void setGain(int id, float gain);
+    // Drops what is left of stream |id|.
+    void abortStream(int id);
+    // Blocks until stream |id| has been handed to the player completely or
+    // dropped. Returns 0, or -1 on timeout.
+    int waitStream(int id, int timeoutMs);
+
+    // out += in * gain, saturated, the gain (Q15) ramping from |gainFrom|
+    // to |gainTo| in kMixRampStep steps. mixQ15() is the vector version
+    // where the build has NEON or SSE2; both give the same samples.
+    static void mixQ15(short* out, const short* in, int samples,
+                       int gainFrom, int gainTo);
+    static void mixQ15Scalar(short* out, const short* in, int samples,
+                             int gainFrom, int gainTo);
+    static int toQ15(float gain);
+
+    void getStats(MixerStats* stats);
+    void dumpStats();
+
+private:
+    enum StreamState {
+        kStreamFree,
+        kStreamOpen,
+    };
+
+    struct Stream {
+        std::atomic<int> state;
+        // Bumped per openStream(); part of the id, so stale ids miss.
+        unsigned int serial;
+        PcmQueue* queue;
+        std::atomic<int> gain;     // Q15 target
+        bool ducking;
+        int curGain;               // mixer thread
+    };
+
+    static void* run(void* arg);
+    void doLoop();
+    bool mixBuffer();
+    void waitReadable();
+    Stream* lookup(int id);
+    void endStream(Stream* stream);
+
+    AudioPlayer* mPlayer;
+    pthread_t mThread;
+    std::atomic<bool> mRunning;
+    pthread_mutex_t mLock;
+    // Also broadcast by the stream queues when data or an end arrives.
+    pthread_cond_t mCond;
+    Stream mStreams[kMaxMixStreams];
+    int mOpenStreams;
+    // Something was committed since the player started.
+    bool mStarted;
+    char* mScratch;
+    MixerStats mStats;
+};
+
+#endif // UTILS_AUDIOMIXER_H
@@ -3,13 +3,15 @@
 //
 
 #include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
 
 #include "AudioPlayer.h"
 
 #define LOG_TAG "AudioPlayer"
 #include "LogUtils.h"
-
-#define BUFFER_COUNT (3)
+#include "TimeUtils.h"
 
 AudioPlayer::AudioPlayer(PlayerType type) :
     mOutputMixObject(NULL),
@@ -17,24 +19,42 @@ AudioPlayer::AudioPlayer(PlayerType type) :
     mPlayerPlay(NULL),
     mPlayerVolume(NULL),
     mPlayerBufferQueue(NULL),
-    mWriteBufIndex(0),
-    mReadBufIndex(0),
-    mDataFull(0),
+    mWriteCount(0),
+    mReadCount(0),
+    mTargetDepth(kStartQueueDepth),
+    mCleanBuffers(0),
+    mStarved(false),
+    mStarvedUs(0),
+    mDraining(false),
+    mLastPlayedUs(0),
+    mEchoRef(NULL),
+    mRefNext(0),
+    mDeviceBuffer(NULL),
+    mDeviceSlotBytes(0),
+    mChannels(0),
+    mQueuedBytes(0),
+    mBytesPerSecond(0),
     mBuffer(NULL),
+    mBufferSize(0),
+    mLeased(NULL),
+    mStartUs(0),
     mCallback(NULL),
     mType(type)
 {
+  pthread_mutex_init(&mStatsLock, NULL);
+  resetStats();
 }
 
 AudioPlayer::~AudioPlayer()
 {
+  pthread_mutex_destroy(&mStatsLock);
 }
 
 int AudioPlayer::destoryAudioPlayer()
 {
-  if (mType == STREAMING) {
-    pthread_mutex_destroy(&mLock);
-    pthread_cond_destroy(&mCond);
+  if (mType == STREAMING && mBuffer != NULL) {
+    sem_destroy(&mSpaceSem);
+    sem_destroy(&mDrainSem);
   }
 
   // destroy buffer queue audio player object, and invalidate all associated interfaces
@@ -46,32 +66,31 @@ int AudioPlayer::destoryAudioPlayer()
     mPlayerVolume = NULL;
   }
 
-  // destroy output mix object, and invalidate all associated interfaces
-  if (mOutputMixObject != NULL) {
-    (*mOutputMixObject)->Destroy(mOutputMixObject);
-    mOutputMixObject = NULL;
-  }
+  // the output mix is shared, it goes away with the last NativeAudioBase
+  mOutputMixObject = NULL;
 
   if (mBuffer) {
     delete [] mBuffer;
+    mBuffer = NULL;
+  }
+  if (mDeviceBuffer) {
+    delete [] mDeviceBuffer;
+    mDeviceBuffer = NULL;
   }
 
   return 0;
 }
 
-int AudioPlayer::createStreamingAudioPlayer(unsigned sampleRate, unsigned channels, unsigned bufferSize)
+int AudioPlayer::createStreamingAudioPlayer(unsigned sampleRate, unsigned channels, unsigned bufferSize,
+                                            unsigned deviceRate)
 {
   SLresult result;
 
-  // create output mix
-  result = (*mEngineEngine)->CreateOutputMix(mEngineEngine, &mOutputMixObject, 0, NULL, NULL);
-  assert(SL_RESULT_SUCCESS == result);
-  (void)result;
-
-  // realize the output mix
-  result = (*mOutputMixObject)->Realize(mOutputMixObject, SL_BOOLEAN_FALSE);
-  assert(SL_RESULT_SUCCESS == result);
-  (void)result;
+  // the engine and output mix are shared, realized by the first user
+  mOutputMixObject = acquireOutputMix();
+  if (mOutputMixObject == NULL) {
+    return -1;
+  }
 
   // configure audio sink
   SLDataLocator_OutputMix loc_outmix = {SL_DATALOCATOR_OUTPUTMIX, mOutputMixObject};
@@ -82,13 +101,27 @@ int AudioPlayer::createStreamingAudioPlayer(unsigned sampleRate, unsigned channe
     ch = SL_SPEAKER_FRONT_LEFT | SL_SPEAKER_FRONT_RIGHT;
   }
 
-  SLuint32 sample = SL_SAMPLINGRATE_16;
-  if (sampleRate == 48000) {
+  if (deviceRate == 0) {
+    deviceRate = sampleRate;
+  }
+  SLuint32 sample = toSLSampleRate(deviceRate);
+  if (sample == 0) {
+    ALOGW("no OpenSL rate %u, playing at 48000", deviceRate);
+    deviceRate = 48000;
     sample = SL_SAMPLINGRATE_48;
   }
+  if (deviceRate != sampleRate) {
+    if (mResampler.init(sampleRate, deviceRate, channels) != 0) {
+      ALOGE("cannot convert %u to %u", sampleRate, deviceRate);
+      return -1;
+    }
+    unsigned frameBytes = channels * sizeof(short);
+    mDeviceSlotBytes = mResampler.maxOutFrames(bufferSize / frameBytes) * frameBytes;
+    mDeviceBuffer = new char[mDeviceSlotBytes * kMaxQueueBuffers];
+  }
 
   // configure audio source
-  SLDataLocator_AndroidSimpleBufferQueue loc_bufq = {SL_DATALOCATOR_ANDROIDSIMPLEBUFFERQUEUE, BUFFER_COUNT};
+  SLDataLocator_AndroidSimpleBufferQueue loc_bufq = {SL_DATALOCATOR_ANDROIDSIMPLEBUFFERQUEUE, kMaxQueueBuffers};
   SLDataFormat_PCM format_pcm = {SL_DATAFORMAT_PCM, (SLuint32)channels, sample,
     SL_PCMSAMPLEFORMAT_FIXED_16, SL_PCMSAMPLEFORMAT_FIXED_16,
     ch, SL_BYTEORDER_LITTLEENDIAN};
@@ -128,11 +161,13 @@ int AudioPlayer::createStreamingAudioPlayer(unsigned sampleRate, unsigned channe
   assert(SL_RESULT_SUCCESS == result);
   (void)result;
 
-  mBuffer = new char[bufferSize * BUFFER_COUNT];
+  mBuffer = new char[bufferSize * kMaxQueueBuffers];
   mBufferSize = bufferSize;
+  mBytesPerSecond = sampleRate * channels * sizeof(short);
+  mChannels = channels;
 
-  pthread_mutex_init(&mLock, NULL);
-  pthread_cond_init(&mCond, NULL);
+  sem_init(&mSpaceSem, 0, 0);
+  sem_init(&mDrainSem, 0, 0);
 
   return 0;
 }
@@ -141,15 +176,11 @@ int AudioPlayer::createUriAudioPlayer(const char* uri)
 {
   SLresult result;
 
-  // create output mix
-  result = (*mEngineEngine)->CreateOutputMix(mEngineEngine, &mOutputMixObject, 0, NULL, NULL);
-  assert(SL_RESULT_SUCCESS == result);
-  (void)result;
-
-  // realize the output mix
-  result = (*mOutputMixObject)->Realize(mOutputMixObject, SL_BOOLEAN_FALSE);
-  assert(SL_RESULT_SUCCESS == result);
-  (void)result;
+  // the engine and output mix are shared, realized by the first user
+  mOutputMixObject = acquireOutputMix();
+  if (mOutputMixObject == NULL) {
+    return -1;
+  }
 
   // configure audio sink
   SLDataLocator_OutputMix loc_outmix = {SL_DATALOCATOR_OUTPUTMIX, mOutputMixObject};
@@ -216,6 +247,19 @@ void AudioPlayer::doUriPlayerCallback(SLPlayItf caller, SLuint32 event)
 
 int AudioPlayer::start()
 {
+  if (mType == STREAMING) {
+    mStartUs = monotonic_us();
+    pthread_mutex_lock(&mStatsLock);
+    mStats.firstQueuedUs = 0;
+    mStats.firstPlayedUs = 0;
+    pthread_mutex_unlock(&mStatsLock);
+    mStarved = false;
+    mQueuedBytes = 0;
+    if (mDeviceBuffer != NULL) {
+      mResampler.reset();
+    }
+  }
+
   // set the player's state to playing
   SLresult result = (*mPlayerPlay)->SetPlayState(mPlayerPlay, SL_PLAYSTATE_PLAYING);
   if (SL_RESULT_SUCCESS != result) {
@@ -231,9 +275,39 @@ int AudioPlayer::stop()
   if (SL_RESULT_SUCCESS != result) {
     return -1;
   }
+
+  if (mType == STREAMING) {
+    // Whatever is still queued will not be played nor called back; the
+    // dry queue at the end of a stream is no underrun.
+    (*mPlayerBufferQueue)->Clear(mPlayerBufferQueue);
+    mReadCount.store(mWriteCount.load());
+    mRefNext.store(mWriteCount.load());
+    mStarved = false;
+    sem_post(&mSpaceSem);
+  }
   return 0;
 }
 
+// Called back for buffer |done|: the next queued one starts playing now.
+// A buffer queued while nothing played has no callback before it and was
+// published by commit() already. The slots stay valid until mReadCount
+// moves past them.
+void AudioPlayer::publishReference(unsigned int done, int64_t now)
+{
+  unsigned int next = done + 1;
+  if ((int)(mWriteCount.load() - next) <= 0 ||
+      (int)(mRefNext.load() - next) > 0) {
+    return;
+  }
+  EchoReference* ref = mEchoRef.load();
+  if (ref != NULL && mBytesPerSecond == kEchoRefRate * sizeof(short)) {
+    ref->publish((const short*)(mBuffer +
+                                mBufferSize * (next % kMaxQueueBuffers)),
+                 mSlotBytes[next % kMaxQueueBuffers] / sizeof(short), now);
+  }
+  mRefNext = next + 1;
+}
+
 // this callback handler is called every time a buffer finishes playing
 /*static*/ void AudioPlayer::bqPlayerCallback(SLAndroidSimpleBufferQueueItf bq, void *context)
 {
@@ -246,46 +320,135 @@ void AudioPlayer::doPlayerCallback(SLAndroidSimpleBufferQueueItf bq)
   assert(bq == mPlayerBufferQueue);
 
   // ALOGD("player callback");
-  pthread_mutex_lock(&mLock);
-  if (mDataFull) {
-    mDataFull = 0;
-    pthread_cond_signal(&mCond);
-  }
-  mReadBufIndex++;
-  mReadBufIndex %= BUFFER_COUNT;
-  pthread_mutex_unlock(&mLock);
+  int64_t now = monotonic_us();
+  SLAndroidSimpleBufferQueueState state;
+  bool empty = (*bq)->GetState(bq, &state) == SL_RESULT_SUCCESS
+      ? state.count == 0
+      : mWriteCount.load() - mReadCount.load() <= 1;
+
+  pthread_mutex_lock(&mStatsLock);
+  mStats.buffersPlayed++;
+  if (mStats.firstPlayedUs == 0) {
+    mStats.firstPlayedUs = now - mStartUs;
+  }
+  if (empty) {
+    // Only an underrun if more audio follows, see commit().
+    mStarvedUs = now;
+    mStarved = true;
+  } else if (++mCleanBuffers >= kShrinkAfterBuffers) {
+    int depth = mTargetDepth.load();
+    if (depth > kMinQueueDepth) {
+      mTargetDepth = depth - 1;
+      if (depth - 1 < mStats.minDepth) {
+        mStats.minDepth = depth - 1;
+      }
+    }
+    mCleanBuffers = 0;
+  }
+  pthread_mutex_unlock(&mStatsLock);
+
+  // A stop() racing with this callback catches mReadCount up to
+  // mWriteCount; moving it on from there would count a buffer twice, so
+  // it only moves if stop() did not.
+  unsigned int done = mReadCount.load();
+  if (done != mWriteCount.load()) {
+    publishReference(done, now);
+    mReadCount.compare_exchange_strong(done, done + 1);
+  }
+  mLastPlayedUs = now;
+  sem_post(&mSpaceSem);
+  if (mDraining && mReadCount.load() == mWriteCount.load()) {
+    sem_post(&mDrainSem);
+  }
 }
 
-int AudioPlayer::obtainBuffer(char** buffer, bool blocked)
+int AudioPlayer::lease(char** buffer, bool blocked)
 {
-  pthread_mutex_lock(&mLock);
-
-  while (mDataFull) {
+  assert(mLeased == NULL);
+  unsigned int write = mWriteCount.load();
+  while ((int)(write - mReadCount.load()) >= mTargetDepth.load()) {
     if (!blocked) {
       ALOGD("no buffer");
-      pthread_mutex_unlock(&mLock);
       return 0;
     }
-    // ALOGE("buffer full wait");
-    pthread_cond_wait(&mCond, &mLock);
+    // Posts pile up while nobody waits, so this may return early; the
+    // counters decide.
+    sem_wait(&mSpaceSem);
   }
 
-  *buffer = mBuffer + mBufferSize * mWriteBufIndex;
-  mWriteBufIndex++;
-  mWriteBufIndex %= BUFFER_COUNT;
+  *buffer = mBuffer + mBufferSize * (write % kMaxQueueBuffers);
+  mLeased = *buffer;
+  return mBufferSize;
+}
 
-  if (mWriteBufIndex == mReadBufIndex) {
-    mDataFull = 1;
+int AudioPlayer::commit(char* buffer, int sizeBytes)
+{
+  assert(buffer == mLeased);
+  assert(sizeBytes >= 0 && sizeBytes <= (int)mBufferSize);
+  mLeased = NULL;
+
+  if (sizeBytes == 0) {
+    // Nothing to play; the slot only counts once committed.
+    return 0;
   }
 
-  pthread_mutex_unlock(&mLock);
+  // What OpenSL gets: the slot itself, or its converted device slot.
+  char* queued = buffer;
+  int queuedBytes = sizeBytes;
+  if (mDeviceBuffer != NULL) {
+    unsigned frameBytes = mChannels * sizeof(short);
+    queued = mDeviceBuffer + mDeviceSlotBytes * (mWriteCount.load() % kMaxQueueBuffers);
+    queuedBytes = mResampler.process((const short*)buffer, sizeBytes / frameBytes,
+                                     (short*)queued) * frameBytes;
+    if (queuedBytes == 0) {
+      // Too short to complete an output frame; it is in the filter history.
+      return 0;
+    }
+  }
 
-  return mBufferSize;
-}
+  int64_t now = monotonic_us();
+  bool underrun = mStarved.exchange(false);
+  pthread_mutex_lock(&mStatsLock);
+  if (underrun) {
+    // The queue had run dry and the stream went on: a gap was heard.
+    // Buffer a little more from now on.
+    mStats.underruns++;
+    mStats.underrunUs += now - mStarvedUs.load();
+    int depth = mTargetDepth.load();
+    if (depth < kMaxQueueBuffers) {
+      mTargetDepth = depth + 1;
+      if (depth + 1 > mStats.maxDepth) {
+        mStats.maxDepth = depth + 1;
+      }
+    }
+    mCleanBuffers = 0;
+  }
+  if (mStats.firstQueuedUs == 0) {
+    mStats.firstQueuedUs = now - mStartUs;
+  }
+  mStats.buffersQueued++;
+  pthread_mutex_unlock(&mStatsLock);
+  if (underrun) {
+    ALOGD("underrun, target depth %d", mTargetDepth.load());
+  }
 
-int AudioPlayer::releaseBuffer(char* buffer, int sizeBytes)
-{
-  SLresult result = (*mPlayerBufferQueue)->Enqueue(mPlayerBufferQueue, buffer, sizeBytes);
+  // Nothing playing: this buffer starts as soon as it is queued and no
+  // callback will announce it, so its reference goes out now, before the
+  // callback can look at the slot.
+  unsigned int write = mWriteCount.load();
+  if (mReadCount.load() == write) {
+    EchoReference* ref = mEchoRef.load();
+    if (ref != NULL && mBytesPerSecond == kEchoRefRate * sizeof(short)) {
+      ref->publish((const short*)buffer, sizeBytes / sizeof(short), now);
+    }
+    mRefNext = write + 1;
+  }
+
+  // Counted before Enqueue(), the callback may come right away.
+  mQueuedBytes += sizeBytes;
+  mSlotBytes[write % kMaxQueueBuffers] = sizeBytes;
+  mWriteCount++;
+  SLresult result = (*mPlayerBufferQueue)->Enqueue(mPlayerBufferQueue, queued, queuedBytes);
   assert(SL_RESULT_SUCCESS == result);
   (void)result;
   return 0;
@@ -296,7 +459,7 @@ int AudioPlayer::write(char* buffer, int sizeBytes, bool blocked)
   int size = sizeBytes;
   while(size > 0) {
     char* bufTemp;
-    int bufSize = obtainBuffer(&bufTemp, blocked);
+    int bufSize = lease(&bufTemp, blocked);
     if (bufSize <= 0) {
       ALOGD("write() no buffer");
       break;
@@ -307,10 +470,99 @@ int AudioPlayer::write(char* buffer, int sizeBytes, bool blocked)
     memcpy(bufTemp, buffer, bytesToCopy);
 
     // ALOGD("enqueue buffer %p, %d", bufTemp, bytesToCopy);
-    releaseBuffer(bufTemp, bytesToCopy);
+    commit(bufTemp, bytesToCopy);
 
     size -= bytesToCopy;
     buffer += bytesToCopy;
   }
   return (sizeBytes - size);
 }
+
+int AudioPlayer::drain(int timeoutMs)
+{
+  if (mType != STREAMING || mBuffer == NULL) {
+    return -1;
+  }
+
+  struct timespec deadline;
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  deadline.tv_sec += timeoutMs / 1000;
+  deadline.tv_nsec += (timeoutMs % 1000) * 1000000L;
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec++;
+    deadline.tv_nsec -= 1000000000L;
+  }
+
+  // Set before looking at the counters; the callback checks the flag
+  // after moving them, so one of the two sees the queue empty.
+  mDraining = true;
+  int ret = 0;
+  while (mReadCount.load() != mWriteCount.load()) {
+    if (sem_timedwait(&mDrainSem, &deadline) != 0 && errno == ETIMEDOUT) {
+      ret = -1;
+      break;
+    }
+  }
+  mDraining = false;
+  // Drop a post that came after the last check.
+  while (sem_trywait(&mDrainSem) == 0) {
+  }
+
+  if (ret != 0) {
+    pthread_mutex_lock(&mStatsLock);
+    mStats.drainTimeouts++;
+    pthread_mutex_unlock(&mStatsLock);
+    ALOGW("drain timed out after %d ms, %u buffers left", timeoutMs,
+          mWriteCount.load() - mReadCount.load());
+    return -1;
+  }
+
+  pthread_mutex_lock(&mStatsLock);
+  mStats.drains++;
+  if (mStats.firstQueuedUs > 0 && mBytesPerSecond > 0) {
+    int64_t audioUs = mQueuedBytes * 1000000LL / mBytesPerSecond;
+    int64_t playedUs = mLastPlayedUs.load() - mStartUs - mStats.firstQueuedUs;
+    mStats.lastAudioUs = audioUs;
+    mStats.lastLateUs = playedUs - audioUs;
+    if (mStats.lastLateUs > mStats.maxLateUs) {
+      mStats.maxLateUs = mStats.lastLateUs;
+    }
+  }
+  pthread_mutex_unlock(&mStatsLock);
+  return 0;
+}
+
+void AudioPlayer::getStats(PlayerStats* stats) const
+{
+  pthread_mutex_lock(&mStatsLock);
+  *stats = mStats;
+  pthread_mutex_unlock(&mStatsLock);
+  stats->targetDepth = mTargetDepth.load();
+}
+
+void AudioPlayer::resetStats()
+{
+  pthread_mutex_lock(&mStatsLock);
+  memset(&mStats, 0, sizeof(mStats));
+  mStats.minDepth = mTargetDepth.load();
+  mStats.maxDepth = mTargetDepth.load();
+  pthread_mutex_unlock(&mStatsLock);
+}
+
+void AudioPlayer::dumpStats() const
+{
+  PlayerStats stats;
+  getStats(&stats);
+  printf("[player] %u queued, %u played, %u underruns (%lld ms), depth %d "
+         "(%d..%d), first audio queued %lld us, played %lld us\n",
+         stats.buffersQueued, stats.buffersPlayed, stats.underruns,
+         (long long)(stats.underrunUs / 1000), stats.targetDepth,
+         stats.minDepth, stats.maxDepth, (long long)stats.firstQueuedUs,
+         (long long)stats.firstPlayedUs);
+  printf("[player] %u drains (%u timed out), last %lld ms of audio done "
+         "%lld ms late, worst %lld ms\n",
+         stats.drains, stats.drainTimeouts,
+         (long long)(stats.lastAudioUs / 1000),
+         (long long)(stats.lastLateUs / 1000),
+         (long long)(stats.maxLateUs / 1000));
+}
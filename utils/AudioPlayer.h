@@ -6,8 +6,23 @@
 #define UTILS_AUDIOPLAYER_H
 
 #include <pthread.h>
+#include <semaphore.h>
+#include <stdint.h>
 
+#include <atomic>
+
+#include "utils/EchoReference.h"
 #include "utils/NativeAudioBase.h"
+#include "utils/Resampler.h"
+
+// Streaming player queue: up to kMaxQueueBuffers buffers of bufferSize are
+// handed to OpenSL. How many may be in flight (the target depth) adapts:
+// an underrun raises it by one, kShrinkAfterBuffers clean buffers in a row
+// lower it again, within [kMinQueueDepth, kMaxQueueBuffers].
+#define kMaxQueueBuffers 8
+#define kMinQueueDepth 2
+#define kStartQueueDepth 3
+#define kShrinkAfterBuffers 64
 
 enum PlayerType
 {
@@ -22,6 +37,30 @@ enum PlayerEvent
 
 typedef void (*PlayerCallbackFunc) (int evnet);
 
+// Streaming player counters since the last resetStats().
+struct PlayerStats {
+    unsigned int buffersQueued;
+    unsigned int buffersPlayed;
+    // The queue ran dry while more audio was still to come, and for how
+    // long in total.
+    unsigned int underruns;
+    int64_t underrunUs;
+    int targetDepth;
+    int minDepth;              // lowest / highest target depth reached
+    int maxDepth;
+    // Time to first audio of the last start(): until the first buffer was
+    // enqueued, and until it had played out.
+    int64_t firstQueuedUs;
+    int64_t firstPlayedUs;
+    // drain(): the last one's audio length and how much longer than that
+    // it took from the first enqueue to the last buffer coming back.
+    unsigned int drains;
+    unsigned int drainTimeouts;
+    int64_t lastAudioUs;
+    int64_t lastLateUs;
+    int64_t maxLateUs;
+};
+
 class AudioPlayer : public NativeAudioBase
 {
 public:
@@ -29,7 +68,12 @@ public:
     AudioPlayer(PlayerType type);
     ~AudioPlayer();
 
-    int createStreamingAudioPlayer(unsigned sampleRate, unsigned channels, unsigned bufferSize);
+    // Buffers are written at |sampleRate|. The sink is opened at
+    // |deviceRate| (0: the same), or at 48000 when OpenSL has no constant
+    // for it; a different rate is converted here with a Resampler on
+    // commit(), not by the platform.
+    int createStreamingAudioPlayer(unsigned sampleRate, unsigned channels, unsigned bufferSize,
+                                   unsigned deviceRate = 0);
     int createUriAudioPlayer(const char* uri);
 
     void setPlayerCallback(PlayerCallbackFunc func) {
@@ -42,15 +86,44 @@ public:
     int stop();
     int setVolume(int volume);
 
+    // Streaming player: blocks until every committed buffer has been played
+    // (handed back by OpenSL) or |timeoutMs| passes. Event driven, no
+    // polling. Returns 0 when drained, -1 on timeout. Call before stop()
+    // so the tail is not cut.
+    int drain(int timeoutMs);
+
     int write(char* buffer, int sizeBytes, bool blocked = false);
 
+    // Zero-copy writing for the streaming player. lease() hands out the next
+    // free queue buffer to be filled in place and returns its size in bytes
+    // (bufferSize()), or 0 when none is free and |blocked| is false.
+    // commit() enqueues the first |sizeBytes| of it; a partly filled buffer
+    // is fine, 0 gives it back unplayed. One lease at a time.
+    int lease(char** buffer, bool blocked = false);
+    int commit(char* buffer, int sizeBytes);
+    unsigned bufferSize() const {
+        return mBufferSize;
+    }
+    unsigned bytesPerSecond() const {
+        return mBytesPerSecond;
+    }
+
+    // Streaming player: publish every buffer to |ref| as it starts to play,
+    // for echo cancellation. Only a 16k mono player; NULL stops it.
+    void setEchoReference(EchoReference* ref) {
+        mEchoRef = ref;
+    }
+
+    void getStats(PlayerStats* stats) const;
+    void resetStats();
+    void dumpStats() const;
+
 private:
 
     // For streaming player
-    int obtainBuffer(char** buffer, bool blocked = false);
-    int releaseBuffer(char* buffer, int sizeBytes);
     static void bqPlayerCallback(SLAndroidSimpleBufferQueueItf bq, void *context);
     void doPlayerCallback(SLAndroidSimpleBufferQueueItf bq);
+    void publishReference(unsigned int done, int64_t now);
 
     // For uri player
     static void uriPlayerCallback(SLPlayItf caller, void *pContext, SLuint32 event);
@@ -61,15 +134,44 @@ private:
     SLPlayItf mPlayerPlay;
     SLVolumeItf mPlayerVolume;
 
-    // For streaming player
+    // For streaming player. Single producer (lease/commit), single consumer
+    // (the OpenSL callback): buffers are used in order, slot n % count, and
+    // the two counters alone tell which are free. The callback posts
+    // mSpaceSem for every buffer it gets back.
     SLAndroidSimpleBufferQueueItf mPlayerBufferQueue;
-    int mWriteBufIndex;
-    int mReadBufIndex;
-    int mDataFull;
+    std::atomic<unsigned int> mWriteCount;
+    std::atomic<unsigned int> mReadCount;
+    std::atomic<int> mTargetDepth;
+    std::atomic<int> mCleanBuffers;
+    std::atomic<bool> mStarved;
+    std::atomic<int64_t> mStarvedUs;
+    sem_t mSpaceSem;
+    // drain() waits on mDrainSem, posted when the last buffer comes back
+    // while mDraining is set.
+    sem_t mDrainSem;
+    std::atomic<bool> mDraining;
+    std::atomic<int64_t> mLastPlayedUs;
+    // Bytes committed to each queue buffer, and the next buffer (count)
+    // to publish to mEchoRef: by the callback as the one before it comes
+    // back, or by commit() when nothing was playing.
+    int mSlotBytes[kMaxQueueBuffers];
+    std::atomic<EchoReference*> mEchoRef;
+    std::atomic<unsigned int> mRefNext;
+    // The sink rate differs: commit() converts slot n into device slot n,
+    // which is what gets enqueued.
+    Resampler mResampler;
+    char* mDeviceBuffer;
+    unsigned mDeviceSlotBytes;
+    unsigned mChannels;
+    int64_t mQueuedBytes;
+    unsigned mBytesPerSecond;
     char* mBuffer;
     unsigned mBufferSize;
-    pthread_mutex_t mLock;
-    pthread_cond_t mCond;
+    char* mLeased;
+    int64_t mStartUs;
+    // Written by the callback and the producer, read by getStats().
+    mutable pthread_mutex_t mStatsLock;
+    PlayerStats mStats;
 
     // For uri player
     PlayerCallbackFunc mCallback;
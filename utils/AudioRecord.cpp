@@ -11,18 +11,30 @@
 
 #include <errno.h>
 #include <stdio.h>
+#include <time.h>
 
 #include "utils/AudioRecord.h"
+#include "utils/TimeUtils.h"
 
 #define LOG_TAG "AudioRecord"
 
 #include "utils/LogUtils.h"
 
 #define BUFFER_COUNT (8)
+// Longest a blocked obtainBuffer() sleeps before rechecking.
+#define WAIT_TIMEOUT_MS (100)
 
-AudioRecord::AudioRecord(int sampleRate, int channel, int bufferSize) {
+// The recorder always captures stereo.
+#define DEVICE_CHANNELS (2)
+
+AudioRecord::AudioRecord(int sampleRate, int channel, int bufferSize, int deviceRate) {
     SLresult result;
 
+    // realize the shared engine, if no one did yet
+    int ret = acquireEngine();
+    assert(ret == 0);
+    (void)ret;
+
     // configure audio source
     SLDataLocator_IODevice loc_dev = {
         SL_DATALOCATOR_IODEVICE,
@@ -31,9 +43,35 @@ AudioRecord::AudioRecord(int sampleRate, int channel, int bufferSize) {
         NULL};
     SLDataSource audioSrc = {&loc_dev, NULL};
 
-    SLuint32 sample = SL_SAMPLINGRATE_16;
-    if (sampleRate == 48000) {
-        sample = SL_SAMPLINGRATE_48;
+    if (deviceRate == 0) {
+        deviceRate = sampleRate;
+    }
+    if (toSLSampleRate(deviceRate) == 0) {
+        ALOGW("no OpenSL rate %d, recording at 48000", deviceRate);
+        deviceRate = 48000;
+    }
+    mDeviceBuffer = NULL;
+    mDeviceBufferSize = 0;
+    if (deviceRate != sampleRate) {
+        int frameBytes = DEVICE_CHANNELS * sizeof(short);
+        int frames = bufferSize / frameBytes;
+        // Whole device buffers only, so every callback fills exactly one
+        // client buffer.
+        if ((int64_t)frames * deviceRate % sampleRate != 0 ||
+            mResampler.init(deviceRate, sampleRate, DEVICE_CHANNELS) != 0) {
+            ALOGE("%d frames cannot be converted from %d to %d", frames,
+                  deviceRate, sampleRate);
+            deviceRate = sampleRate;
+        } else {
+            mDeviceBufferSize = (int)((int64_t)frames * deviceRate / sampleRate) *
+                                frameBytes;
+            mDeviceBuffer = new char[mDeviceBufferSize * BUFFER_COUNT];
+        }
+    }
+    SLuint32 sample = toSLSampleRate(deviceRate);
+    if (sample == 0) {
+        ALOGW("no OpenSL rate %d, recording at 16000", deviceRate);
+        sample = SL_SAMPLINGRATE_16;
     }
 
     // configure audio sink
@@ -87,9 +125,13 @@ AudioRecord::AudioRecord(int sampleRate, int channel, int bufferSize) {
     assert(SL_RESULT_SUCCESS == result);
 
     mBuffer = new char[bufferSize * BUFFER_COUNT];
+    mBufferUs = new int64_t[BUFFER_COUNT]();
     mSampleRate = sampleRate;
     mChannels = channel;
     mBufferSize = bufferSize;
+    mDataCallback = NULL;
+    mDataContext = NULL;
+    mInterrupted = 0;
     pthread_mutex_init(&mLock, NULL);
     pthread_cond_init(&mCond, NULL);
 }
@@ -106,6 +148,10 @@ AudioRecord::~AudioRecord() {
     if (mBuffer != NULL) {
         delete [] mBuffer;
     }
+    if (mDeviceBuffer != NULL) {
+        delete [] mDeviceBuffer;
+    }
+    delete [] mBufferUs;
 
     pthread_mutex_destroy(&mLock);
     pthread_cond_destroy(&mCond);
@@ -123,6 +169,17 @@ void AudioRecord::bqRecorderCallback(SLAndroidSimpleBufferQueueItf bq,
 
 void AudioRecord::doRecorderCallback(SLAndroidSimpleBufferQueueItf bq) {
     assert(bq == mRecorderBufferQueue);
+    // Before the conversion, which is ours and not the capture's.
+    int64_t nowUs = monotonic_us();
+
+    if (mDeviceBuffer != NULL) {
+        // Slot mWroteBufIndex is ours until the index moves on.
+        int frameBytes = DEVICE_CHANNELS * sizeof(short);
+        mResampler.process(
+            (const short*)(mDeviceBuffer + mDeviceBufferSize * mWroteBufIndex),
+            mDeviceBufferSize / frameBytes,
+            (short*)(mBuffer + mBufferSize * mWroteBufIndex));
+    }
 
     pthread_mutex_lock(&mLock);
 
@@ -131,6 +188,7 @@ void AudioRecord::doRecorderCallback(SLAndroidSimpleBufferQueueItf bq) {
         pthread_cond_signal(&mCond);
     }
 
+    mBufferUs[mWroteBufIndex] = nowUs;
     mWroteBufIndex++;
     mWroteBufIndex %= BUFFER_COUNT;
 
@@ -138,7 +196,13 @@ void AudioRecord::doRecorderCallback(SLAndroidSimpleBufferQueueItf bq) {
         ALOGD("full audio data DSP");
         mDataFull = 1;
     }
+    record_callback callback = mDataCallback;
+    void* context = mDataContext;
     pthread_mutex_unlock(&mLock);
+
+    if (callback != NULL) {
+        callback(context);
+    }
     /*
     SLresult result =
         (*mRecorderBufferQueue)->Enqueue(mRecorderBufferQueue,
@@ -150,9 +214,15 @@ void AudioRecord::doRecorderCallback(SLAndroidSimpleBufferQueueItf bq) {
 
 // set the recording state for the audio recorder
 int AudioRecord::startRecording() {
+    pthread_mutex_lock(&mLock);
     mWroteBufIndex = 0;
     mReadBufIndex = 0;
     mDataFull = 0;
+    mInterrupted = 0;
+    pthread_mutex_unlock(&mLock);
+    if (mDeviceBuffer != NULL) {
+        mResampler.reset();
+    }
 
     SLresult result;
 
@@ -168,9 +238,15 @@ int AudioRecord::startRecording() {
     // enqueue an empty buffer to be filled by the recorder
 
     for (int i = 0; i < BUFFER_COUNT; i++) {
+        char* buffer = mBuffer + mBufferSize * i;
+        int size = mBufferSize;
+        if (mDeviceBuffer != NULL) {
+            buffer = mDeviceBuffer + mDeviceBufferSize * i;
+            size = mDeviceBufferSize;
+        }
         result = (*mRecorderBufferQueue)->Enqueue(mRecorderBufferQueue,
-                                                  mBuffer + mBufferSize * i,
-                                                  mBufferSize);
+                                                  buffer,
+                                                  size);
         // the most likely other result is SL_RESULT_BUFFER_INSUFFICIENT,
         // which for this code example would indicate a programming error
         assert(SL_RESULT_SUCCESS == result);
@@ -200,18 +276,38 @@ int AudioRecord::stop() {
     return 0;
 }
 
-int AudioRecord::obtainBuffer(char** buffer, bool blocked)
+void AudioRecord::setDataCallback(record_callback callback, void* context)
+{
+    pthread_mutex_lock(&mLock);
+    mDataCallback = callback;
+    mDataContext = context;
+    pthread_mutex_unlock(&mLock);
+}
+
+int AudioRecord::obtainBuffer(char** buffer, bool blocked, int64_t* captureUs)
 {
     pthread_mutex_lock(&mLock);
 
     while (mReadBufIndex == mWroteBufIndex && !mDataFull) {
+        if (mInterrupted) {
+            pthread_mutex_unlock(&mLock);
+            return -1;
+        }
         if (!blocked) {
             //ALOGD("buffer empty");
             pthread_mutex_unlock(&mLock);
             return 0;
         }
         //ALOGE("no data wait");
-        pthread_cond_wait(&mCond, &mLock);
+        struct timespec ts;
+        clock_gettime(CLOCK_REALTIME, &ts);
+        ts.tv_nsec += WAIT_TIMEOUT_MS * 1000000L;
+        ts.tv_sec += ts.tv_nsec / 1000000000L;
+        ts.tv_nsec %= 1000000000L;
+        if (pthread_cond_timedwait(&mCond, &mLock, &ts) == ETIMEDOUT) {
+            pthread_mutex_unlock(&mLock);
+            return 0;
+        }
     }
 
     if (mDataFull) {
@@ -219,6 +315,9 @@ int AudioRecord::obtainBuffer(char** buffer, bool blocked)
     }
 
     *buffer = mBuffer + mBufferSize * mReadBufIndex;
+    if (captureUs != NULL) {
+        *captureUs = mBufferUs[mReadBufIndex];
+    }
     //ALOGE("has data %p", *buffer);
     mReadBufIndex++;
     mReadBufIndex %= BUFFER_COUNT;
@@ -228,11 +327,25 @@ int AudioRecord::obtainBuffer(char** buffer, bool blocked)
     return mBufferSize;
 }
 
+void AudioRecord::interrupt()
+{
+    pthread_mutex_lock(&mLock);
+    mInterrupted = 1;
+    pthread_cond_broadcast(&mCond);
+    pthread_mutex_unlock(&mLock);
+}
+
 int AudioRecord::releaseBuffer(char* buffer)
 {
+    int size = mBufferSize;
+    if (mDeviceBuffer != NULL) {
+        // Hand back the device slot behind it; slots go round in order.
+        buffer = mDeviceBuffer + mDeviceBufferSize * ((buffer - mBuffer) / mBufferSize);
+        size = mDeviceBufferSize;
+    }
     SLresult result = (*mRecorderBufferQueue)->Enqueue(mRecorderBufferQueue,
                                                        buffer,
-                                                       mBufferSize);
+                                                       size);
     assert(SL_RESULT_SUCCESS == result);
     return 0;
 }
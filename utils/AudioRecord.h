@@ -6,23 +6,44 @@
 #define UTILS_AUDIORECORD_H
 
 #include <pthread.h>
+#include <stdint.h>
 
 #include <SLES/OpenSLES.h>
 #include <SLES/OpenSLES_Android.h>
 
 #include "utils/NativeAudioBase.h"
+#include "utils/Resampler.h"
+
+// Invoked on the OpenSL callback thread each time a buffer is filled.
+typedef void (*record_callback)(void* context);
 
 class AudioRecord : public NativeAudioBase {
 
 public:
-    AudioRecord(int sampleRate, int channel, int bufferSize);
+    // Buffers come out at |sampleRate|. The device records at |deviceRate|
+    // (0: the same), or at 48000 when OpenSL has no constant for it; a
+    // different rate is converted in the callback. That needs the frames
+    // per buffer to be a multiple of sampleRate / gcd(sampleRate,
+    // deviceRate), otherwise the device is left at |sampleRate|.
+    AudioRecord(int sampleRate, int channel, int bufferSize, int deviceRate = 0);
     ~AudioRecord();
 
     int startRecording();
     int stop();
-    int obtainBuffer(char ** buffer, bool blocked = false);
+    // Returns the buffer size, 0 if nothing is ready (or a blocking wait
+    // timed out), or -1 once interrupt() was called and no data is left.
+    // |captureUs|, if given, gets monotonic_us() of when OpenSL handed the
+    // buffer over, i.e. about the end of the span it holds, however long it
+    // then waited for the consumer.
+    int obtainBuffer(char ** buffer, bool blocked = false,
+                     int64_t* captureUs = NULL);
     int releaseBuffer(char* buffer);
 
+    // Wake a consumer blocked in obtainBuffer(); cleared by startRecording().
+    void interrupt();
+
+    void setDataCallback(record_callback callback, void* context);
+
 private:
     static void bqRecorderCallback(SLAndroidSimpleBufferQueueItf bq, void *context);
     void doRecorderCallback(SLAndroidSimpleBufferQueueItf bq);
@@ -31,14 +52,26 @@ private:
     int mChannels;
     int mBufferSize;
     char* mBuffer;
+    // Set when converting: OpenSL fills device slot n, the callback
+    // converts it into slot n of mBuffer.
+    char* mDeviceBuffer;
+    int mDeviceBufferSize;
+    Resampler mResampler;
+
+    // Per slot, stamped in the callback; see obtainBuffer().
+    int64_t* mBufferUs;
 
     int mWroteBufIndex;
     int mReadBufIndex;
     int mDataFull;
+    int mInterrupted;
 
     pthread_mutex_t mLock;
     pthread_cond_t mCond;
 
+    record_callback mDataCallback;
+    void* mDataContext;
+
     // recorder interfaces
     SLObjectItf mRecorderObject;
     SLRecordItf mRecorderRecord;
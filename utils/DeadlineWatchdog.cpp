@@ -0,0 +1,112 @@
+//
+// Created by ljliu on 19-3-13.
+//
+
+#include "utils/DeadlineWatchdog.h"
+
+#include <stdio.h>
+#include <string.h>
+
+const char* quality_name(int level) {
+  switch (level) {
+    case kQualityFull:
+      return "full";
+    case kQualityNoPostAec:
+      return "no_post_aec";
+    case kQualityHotwordSubset:
+      return "hotword_subset";
+    default:
+      return "unknown";
+  }
+}
+
+DeadlineWatchdog::DeadlineWatchdog()
+{
+  reset(10 * 1000, 0);
+}
+
+void DeadlineWatchdog::reset(int64_t budgetUs, int maxLevel)
+{
+  mBudgetUs = budgetUs;
+  mMaxLevel = maxLevel < kQualityLevels ? maxLevel : kQualityLevels - 1;
+  mLevel = kQualityFull;
+  mWindowFrames = 0;
+  mWindowMisses = 0;
+  mWindowUs = 0;
+  mWindowWorstUs = 0;
+  mCalmWindows = 0;
+  mRecoverWindows = kRecoverWindows;
+  mJustRecovered = false;
+  memset(&mStats, 0, sizeof(mStats));
+  mCause[0] = '\0';
+}
+
+int DeadlineWatchdog::update(int64_t frameUs, const char** cause)
+{
+  int64_t slack = mBudgetUs - frameUs;
+  mStats.frames++;
+  if (slack < 0) {
+    mStats.misses++;
+    mWindowMisses++;
+  }
+  if (slack < mStats.worstSlackUs) {
+    mStats.worstSlackUs = slack;
+  }
+  if (frameUs > mWindowWorstUs) {
+    mWindowWorstUs = frameUs;
+  }
+  mWindowUs += frameUs;
+  if (++mWindowFrames < kWatchWindow) {
+    return mLevel;
+  }
+
+  int load = (int)(mWindowUs * 100 / (mBudgetUs * mWindowFrames));
+  int next = mLevel;
+  if (mWindowMisses >= kDegradeMisses || load > kDegradeLoad) {
+    mCalmWindows = 0;
+    if (mLevel < mMaxLevel) {
+      next = mLevel + 1;
+      if (mJustRecovered && mRecoverWindows < kMaxRecoverWindows) {
+        // Headroom was not really back, wait longer next time.
+        mRecoverWindows *= 2;
+      }
+      snprintf(mCause, sizeof(mCause),
+               "%d/%d frames over %lld us, load %d%%, worst %lld us",
+               mWindowMisses, mWindowFrames, (long long)mBudgetUs, load,
+               (long long)mWindowWorstUs);
+    }
+    mJustRecovered = false;
+  } else if (mWindowMisses == 0 && load < kRecoverLoad) {
+    // A calm window after a step up confirms it.
+    mJustRecovered = false;
+    if (mLevel > kQualityFull && ++mCalmWindows >= mRecoverWindows) {
+      next = mLevel - 1;
+      mCalmWindows = 0;
+      mJustRecovered = true;
+      snprintf(mCause, sizeof(mCause),
+               "%d windows without overrun, load %d%%, worst %lld us",
+               mRecoverWindows, load, (long long)mWindowWorstUs);
+    }
+  } else {
+    mCalmWindows = 0;
+    mJustRecovered = false;
+  }
+
+  mWindowFrames = 0;
+  mWindowMisses = 0;
+  mWindowUs = 0;
+  mWindowWorstUs = 0;
+
+  if (next != mLevel) {
+    mLevel = next;
+    mStats.transitions++;
+    *cause = mCause;
+  }
+  return mLevel;
+}
+
+void DeadlineWatchdog::getStats(WatchdogStats* stats) const
+{
+  *stats = mStats;
+  stats->level = mLevel;
+}
@@ -0,0 +1,78 @@
+//
+// Created by ljliu on 19-3-13.
+//
+
+#ifndef UTILS_DEADLINEWATCHDOG_H
+#define UTILS_DEADLINEWATCHDOG_H
+
+#include <stdint.h>
+
+// Cheaper ways to run the chain, mildest first. Each level includes the
+// ones above it. Only cuts that take effect on the next frame belong here:
+// anything needing a DSP rebuild would stall or drop audio exactly when
+// the device is already overloaded.
+enum QualityLevel {
+    kQualityFull = 0,
+    kQualityNoPostAec,         // post_aec stage disabled
+    kQualityHotwordSubset,     // consumer silences all but every
+                               // kSubsetStride-th hotword beam
+    kQualityLevels
+};
+
+// Frames per evaluation window.
+#define kWatchWindow 50
+// A window with this many overruns, or a mean load above kDegradeLoad
+// percent of the budget, steps one level down.
+#define kDegradeMisses 3
+#define kDegradeLoad 85
+// Stepping back up needs kRecoverWindows clean windows below kRecoverLoad
+// percent; the count doubles (up to kMaxRecoverWindows) each time a level
+// that was just regained has to be given up again.
+#define kRecoverLoad 50
+#define kRecoverWindows 4
+#define kMaxRecoverWindows 64
+
+const char* quality_name(int level);
+
+struct WatchdogStats {
+    int level;
+    unsigned int frames;
+    unsigned int misses;
+    int64_t worstSlackUs;      // most negative budget - frame time seen
+    unsigned int transitions;
+};
+
+// Tracks per-frame deadline slack and picks the quality level for the next
+// frame. Single threaded: fed by the frame loop only.
+class DeadlineWatchdog {
+public:
+    DeadlineWatchdog();
+
+    // |maxLevel| is the deepest level that may be chosen, 0 disables.
+    void reset(int64_t budgetUs, int maxLevel);
+
+    // Account one frame. Returns the level for the next frame; when it
+    // differs from the current one |cause| describes why.
+    int update(int64_t frameUs, const char** cause);
+
+    int level() const { return mLevel; }
+    void getStats(WatchdogStats* stats) const;
+
+private:
+    int64_t mBudgetUs;
+    int mMaxLevel;
+    int mLevel;
+
+    int mWindowFrames;
+    int mWindowMisses;
+    int64_t mWindowUs;
+    int64_t mWindowWorstUs;
+    int mCalmWindows;
+    int mRecoverWindows;
+    bool mJustRecovered;
+
+    WatchdogStats mStats;
+    char mCause[128];
+};
+
+#endif // UTILS_DEADLINEWATCHDOG_H
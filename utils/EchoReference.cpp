@@ -0,0 +1,170 @@
+//
+// Created by ljliu on 19-3-20.
+//
+
+#include "utils/EchoReference.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+static inline int64_t samples_to_us(int64_t samples) {
+  return samples * 1000000LL / kEchoRefRate;
+}
+
+// Rounded down, also for negative spans.
+static inline int64_t us_to_samples(int64_t us) {
+  int64_t scaled = us * kEchoRefRate;
+  return scaled >= 0 ? scaled / 1000000LL
+                     : -((-scaled + 999999LL) / 1000000LL);
+}
+
+EchoReference::EchoReference() :
+    mRingSamples(kEchoRefRate / 1000 * kEchoRefMs),
+    mWritePos(0),
+    mChunkCount(0),
+    mLastEndUs(0),
+    mPublished(0),
+    mLocked(false),
+    mReadPos(0),
+    mFrames(0),
+    mActiveFrames(0),
+    mResyncs(0)
+{
+  mRing = new short[mRingSamples];
+  memset(mChunks, 0, sizeof(mChunks));
+}
+
+EchoReference::~EchoReference()
+{
+  delete [] mRing;
+}
+
+void EchoReference::publish(const short* pcm, int samples, int64_t startUs)
+{
+  if (samples <= 0) {
+    return;
+  }
+  if (samples > mRingSamples) {
+    pcm += samples - mRingSamples;
+    startUs += samples_to_us(samples - mRingSamples);
+    samples = mRingSamples;
+  }
+
+  uint64_t pos = mWritePos.load(std::memory_order_relaxed);
+  int offset = (int)(pos % mRingSamples);
+  int first = mRingSamples - offset < samples ? mRingSamples - offset
+                                              : samples;
+  memcpy(mRing + offset, pcm, first * sizeof(short));
+  memcpy(mRing, pcm + first, (samples - first) * sizeof(short));
+
+  // Callback jitter would otherwise show up as small jumps in the middle of
+  // one stream.
+  if (mLastEndUs != 0 && llabs(startUs - mLastEndUs) < kEchoRefSlackUs) {
+    startUs = mLastEndUs;
+  }
+  unsigned int count = mChunkCount.load(std::memory_order_relaxed);
+  Chunk& chunk = mChunks[count % kEchoRefChunks];
+  chunk.pos = pos;
+  chunk.us = startUs;
+  chunk.samples = samples;
+  mLastEndUs = startUs + samples_to_us(samples);
+
+  mPublished += samples;
+  mWritePos.store(pos + samples, std::memory_order_release);
+  mChunkCount.store(count + 1, std::memory_order_release);
+}
+
+int EchoReference::read(int64_t startUs, short* out, int samples)
+{
+  mFrames++;
+  unsigned int count = mChunkCount.load(std::memory_order_acquire);
+  uint64_t writePos = mWritePos.load(std::memory_order_acquire);
+  int64_t oldest = writePos > (uint64_t)mRingSamples
+                       ? (int64_t)(writePos - mRingSamples) : 0;
+  int64_t endUs = startUs + samples_to_us(samples);
+
+  // Newest first, to the earliest chunk overlapping the frame. The
+  // publisher only writes the slot kEchoRefChunks behind, far from here.
+  unsigned int limit = count < kEchoRefChunks / 2 ? count
+                                                  : kEchoRefChunks / 2;
+  Chunk hit = {0, 0, 0};
+  bool found = false;
+  bool hitStartsRun = true;
+  int64_t hitRunEnd = 0;
+  int64_t runEnd = 0;
+  int64_t nextUs = 0;
+  for (unsigned int k = 1; k <= limit; k++) {
+    Chunk chunk = mChunks[(count - k) % kEchoRefChunks];
+    int64_t chunkEndUs = chunk.us + samples_to_us(chunk.samples);
+    if (k == 1 || chunkEndUs != nextUs) {
+      // Last chunk of a stream; audio after it belongs to a later one.
+      runEnd = chunk.pos + chunk.samples;
+    }
+    if (found && chunk.us + samples_to_us(chunk.samples) == hit.us &&
+        chunk.pos + chunk.samples == hit.pos) {
+      hitStartsRun = false;
+    }
+    nextUs = chunk.us;
+    if (chunk.us < endUs && chunkEndUs > startUs) {
+      hit = chunk;
+      found = true;
+      hitStartsRun = true;
+      hitRunEnd = runEnd;
+    } else if (chunkEndUs <= startUs) {
+      break;
+    }
+  }
+
+  if (!found) {
+    mLocked = false;
+    memset(out, 0, samples * sizeof(short));
+    return 0;
+  }
+
+  int64_t expected = (int64_t)hit.pos + us_to_samples(startUs - hit.us);
+  int64_t slack = us_to_samples(kEchoRefSlackUs);
+  if (!mLocked || llabs(expected - mReadPos) > slack) {
+    if (mLocked) {
+      mResyncs++;
+    }
+    mReadPos = expected;
+    mLocked = true;
+  }
+
+  int64_t begin = mReadPos;
+  if (begin < oldest) {
+    begin = oldest;
+  }
+  if (hitStartsRun && begin < (int64_t)hit.pos) {
+    begin = hit.pos;
+  }
+  int64_t end = mReadPos + samples;
+  if (end > hitRunEnd) {
+    end = hitRunEnd;
+  }
+
+  int active = 0;
+  for (int i = 0; i < samples; i++) {
+    int64_t pos = mReadPos + i;
+    if (pos >= begin && pos < end) {
+      out[i] = mRing[pos % mRingSamples];
+      active++;
+    } else {
+      out[i] = 0;
+    }
+  }
+  mReadPos += samples;
+  if (active > 0) {
+    mActiveFrames++;
+  }
+  return active;
+}
+
+void EchoReference::getStats(EchoRefStats* stats) const
+{
+  stats->publishedSamples = mPublished.load();
+  stats->chunks = mChunkCount.load();
+  stats->frames = mFrames;
+  stats->activeFrames = mActiveFrames;
+  stats->resyncs = mResyncs;
+}
@@ -0,0 +1,80 @@
+//
+// Created by ljliu on 19-3-20.
+//
+
+#ifndef UTILS_ECHOREFERENCE_H
+#define UTILS_ECHOREFERENCE_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+// Reference format: what the streaming player renders, 16k mono.
+#define kEchoRefRate 16000
+// Played audio kept; bounds the speaker to mic delay that can be covered.
+#define kEchoRefMs 1000
+// Published chunks remembered, one per player buffer; read() only looks at
+// the newer half.
+#define kEchoRefChunks 64
+// Timestamps this close are taken as the same instant: consecutive chunks
+// are joined into one stream, and read() keeps its sample position.
+#define kEchoRefSlackUs 4000
+
+struct EchoRefStats {
+    int64_t publishedSamples;
+    unsigned int chunks;
+    unsigned int frames;       // read() calls
+    unsigned int activeFrames; // ... that found played audio
+    unsigned int resyncs;      // position jumped to follow the timestamps
+};
+
+// Timeline of the audio the player actually handed to the output, for the
+// echo canceller. The player publishes every buffer as OpenSL starts on
+// it, stamped with that time; the capture side asks for
+// what was rendered during a frame's time span (moved by the speaker to mic
+// delay). Once locked onto a stream it advances sample by sample and only
+// jumps when the timestamps drift off by more than kEchoRefSlackUs, so the
+// canceller sees a continuous reference.
+//
+// One publishing and one reading thread, no locks.
+class EchoReference {
+public:
+    EchoReference();
+    ~EchoReference();
+
+    // Player side: |samples| rendered from |startUs| (monotonic_us()) on.
+    void publish(const short* pcm, int samples, int64_t startUs);
+
+    // Capture side: fills |out| with what was rendered during the
+    // |samples| from |startUs| on, silence where nothing played. Returns
+    // the number of samples that carried played audio.
+    int read(int64_t startUs, short* out, int samples);
+
+    void getStats(EchoRefStats* stats) const;
+
+private:
+    struct Chunk {
+        uint64_t pos;          // of its first sample in the stream
+        int64_t us;
+        int samples;
+    };
+
+    short* mRing;
+    int mRingSamples;
+    Chunk mChunks[kEchoRefChunks];
+    std::atomic<uint64_t> mWritePos;
+    std::atomic<unsigned int> mChunkCount;
+
+    // Publisher.
+    int64_t mLastEndUs;
+    std::atomic<int64_t> mPublished;
+
+    // Reader.
+    bool mLocked;
+    int64_t mReadPos;
+    unsigned int mFrames;
+    unsigned int mActiveFrames;
+    unsigned int mResyncs;
+};
+
+#endif // UTILS_ECHOREFERENCE_H
@@ -0,0 +1,217 @@
+//
+// Created by ljliu on 19-3-14.
+//
+
+#include "utils/Fft.h"
+
+#include <math.h>
+
+static inline Complex cmul(Complex a, Complex b, bool conjB)
+{
+  Complex c;
+  if (conjB) {
+    c.re = a.re * b.re + a.im * b.im;
+    c.im = a.im * b.re - a.re * b.im;
+  } else {
+    c.re = a.re * b.re - a.im * b.im;
+    c.im = a.im * b.re + a.re * b.im;
+  }
+  return c;
+}
+
+Fft::Fft(int n) :
+    mSize(n),
+    mValid(n > 0),
+    mTwiddles(n > 0 ? n : 0),
+    mScratch(5),
+    mRealIn(n > 0 ? n : 0),
+    mRealOut(n > 0 ? n : 0)
+{
+  for (int k = 0; k < n; k++) {
+    double phase = -2.0 * M_PI * k / n;
+    mTwiddles[k].re = (float)cos(phase);
+    mTwiddles[k].im = (float)sin(phase);
+  }
+
+  // Radix 4 first, it has the cheapest butterfly per point.
+  int rest = n;
+  while (mValid && rest > 1) {
+    int p = 0;
+    if (rest % 4 == 0) {
+      p = 4;
+    } else if (rest % 2 == 0) {
+      p = 2;
+    } else if (rest % 3 == 0) {
+      p = 3;
+    } else if (rest % 5 == 0) {
+      p = 5;
+    } else {
+      mValid = false;
+      break;
+    }
+    rest /= p;
+    mFactors.push_back(p);
+    mFactors.push_back(rest);
+  }
+}
+
+void Fft::forward(const Complex* in, Complex* out)
+{
+  transform(in, out, false);
+}
+
+void Fft::inverse(const Complex* in, Complex* out)
+{
+  transform(in, out, true);
+}
+
+void Fft::transform(const Complex* in, Complex* out, bool inverse)
+{
+  if (!mValid) {
+    return;
+  }
+  if (mSize == 1) {
+    out[0] = in[0];
+    return;
+  }
+  work(out, in, 1, &mFactors[0], inverse);
+}
+
+void Fft::forwardReal(const float* in, Complex* out)
+{
+  for (int i = 0; i < mSize; i++) {
+    mRealIn[i].re = in[i];
+    mRealIn[i].im = 0.0f;
+  }
+  transform(&mRealIn[0], &mRealOut[0], false);
+  for (int k = 0; k <= mSize / 2; k++) {
+    out[k] = mRealOut[k];
+  }
+}
+
+void Fft::inverseReal(const Complex* in, float* out)
+{
+  int half = mSize / 2;
+  for (int k = 0; k <= half; k++) {
+    mRealIn[k] = in[k];
+  }
+  // Rebuild the mirrored half of a Hermitian spectrum.
+  for (int k = half + 1; k < mSize; k++) {
+    mRealIn[k].re = in[mSize - k].re;
+    mRealIn[k].im = -in[mSize - k].im;
+  }
+  transform(&mRealIn[0], &mRealOut[0], true);
+  float scale = 1.0f / mSize;
+  for (int i = 0; i < mSize; i++) {
+    out[i] = mRealOut[i].re * scale;
+  }
+}
+
+// Decimation in time: the p interleaved sub-sequences of |in| are
+// transformed into consecutive blocks of |out|, then combined by one radix p
+// pass.
+void Fft::work(Complex* out, const Complex* in, int stride,
+               const int* factors, bool inverse)
+{
+  int p = factors[0];
+  int m = factors[1];
+  Complex* begin = out;
+  Complex* end = out + p * m;
+
+  if (m == 1) {
+    for (; out != end; out++, in += stride) {
+      *out = *in;
+    }
+  } else {
+    for (; out != end; out += m, in += stride) {
+      work(out, in, stride * p, factors + 2, inverse);
+    }
+  }
+
+  switch (p) {
+    case 2:
+      butterfly2(begin, stride, m, inverse);
+      break;
+    case 4:
+      butterfly4(begin, stride, m, inverse);
+      break;
+    default:
+      butterflyGeneric(begin, stride, p, m, inverse);
+      break;
+  }
+}
+
+void Fft::butterfly2(Complex* out, int stride, int m, bool inverse)
+{
+  const Complex* tw = &mTwiddles[0];
+  for (int k = 0; k < m; k++) {
+    Complex t = cmul(out[m + k], tw[k * stride], inverse);
+    out[m + k].re = out[k].re - t.re;
+    out[m + k].im = out[k].im - t.im;
+    out[k].re += t.re;
+    out[k].im += t.im;
+  }
+}
+
+void Fft::butterfly4(Complex* out, int stride, int m, bool inverse)
+{
+  const Complex* tw = &mTwiddles[0];
+  for (int k = 0; k < m; k++) {
+    Complex s0 = cmul(out[k + m], tw[k * stride], inverse);
+    Complex s1 = cmul(out[k + 2 * m], tw[2 * k * stride], inverse);
+    Complex s2 = cmul(out[k + 3 * m], tw[3 * k * stride], inverse);
+    Complex s3, s4, s5;
+
+    s5.re = out[k].re - s1.re;
+    s5.im = out[k].im - s1.im;
+    out[k].re += s1.re;
+    out[k].im += s1.im;
+    s3.re = s0.re + s2.re;
+    s3.im = s0.im + s2.im;
+    s4.re = s0.re - s2.re;
+    s4.im = s0.im - s2.im;
+
+    out[k + 2 * m].re = out[k].re - s3.re;
+    out[k + 2 * m].im = out[k].im - s3.im;
+    out[k].re += s3.re;
+    out[k].im += s3.im;
+    // s4 times -i (forward) or +i (inverse).
+    if (inverse) {
+      out[k + m].re = s5.re - s4.im;
+      out[k + m].im = s5.im + s4.re;
+      out[k + 3 * m].re = s5.re + s4.im;
+      out[k + 3 * m].im = s5.im - s4.re;
+    } else {
+      out[k + m].re = s5.re + s4.im;
+      out[k + m].im = s5.im - s4.re;
+      out[k + 3 * m].re = s5.re - s4.im;
+      out[k + 3 * m].im = s5.im + s4.re;
+    }
+  }
+}
+
+// Plain O(p^2) DFT across the p blocks, used for radix 3 and 5.
+void Fft::butterflyGeneric(Complex* out, int stride, int p, int m,
+                           bool inverse)
+{
+  const Complex* tw = &mTwiddles[0];
+  Complex* scratch = &mScratch[0];
+  for (int u = 0; u < m; u++) {
+    for (int q = 0, k = u; q < p; q++, k += m) {
+      scratch[q] = out[k];
+    }
+    for (int q1 = 0, k = u; q1 < p; q1++, k += m) {
+      int index = 0;
+      out[k] = scratch[0];
+      for (int q = 1; q < p; q++) {
+        index += stride * k;
+        if (index >= mSize) {
+          index %= mSize;
+        }
+        Complex t = cmul(scratch[q], tw[index], inverse);
+        out[k].re += t.re;
+        out[k].im += t.im;
+      }
+    }
+  }
+}
@@ -0,0 +1,57 @@
+//
+// Created by ljliu on 19-3-14.
+//
+
+#ifndef UTILS_FFT_H
+#define UTILS_FFT_H
+
+#include <vector>
+
+struct Complex {
+    float re;
+    float im;
+};
+
+// Mixed radix complex FFT for sizes made of 2, 3, 4 and 5 (the DSP's
+// 320 point frames are 4*4*4*5). Twiddles and scratch are set up by the
+// constructor, so transforms never allocate. Not thread safe: one
+// instance per thread.
+class Fft {
+public:
+    explicit Fft(int n);
+
+    // False when |n| has a prime factor above 5.
+    bool valid() const { return mValid; }
+    int size() const { return mSize; }
+
+    // Out of place, |in| and |out| must not overlap. inverse() is not
+    // scaled, a round trip multiplies by size().
+    void forward(const Complex* in, Complex* out);
+    void inverse(const Complex* in, Complex* out);
+
+    // Real signal of size() samples <-> its size() / 2 + 1 bins. Unlike
+    // inverse(), inverseReal() scales by 1 / size().
+    void forwardReal(const float* in, Complex* out);
+    void inverseReal(const Complex* in, float* out);
+
+private:
+    void transform(const Complex* in, Complex* out, bool inverse);
+    void work(Complex* out, const Complex* in, int stride, const int* factors,
+              bool inverse);
+    void butterfly2(Complex* out, int stride, int m, bool inverse);
+    void butterfly4(Complex* out, int stride, int m, bool inverse);
+    void butterflyGeneric(Complex* out, int stride, int p, int m,
+                          bool inverse);
+
+    int mSize;
+    bool mValid;
+    // (radix, remaining length) pairs, outermost stage first.
+    std::vector<int> mFactors;
+    // exp(-2 pi i k / n); conjugated on the fly for inverse().
+    std::vector<Complex> mTwiddles;
+    std::vector<Complex> mScratch;
+    std::vector<Complex> mRealIn;
+    std::vector<Complex> mRealOut;
+};
+
+#endif // UTILS_FFT_H
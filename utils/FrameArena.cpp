@@ -0,0 +1,119 @@
+//
+// Created by ljliu on 19-3-6.
+//
+
+#include "utils/FrameArena.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#ifdef HAVE_MEMALIGN
+#include <malloc.h>
+#endif
+
+#define LOG_TAG "FrameArena"
+#include "utils/LogUtils.h"
+
+FrameArena::FrameArena() :
+    mBase(NULL),
+    mCapacity(0),
+    mUsed(0)
+{
+}
+
+FrameArena::~FrameArena()
+{
+  release();
+}
+
+int FrameArena::init(size_t capacity)
+{
+  release();
+
+  capacity = padded(capacity);
+  void* base = NULL;
+#ifdef HAVE_MEMALIGN
+  base = memalign(kCacheLine, capacity);
+#else
+  if (posix_memalign(&base, kCacheLine, capacity) != 0) {
+    base = NULL;
+  }
+#endif
+  if (base == NULL) {
+    ALOGE("can not allocate %u bytes", (unsigned)capacity);
+    return -1;
+  }
+
+  memset(base, 0, capacity);
+  mBase = (char*)base;
+  mCapacity = capacity;
+  mUsed = 0;
+  return 0;
+}
+
+void FrameArena::release()
+{
+  if (mBase != NULL) {
+    free(mBase);
+    mBase = NULL;
+  }
+  mCapacity = 0;
+  mUsed = 0;
+}
+
+void* FrameArena::alloc(size_t bytes)
+{
+  size_t size = padded(bytes);
+  if (mBase == NULL || mUsed + size > mCapacity) {
+    ALOGE("arena exhausted: %u + %u > %u",
+          (unsigned)mUsed, (unsigned)size, (unsigned)mCapacity);
+    return NULL;
+  }
+
+  void* p = mBase + mUsed;
+  mUsed += size;
+  return p;
+}
+
+#ifdef FRAME_ARENA_COUNT_ALLOCS
+// Replaces the global allocation functions of the whole binary with
+// counting ones, so the pipeline can assert that its steady-state loop
+// stays off the heap. Only the test tools define it; the demo and the
+// libraries linking us keep their own allocator.
+static __thread int64_t sThreadAllocations = 0;
+
+/*static*/ int64_t FrameArena::threadAllocations()
+{
+  return sThreadAllocations;
+}
+
+void* operator new(size_t size)
+{
+  sThreadAllocations++;
+  void* p = malloc(size ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](size_t size)
+{
+  return operator new(size);
+}
+
+void operator delete(void* p) noexcept
+{
+  free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+  free(p);
+}
+#else
+/*static*/ int64_t FrameArena::threadAllocations()
+{
+  return -1;
+}
+#endif
@@ -0,0 +1,51 @@
+//
+// Created by ljliu on 19-3-6.
+//
+
+#ifndef UTILS_FRAMEARENA_H
+#define UTILS_FRAMEARENA_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define kCacheLine 64
+
+// One block of memory per pipeline, carved up in start() into the per-frame
+// buffers of every stage. Each buffer starts on a cache line and is padded
+// to a whole number of lines, so stages never share a line and SIMD loads
+// are aligned. Nothing is freed individually; release() drops everything.
+class FrameArena {
+public:
+    FrameArena();
+    ~FrameArena();
+
+    // Bytes a buffer of |bytes| takes in the arena, padding included.
+    static size_t padded(size_t bytes) {
+        return (bytes + kCacheLine - 1) & ~(size_t)(kCacheLine - 1);
+    }
+
+    int init(size_t capacity);
+    void release();
+
+    // Zero-filled, kCacheLine aligned; NULL when the arena is exhausted.
+    void* alloc(size_t bytes);
+    template <typename T>
+    T* alloc(size_t count) {
+        return static_cast<T*>(alloc(count * sizeof(T)));
+    }
+
+    size_t capacity() const { return mCapacity; }
+    size_t used() const { return mUsed; }
+
+    // Heap allocations made through operator new on the calling thread.
+    // Only counted when built with FRAME_ARENA_COUNT_ALLOCS (the pipeline
+    // test tools, see ENABLE_ALLOC_CHECK); returns -1 otherwise.
+    static int64_t threadAllocations();
+
+private:
+    char* mBase;
+    size_t mCapacity;
+    size_t mUsed;
+};
+
+#endif // UTILS_FRAMEARENA_H
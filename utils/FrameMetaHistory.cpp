@@ -0,0 +1,146 @@
+//
+// Created by ljliu on 19-3-12.
+//
+
+#include "utils/FrameMetaHistory.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+FrameMetaHistory::FrameMetaHistory(int capacity) :
+    mRing(capacity),
+    mNext(0),
+    mWindow(capacity),
+    mFed(capacity),
+    mFedCount(0),
+    mFedMs(0)
+{
+  for (size_t i = 0; i < mRing.size(); i++) {
+    memset(&mRing[i], 0, sizeof(FrameMeta));
+    // Mark empty so frame 0 does not match a blank slot.
+    mRing[i].frameIndex = (unsigned int)-1;
+  }
+  pthread_mutex_init(&mLock, NULL);
+}
+
+FrameMetaHistory::~FrameMetaHistory()
+{
+  pthread_mutex_destroy(&mLock);
+}
+
+void FrameMetaHistory::push(const FrameMeta& meta)
+{
+  pthread_mutex_lock(&mLock);
+  mRing[meta.frameIndex % mRing.size()] = meta;
+  mNext = meta.frameIndex + 1;
+  if (meta.frameMs > 0) {
+    mWindow = std::min((int)mRing.size(), kEnergyWinMs / meta.frameMs);
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+bool FrameMetaHistory::get(unsigned int frameIndex, FrameMeta* meta)
+{
+  pthread_mutex_lock(&mLock);
+  const FrameMeta& slot = mRing[frameIndex % mRing.size()];
+  bool found = slot.frameIndex == frameIndex;
+  if (found) {
+    *meta = slot;
+  }
+  pthread_mutex_unlock(&mLock);
+  return found;
+}
+
+unsigned long FrameMetaHistory::beamEnergyLocked(int beam, unsigned int frame)
+{
+  // 40% of the window before the frame, the rest after, as before.
+  int size = mRing.size();
+  unsigned int before = mWindow * 4 / 10;
+  unsigned int first = frame > before ? frame - before : 0;
+  unsigned long sum = 0;
+  for (unsigned int f = first; f < first + mWindow / 2 && f < mNext; f++) {
+    const FrameMeta& slot = mRing[f % size];
+    if (slot.frameIndex == f) {
+      sum += slot.beamEnergy[beam];
+    }
+  }
+  return sum;
+}
+
+unsigned long FrameMetaHistory::beamEnergy(int beam, unsigned int frame)
+{
+  pthread_mutex_lock(&mLock);
+  unsigned long sum = beamEnergyLocked(beam, frame);
+  pthread_mutex_unlock(&mLock);
+  return sum;
+}
+
+int FrameMetaHistory::selectBeam(const std::vector<double>& frames)
+{
+  int index = -1;
+  unsigned long energy = 0;
+  pthread_mutex_lock(&mLock);
+  for (size_t i = 0; i < frames.size() && i < kOutNum; i++) {
+    if (frames[i] != 0) {
+      int beam = i;
+      unsigned long e = beamEnergyLocked(beam, (unsigned int)frames[i]);
+      if (index < 0 || e > energy) {
+        index = beam;
+        energy = e;
+      }
+    }
+  }
+  pthread_mutex_unlock(&mLock);
+  return index;
+}
+
+int FrameMetaHistory::doaAt(unsigned int frame)
+{
+  FrameMeta meta;
+  if (!get(frame, &meta)) {
+    return -1;
+  }
+  return meta.doaAngle;
+}
+
+void FrameMetaHistory::recordFed(unsigned int frameIndex, int frameMs)
+{
+  pthread_mutex_lock(&mLock);
+  FedFrame& slot = mFed[mFedCount % mFed.size()];
+  slot.startMs = mFedMs;
+  slot.frameIndex = frameIndex;
+  slot.frameMs = frameMs;
+  mFedCount++;
+  mFedMs += frameMs;
+  pthread_mutex_unlock(&mLock);
+}
+
+void FrameMetaHistory::resetFed()
+{
+  pthread_mutex_lock(&mLock);
+  mFedCount = 0;
+  mFedMs = 0;
+  pthread_mutex_unlock(&mLock);
+}
+
+bool FrameMetaHistory::fedFrame(unsigned int hotwordFrame,
+                                unsigned int* frameIndex)
+{
+  int64_t ms = (int64_t)hotwordFrame * kHotwordFrameMs;
+  bool found = false;
+  pthread_mutex_lock(&mLock);
+  unsigned int kept = std::min(mFedCount, (unsigned int)mFed.size());
+  for (unsigned int i = 1; i <= kept; i++) {
+    const FedFrame& slot = mFed[(mFedCount - i) % mFed.size()];
+    if (slot.startMs <= ms) {
+      found = ms < slot.startMs + slot.frameMs;
+      if (found) {
+        *frameIndex = slot.frameIndex;
+      }
+      break;
+    }
+  }
+  pthread_mutex_unlock(&mLock);
+  return found;
+}
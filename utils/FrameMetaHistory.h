@@ -0,0 +1,67 @@
+//
+// Created by ljliu on 19-3-12.
+//
+
+#ifndef UTILS_FRAMEMETAHISTORY_H
+#define UTILS_FRAMEMETAHISTORY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "utils/MobPipeline.h"
+
+// Frame length the hotword engine numbers its detections in.
+#define kHotwordFrameMs 10
+
+// Consumer-side ring of the FrameMeta records delivered with each frame,
+// so decisions about past frames (which beam heard the hotword, where it
+// came from) need neither the DSP thread nor its buffers.
+class FrameMetaHistory {
+public:
+    explicit FrameMetaHistory(int capacity = kEnergyWinLen);
+    ~FrameMetaHistory();
+
+    void push(const FrameMeta& meta);
+    bool get(unsigned int frameIndex, FrameMeta* meta);
+
+    // Energy of |beam| summed over the frames around |frame|, the window
+    // the pipeline used for hotword beam selection.
+    unsigned long beamEnergy(int beam, unsigned int frame);
+    // Loudest beam among those with a non-zero detected frame, or -1.
+    // frames[i] belongs to beam i.
+    int selectBeam(const std::vector<double>& frames);
+    // DOA recorded for |frame|, -1 when unknown.
+    int doaAt(unsigned int frame);
+
+    // The hotword engine numbers the kHotwordFrameMs frames fed to it since
+    // its START, whatever was skipped in between: record each pipeline
+    // frame as it is fed, in order, and resetFed() when the engine starts.
+    void recordFed(unsigned int frameIndex, int frameMs);
+    void resetFed();
+    // Pipeline frame that hotword frame |hotwordFrame| fell in; false when
+    // it is not in the history.
+    bool fedFrame(unsigned int hotwordFrame, unsigned int* frameIndex);
+
+private:
+    struct FedFrame {
+        int64_t startMs;       // hotword audio fed before it
+        unsigned int frameIndex;
+        int frameMs;
+    };
+
+    unsigned long beamEnergyLocked(int beam, unsigned int frame);
+
+    std::vector<FrameMeta> mRing;
+    unsigned int mNext;
+    // Frames in kEnergyWinMs at the current frame length.
+    int mWindow;
+    // Ring of the last fed frames, mFedCount of them so far, mFedMs long.
+    std::vector<FedFrame> mFed;
+    unsigned int mFedCount;
+    int64_t mFedMs;
+    pthread_mutex_t mLock;
+};
+
+#endif // UTILS_FRAMEMETAHISTORY_H
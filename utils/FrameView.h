@@ -0,0 +1,119 @@
+//
+// Created by ljliu on 19-3-11.
+//
+
+#ifndef UTILS_FRAMEVIEW_H
+#define UTILS_FRAMEVIEW_H
+
+#include <assert.h>
+
+// Layout tags. A view's layout is part of its type, so handing interleaved
+// mic samples to code that expects planar beams does not compile.
+struct PlanarLayout {};       // channel after channel, |stride| apart
+struct InterleavedLayout {};  // one sample of every channel after another
+
+// Non-owning view of one frame of 16-bit multi-channel audio. Sub-views
+// share the underlying buffer; nothing is copied.
+template <typename Layout>
+class FrameView;
+
+template <>
+class FrameView<PlanarLayout> {
+public:
+    FrameView(short* data, int channels, int samples, int stride,
+              int sampleRate, unsigned int frameIndex) :
+        mData(data), mChannels(channels), mSamples(samples),
+        mStride(stride), mSampleRate(sampleRate), mFrameIndex(frameIndex) {
+    }
+
+    short* data() const { return mData; }
+    int channels() const { return mChannels; }
+    int samples() const { return mSamples; }
+    int stride() const { return mStride; }
+    int sampleRate() const { return mSampleRate; }
+    unsigned int frameIndex() const { return mFrameIndex; }
+
+    short* channelData(int channel) const {
+        assert(channel >= 0 && channel < mChannels);
+        return mData + channel * mStride;
+    }
+    short& at(int channel, int sample) const {
+        assert(sample >= 0 && sample < mSamples);
+        return channelData(channel)[sample];
+    }
+
+    // True when the view is one gap-free block, e.g. to pass as raw bytes.
+    bool contiguous() const {
+        return mChannels == 1 || mStride == mSamples;
+    }
+    char* bytes() const { return (char*)mData; }
+    int byteSize() const { return mChannels * mSamples * (int)sizeof(short); }
+
+    FrameView channel(int channel) const {
+        return channels(channel, 1);
+    }
+    FrameView channels(int first, int count) const {
+        assert(first >= 0 && count > 0 && first + count <= mChannels);
+        return FrameView(mData + first * mStride, count, mSamples, mStride,
+                         mSampleRate, mFrameIndex);
+    }
+    FrameView slice(int offset, int count) const {
+        assert(offset >= 0 && count > 0 && offset + count <= mSamples);
+        return FrameView(mData + offset, mChannels, count, mStride,
+                         mSampleRate, mFrameIndex);
+    }
+
+private:
+    short* mData;
+    int mChannels;
+    int mSamples;
+    int mStride;
+    int mSampleRate;
+    unsigned int mFrameIndex;
+};
+
+template <>
+class FrameView<InterleavedLayout> {
+public:
+    FrameView(short* data, int channels, int samples, int sampleRate,
+              unsigned int frameIndex) :
+        mData(data), mChannels(channels), mSamples(samples),
+        mSampleRate(sampleRate), mFrameIndex(frameIndex) {
+    }
+
+    short* data() const { return mData; }
+    int channels() const { return mChannels; }
+    int samples() const { return mSamples; }
+    int sampleRate() const { return mSampleRate; }
+    unsigned int frameIndex() const { return mFrameIndex; }
+
+    short& at(int channel, int sample) const {
+        assert(channel >= 0 && channel < mChannels);
+        assert(sample >= 0 && sample < mSamples);
+        return mData[sample * mChannels + channel];
+    }
+
+    bool contiguous() const { return true; }
+    char* bytes() const { return (char*)mData; }
+    int byteSize() const { return mChannels * mSamples * (int)sizeof(short); }
+
+    // Only time slices stay zero-copy for interleaved data; picking single
+    // channels needs a planar view.
+    FrameView slice(int offset, int count) const {
+        assert(offset >= 0 && count > 0 && offset + count <= mSamples);
+        return FrameView(mData + offset * mChannels, mChannels, count,
+                         mSampleRate, mFrameIndex);
+    }
+
+private:
+    short* mData;
+    int mChannels;
+    int mSamples;
+    int mSampleRate;
+    unsigned int mFrameIndex;
+};
+
+typedef FrameView<PlanarLayout> BeamFrame;
+typedef FrameView<InterleavedLayout> MicFrame;
+
+#endif // UTILS_FRAMEVIEW_H
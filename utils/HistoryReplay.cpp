@@ -0,0 +1,142 @@
+//
+// Created by ljliu on 19-3-15.
+//
+
+#include "utils/HistoryReplay.h"
+
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#define LOG_TAG "HistoryReplay"
+#include "utils/LogUtils.h"
+#include "utils/TimeUtils.h"
+
+HistoryReplay::HistoryReplay(MicHistory* history, int frameSamples,
+                             replay_feed feed, void* ctx) :
+    mHistory(history),
+    mFrameSamples(frameSamples),
+    mFeed(feed),
+    mCtx(ctx),
+    mRunning(false),
+    mAbort(false),
+    mLiveFrom(0),
+    mNext(0),
+    mStartUs(0),
+    mMic((size_t)kReplayChunkFrames * frameSamples * kSteerMics *
+         sizeof(short)),
+    mBeam(frameSamples)
+{
+  memset(&mStats, 0, sizeof(mStats));
+}
+
+HistoryReplay::~HistoryReplay()
+{
+  stop();
+}
+
+int HistoryReplay::load(const char* weightFile)
+{
+  return mBeamformer.load(weightFile);
+}
+
+int HistoryReplay::start(unsigned int fromFrame, int angle)
+{
+  if (mRunning || !mBeamformer.loaded() ||
+      mHistory->frameBytes() !=
+          (int)(mFrameSamples * kSteerMics * sizeof(short))) {
+    return -1;
+  }
+  if (mBeamformer.steer(angle) < 0) {
+    return -1;
+  }
+  mBeamformer.reset();
+
+  // Hold the live stream back before the worker exists.
+  mLiveFrom = UINT_MAX;
+  mAbort = false;
+  mNext = fromFrame;
+  mStartUs = monotonic_us();
+  mStats.replays++;
+  mStats.fromFrame = fromFrame;
+  mStats.liveFrame = 0;
+  mStats.frames = 0;
+  mStats.lostFrames = 0;
+  mStats.wallUs = 0;
+  if (pthread_create(&mThread, NULL, run, this) != 0) {
+    ALOGE("failed to start the replay thread");
+    mLiveFrom = 0;
+    return -1;
+  }
+  mRunning = true;
+  return 0;
+}
+
+void HistoryReplay::stop()
+{
+  if (!mRunning) {
+    return;
+  }
+  mAbort = true;
+  pthread_join(mThread, NULL);
+  mRunning = false;
+}
+
+/*static*/ void* HistoryReplay::run(void* arg)
+{
+  ((HistoryReplay*)arg)->doReplay();
+  return NULL;
+}
+
+void HistoryReplay::doReplay()
+{
+  int frameBytes = mHistory->frameBytes();
+  while (!mAbort) {
+    int count = mHistory->read(&mNext, &mMic[0], kReplayChunkFrames,
+                               &mStats.lostFrames);
+    if (count == 0) {
+      if (mHistory->handOver(mNext, &mLiveFrom)) {
+        mStats.handovers++;
+        mStats.liveFrame = mNext;
+        mStats.wallUs = monotonic_us() - mStartUs;
+        ALOGD("replayed %u frames (%u lost) in %lld us, live from %u",
+              mStats.frames, mStats.lostFrames, (long long)mStats.wallUs,
+              mNext);
+        return;
+      }
+      // Only while the history restarts under us.
+      usleep(1000);
+      continue;
+    }
+
+    unsigned int first = mNext - count;
+    for (int i = 0; i < count && !mAbort; i++) {
+      const short* mic = (const short*)&mMic[(size_t)i * frameBytes];
+      mBeamformer.process(mic, mFrameSamples, &mBeam[0]);
+      BeamFrame frame(&mBeam[0], 1, mFrameSamples, mFrameSamples, kSteerRate,
+                      first + i);
+      mStats.frames++;
+      if (!mFeed(mCtx, frame)) {
+        ALOGW("replay feed failed at frame %u", first + i);
+        mAbort = true;
+      }
+    }
+  }
+  // Nobody replays any more, the live stream takes everything.
+  mLiveFrom = 0;
+}
+
+void HistoryReplay::dumpStats()
+{
+  ReplayStats stats = mStats;
+  int64_t audioUs = (int64_t)stats.frames * mFrameSamples * 1000000LL /
+      kSteerRate;
+  printf("[replay] %u of %u replays handed over; last: frames %u..%u, "
+         "%u lost, %lld ms of audio in %lld ms (%.1fx real time)\n",
+         stats.handovers, stats.replays, stats.fromFrame, stats.liveFrame,
+         stats.lostFrames, (long long)(audioUs / 1000),
+         (long long)(stats.wallUs / 1000),
+         stats.wallUs > 0 ? (double)audioUs / stats.wallUs : 0.0);
+  mBeamformer.dumpStats();
+}
@@ -0,0 +1,94 @@
+//
+// Created by ljliu on 19-3-15.
+//
+
+#ifndef UTILS_HISTORYREPLAY_H
+#define UTILS_HISTORYREPLAY_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <vector>
+
+#include "utils/FrameView.h"
+#include "utils/MicHistory.h"
+#include "utils/SteeredBeamformer.h"
+
+// Frames copied out of the history per lock.
+#define kReplayChunkFrames 10
+
+// Receives the replayed beam one frame at a time, on the replay thread.
+// Returning false ends the replay.
+typedef bool (*replay_feed)(void* ctx, const BeamFrame& frame);
+
+struct ReplayStats {
+    unsigned int replays;
+    unsigned int handovers;
+    // Last replay.
+    unsigned int fromFrame;
+    unsigned int liveFrame;    // first frame left to the live stream
+    unsigned int frames;
+    unsigned int lostFrames;   // already gone from the history
+    int64_t wallUs;            // start() to handover
+};
+
+// Re-beamforms buffered raw capture towards a look direction that was only
+// known later, faster than real time, and then hands the stream over to
+// the live path without a gap or an overlap:
+//
+//   replay.start(hotwordFrame, doaAngle);   // live frames now held back
+//   ...
+//   // in the frame callback
+//   if (replay.live(meta.frameIndex)) feed(frame.channel(kSteeredChannel));
+//
+// After its first three hops the replayed beam equals the pipeline's
+// steered beam sample for sample (with 10 or 20 ms frames; other lengths
+// can differ in hop phase), so the live path should feed that channel.
+class HistoryReplay {
+public:
+    // |frameSamples| is the pipeline frame length at 16k.
+    HistoryReplay(MicHistory* history, int frameSamples, replay_feed feed,
+                  void* ctx);
+    ~HistoryReplay();
+
+    // Weight table for the beamformer, see SteeredBeamformer::load().
+    int load(const char* weightFile);
+
+    // Replays frames from |fromFrame| on towards |angle| degrees on a worker
+    // thread. From the call on, live() is false until the worker has caught
+    // up. Returns -1 when busy or not loaded.
+    int start(unsigned int fromFrame, int angle);
+    // Aborts a replay that is still catching up and joins the worker.
+    void stop();
+
+    // Whether the live stream delivers |frameIndex| itself. Frame thread.
+    bool live(unsigned int frameIndex) const {
+        return frameIndex >= mLiveFrom.load();
+    }
+
+    void getStats(ReplayStats* stats) const { *stats = mStats; }
+    void dumpStats();
+
+private:
+    static void* run(void* arg);
+    void doReplay();
+
+    MicHistory* mHistory;
+    int mFrameSamples;
+    replay_feed mFeed;
+    void* mCtx;
+    SteeredBeamformer mBeamformer;
+
+    pthread_t mThread;
+    bool mRunning;
+    std::atomic<bool> mAbort;
+    std::atomic<unsigned int> mLiveFrom;
+    unsigned int mNext;
+    int64_t mStartUs;
+    std::vector<char> mMic;
+    std::vector<short> mBeam;
+    ReplayStats mStats;
+};
+
+#endif // UTILS_HISTORYREPLAY_H
@@ -0,0 +1,345 @@
+//
+// Created by ljliu on 19-3-23.
+//
+
+#include "utils/LatencyCalibrator.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "utils/Fft.h"
+
+#define LOG_TAG "LatencyCalibrator"
+#include "utils/LogUtils.h"
+
+// Taper of the chirp's ends, against clicks.
+#define kChirpFadeMs 5
+
+// Smallest size >= |n| made of 2, 3 and 5, which Fft handles.
+static int fft_size(int n) {
+  for (int size = n > 2 ? n : 2; ; size++) {
+    int rest = size;
+    while (rest % 2 == 0) rest /= 2;
+    while (rest % 3 == 0) rest /= 3;
+    while (rest % 5 == 0) rest /= 5;
+    if (rest == 1 && size % 2 == 0) {
+      return size;
+    }
+  }
+}
+
+LatencyCalibrator::LatencyCalibrator(CalibProbe probe, int repeats,
+                                     int micChannels) :
+    mRepeats(repeats),
+    mMicChannels(micChannels),
+    mPeriodSamples(kCalibPeriodMs * kCalibRate / 1000),
+    mRendered(0),
+    mMic(micChannels)
+{
+  if (probe == kProbeChirp) {
+    makeChirp();
+  } else {
+    makeMls();
+  }
+}
+
+// x^12 + x^11 + x^10 + x^4 + 1, a maximal length LFSR: every nonzero state
+// once per 4095 chips.
+void LatencyCalibrator::makeMls()
+{
+  int length = (1 << kCalibMlsOrder) - 1;
+  mProbe.resize(length);
+  unsigned int state = 1;
+  for (int i = 0; i < length; i++) {
+    mProbe[i] = (state & 1) ? 1.0f : -1.0f;
+    unsigned int bit = ((state >> 11) ^ (state >> 10) ^ (state >> 9) ^
+                        (state >> 3)) & 1;
+    state = ((state << 1) | bit) & ((1u << kCalibMlsOrder) - 1);
+  }
+}
+
+// Linear sweep from kCalibChirpFrom to kCalibChirpTo, as long as the MLS.
+void LatencyCalibrator::makeChirp()
+{
+  int length = (1 << kCalibMlsOrder) - 1;
+  int fade = kChirpFadeMs * kCalibRate / 1000;
+  double duration = (double)length / kCalibRate;
+  mProbe.resize(length);
+  for (int i = 0; i < length; i++) {
+    double t = (double)i / kCalibRate;
+    double phase = 2 * M_PI * (kCalibChirpFrom * t +
+        (kCalibChirpTo - kCalibChirpFrom) * t * t / (2 * duration));
+    double gain = 1.0;
+    int edge = i < length - 1 - i ? i : length - 1 - i;
+    if (edge < fade) {
+      gain = 0.5 - 0.5 * cos(M_PI * edge / fade);
+    }
+    mProbe[i] = (float)(gain * sin(phase));
+  }
+}
+
+int LatencyCalibrator::renderProbe(short* out, int samples)
+{
+  int left = totalSamples() - mRendered;
+  if (samples > left) {
+    samples = left;
+  }
+  int length = (int)mProbe.size();
+  for (int i = 0; i < samples; i++) {
+    int offset = (mRendered + i) % mPeriodSamples;
+    out[i] = offset < length
+        ? (short)lrintf(mProbe[offset] * kCalibProbeLevel) : 0;
+  }
+  mRendered += samples;
+  return samples;
+}
+
+int LatencyCalibrator::tailSamples() const
+{
+  return (kCalibMaxDelayMs + 100) * kCalibRate / 1000;
+}
+
+void LatencyCalibrator::addCapture(const short* mic, const short* ref,
+                                   int samples)
+{
+  mRef.insert(mRef.end(), ref, ref + samples);
+  for (int c = 0; c < mMicChannels; c++) {
+    std::vector<float>& channel = mMic[c];
+    for (int i = 0; i < samples; i++) {
+      channel.push_back(mic[i * mMicChannels + c]);
+    }
+  }
+}
+
+// Zero padded past both lengths, so the circular correlation of the FFT
+// is the linear one.
+void LatencyCalibrator::correlate(const std::vector<float>& x,
+                                  std::vector<float>* corr)
+{
+  int n = (int)x.size();
+  int size = fft_size(n + (int)mProbe.size());
+  Fft fft(size);
+  std::vector<float> buffer(size, 0.0f);
+  std::vector<Complex> spectrum(size / 2 + 1);
+  std::vector<Complex> probe(size / 2 + 1);
+
+  memcpy(&buffer[0], &mProbe[0], mProbe.size() * sizeof(float));
+  fft.forwardReal(&buffer[0], &probe[0]);
+
+  memset(&buffer[0], 0, size * sizeof(float));
+  memcpy(&buffer[0], &x[0], n * sizeof(float));
+  fft.forwardReal(&buffer[0], &spectrum[0]);
+
+  // X * conj(P)
+  for (int k = 0; k <= size / 2; k++) {
+    Complex a = spectrum[k];
+    Complex b = probe[k];
+    spectrum[k].re = a.re * b.re + a.im * b.im;
+    spectrum[k].im = a.im * b.re - a.re * b.im;
+  }
+  fft.inverseReal(&spectrum[0], &buffer[0]);
+  corr->assign(buffer.begin(), buffer.begin() + n);
+}
+
+int LatencyCalibrator::measure(LatencyResult* result)
+{
+  memset(result, 0, sizeof(*result));
+  result->channel = -1;
+  int n = (int)mRef.size();
+  int length = (int)mProbe.size();
+  if (n < length) {
+    ALOGE("only %d samples captured", n);
+    return -1;
+  }
+
+  // Where the probes went out: the reference is the probe itself, so its
+  // peaks are clean. The first sample above half the highest peak starts
+  // a probe, its peak is the highest within a probe length.
+  std::vector<float> corr;
+  correlate(mRef, &corr);
+  float highest = 0;
+  for (int k = 0; k < n; k++) {
+    if (corr[k] > highest) {
+      highest = corr[k];
+    }
+  }
+  std::vector<int> onsets;
+  for (int k = 0; k < n && highest > 0; k++) {
+    if (corr[k] < highest * 0.5f) {
+      continue;
+    }
+    int peak = k;
+    for (int j = k; j < n && j < k + length; j++) {
+      if (corr[j] > corr[peak]) {
+        peak = j;
+      }
+    }
+    onsets.push_back(peak);
+    k = peak + mPeriodSamples / 2;
+  }
+  result->probes = (int)onsets.size();
+  if (result->probes == 0) {
+    ALOGE("no probe in the reference, did the player publish to it?");
+    return -1;
+  }
+
+  int minLag = kCalibMinDelayMs * kCalibRate / 1000;
+  int maxLag = kCalibMaxDelayMs * kCalibRate / 1000;
+  std::vector<float> best;
+  float bestRatio = 0;
+  for (int c = 0; c < mMicChannels; c++) {
+    correlate(mMic[c], &corr);
+    std::vector<float> lags;
+    float weakest = 0;
+    for (size_t p = 0; p < onsets.size(); p++) {
+      int from = onsets[p] + minLag > 0 ? onsets[p] + minLag : 0;
+      int to = onsets[p] + maxLag < n ? onsets[p] + maxLag : n - 1;
+      if (to - from < 2) {
+        continue;
+      }
+      // The speaker or mic may invert, look at magnitudes.
+      int peak = from;
+      double sum = 0;
+      for (int k = from; k <= to; k++) {
+        float v = fabsf(corr[k]);
+        sum += v;
+        if (v > fabsf(corr[peak])) {
+          peak = k;
+        }
+      }
+      float ratio = (float)(fabsf(corr[peak]) / (sum / (to - from + 1)));
+      if (ratio < kCalibMinPeakRatio) {
+        continue;
+      }
+      // Parabola through the peak and its neighbours.
+      float offset = 0;
+      if (peak > from && peak < to) {
+        float a = fabsf(corr[peak - 1]);
+        float b = fabsf(corr[peak]);
+        float d = fabsf(corr[peak + 1]);
+        float denom = a - 2 * b + d;
+        if (denom < 0) {
+          offset = 0.5f * (a - d) / denom;
+        }
+      }
+      lags.push_back(peak + offset - onsets[p]);
+      if (weakest == 0 || ratio < weakest) {
+        weakest = ratio;
+      }
+    }
+    if (lags.size() > best.size() ||
+        (lags.size() == best.size() && weakest > bestRatio)) {
+      best = lags;
+      bestRatio = weakest;
+      result->channel = c;
+    }
+  }
+
+  result->found = (int)best.size();
+  result->peakRatio = bestRatio;
+  if (best.empty()) {
+    ALOGE("none of %d probes found on the mics", result->probes);
+    return -1;
+  }
+  double sum = 0;
+  double squares = 0;
+  float lowest = best[0];
+  float highestLag = best[0];
+  for (size_t i = 0; i < best.size(); i++) {
+    sum += best[i];
+    squares += (double)best[i] * best[i];
+    lowest = best[i] < lowest ? best[i] : lowest;
+    highestLag = best[i] > highestLag ? best[i] : highestLag;
+  }
+  double mean = sum / best.size();
+  double variance = squares / best.size() - mean * mean;
+  float msPerSample = 1000.0f / kCalibRate;
+  result->delayMs = (float)mean * msPerSample;
+  result->jitterMs = (float)sqrt(variance > 0 ? variance : 0) * msPerSample;
+  result->minDelayMs = lowest * msPerSample;
+  result->maxDelayMs = highestLag * msPerSample;
+
+  if (result->found * 2 < mRepeats) {
+    ALOGE("only %d of %d probes found", result->found, mRepeats);
+    return -1;
+  }
+  return 0;
+}
+
+/*static*/ int LatencyCalibrator::save(const char* path,
+                                       const LatencyResult& result)
+{
+  FILE* fp = fopen(path, "w");
+  if (fp == NULL) {
+    ALOGE("cannot write %s", path);
+    return -1;
+  }
+  fprintf(fp, "# speaker to mic delay from a loopback calibration\n");
+  fprintf(fp, "delay_ms %.2f\n", result.delayMs);
+  fprintf(fp, "jitter_ms %.2f\n", result.jitterMs);
+  fprintf(fp, "min_delay_ms %.2f\n", result.minDelayMs);
+  fprintf(fp, "max_delay_ms %.2f\n", result.maxDelayMs);
+  fprintf(fp, "probes %d\n", result.probes);
+  fprintf(fp, "found %d\n", result.found);
+  fprintf(fp, "channel %d\n", result.channel);
+  fprintf(fp, "peak_ratio %.1f\n", result.peakRatio);
+  fclose(fp);
+  return 0;
+}
+
+/*static*/ int LatencyCalibrator::load(const char* path, LatencyResult* result)
+{
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  memset(result, 0, sizeof(*result));
+  int ret = -1;
+  char line[128];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    char key[64];
+    float value;
+    if (line[0] == '#' || sscanf(line, "%63s %f", key, &value) != 2) {
+      continue;
+    }
+    if (strcmp(key, "delay_ms") == 0) {
+      result->delayMs = value;
+      ret = 0;
+    } else if (strcmp(key, "jitter_ms") == 0) {
+      result->jitterMs = value;
+    } else if (strcmp(key, "min_delay_ms") == 0) {
+      result->minDelayMs = value;
+    } else if (strcmp(key, "max_delay_ms") == 0) {
+      result->maxDelayMs = value;
+    } else if (strcmp(key, "probes") == 0) {
+      result->probes = (int)value;
+    } else if (strcmp(key, "found") == 0) {
+      result->found = (int)value;
+    } else if (strcmp(key, "channel") == 0) {
+      result->channel = (int)value;
+    } else if (strcmp(key, "peak_ratio") == 0) {
+      result->peakRatio = value;
+    }
+  }
+
+  fclose(fp);
+  return ret;
+}
+
+/*static*/ void LatencyCalibrator::dump(const LatencyResult& result)
+{
+  printf("[latency] %d of %d probes on mic %d: delay %.2f ms, jitter %.2f ms "
+         "(%.2f..%.2f), weakest peak %.1f, configures %d ms\n",
+         result.found, result.probes, result.channel, result.delayMs,
+         result.jitterMs, result.minDelayMs, result.maxDelayMs,
+         result.peakRatio, echoDelayMs(result));
+}
+
+/*static*/ int LatencyCalibrator::echoDelayMs(const LatencyResult& result)
+{
+  float margin = kCalibJitterSigmas * result.jitterMs + kEchoDelayMarginMs;
+  int delay = (int)lrintf(result.delayMs - margin);
+  return delay > 0 ? delay : 0;
+}
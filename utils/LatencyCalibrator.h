@@ -0,0 +1,115 @@
+//
+// Created by ljliu on 19-3-23.
+//
+
+#ifndef UTILS_LATENCYCALIBRATOR_H
+#define UTILS_LATENCYCALIBRATOR_H
+
+#include <stdint.h>
+
+#include <vector>
+
+// Probe format: what the streaming player renders, see kEchoRefRate.
+#define kCalibRate 16000
+// MLS of 2^12 - 1 chips, 256 ms; the chirp is as long.
+#define kCalibMlsOrder 12
+#define kCalibChirpFrom 200.0
+#define kCalibChirpTo 6000.0
+#define kCalibProbeLevel 8000
+// One probe per period, the rest silent so its echo dies down before the
+// next one.
+#define kCalibPeriodMs 600
+#define kCalibRepeats 8
+// Speaker to mic delays searched, from slightly negative (reference
+// timestamps running late) up to this.
+#define kCalibMinDelayMs (-20)
+#define kCalibMaxDelayMs 300
+// A probe counts as found when its correlation peak is this far above the
+// mean magnitude around it.
+#define kCalibMinPeakRatio 8.0f
+// Result file in the DSP config dir, read by MobPipeline.
+#define kLatencyFile "latency.cfg"
+// The delay configured is the measured mean less this many standard
+// deviations of jitter and kEchoDelayMarginMs more, see echoDelayMs().
+#define kCalibJitterSigmas 3
+#define kEchoDelayMarginMs 2
+
+enum CalibProbe {
+    kProbeMls,
+    kProbeChirp,
+};
+
+struct LatencyResult {
+    int probes;                // played
+    int found;                 // ... and located on the mic
+    int channel;               // mic used
+    float delayMs;             // mean speaker to mic delay
+    float jitterMs;            // its standard deviation over the probes
+    float minDelayMs;
+    float maxDelayMs;
+    float peakRatio;           // weakest probe's, see kCalibMinPeakRatio
+};
+
+// Round trip latency of AudioPlayer -> speaker -> mic -> AudioRecord, in
+// the convention of MobPipelineConfig::echoDelayMs.
+//
+// The playback side plays renderProbe() (kCalibRepeats MLS or chirp probes
+// kCalibPeriodMs apart) through a player publishing to an EchoReference.
+// The capture side hands every block of mic channels to addCapture()
+// together with EchoReference::read() of the same span at no delay, the way
+// the echo_ref stage reads it. measure() then finds each probe in that
+// reference and on the mics by FFT cross-correlation; how far the mics lag
+// behind is the delay, its spread over the probes the jitter, and
+// echoDelayMs() the delay to configure from both.
+// The best mic (highest weakest peak) is used.
+//
+// Not thread safe; the capture side may run on another thread than
+// renderProbe() only if the caller serializes them.
+class LatencyCalibrator {
+public:
+    LatencyCalibrator(CalibProbe probe, int repeats, int micChannels);
+
+    // Next |samples| of the playback sequence; returns how many were
+    // written, 0 once it is over.
+    int renderProbe(short* out, int samples);
+    int totalSamples() const { return mRepeats * mPeriodSamples; }
+    // Captured samples to keep going for after the sequence, so the last
+    // echo is in.
+    int tailSamples() const;
+
+    // |samples| frames of |micChannels| interleaved mics and |samples| of
+    // reference played in the same span.
+    void addCapture(const short* mic, const short* ref, int samples);
+    int capturedSamples() const { return (int)mRef.size(); }
+
+    // Returns 0, or -1 when fewer than half of the probes were found.
+    int measure(LatencyResult* result);
+
+    // The result as "key value" lines; load() fills what it finds. Both
+    // return 0 on success.
+    static int save(const char* path, const LatencyResult& result);
+    static int load(const char* path, LatencyResult* result);
+    static void dump(const LatencyResult& result);
+    // Delay to configure for |result|: early enough that a slow probe
+    // still has its reference in time, as a reference arriving a little
+    // early only costs the canceller some taps while a late one cannot be
+    // cancelled at all. Never below 0.
+    static int echoDelayMs(const LatencyResult& result);
+
+private:
+    void makeMls();
+    void makeChirp();
+    // corr[k] = sum_n x[n + k] * probe[n], for k < size.
+    void correlate(const std::vector<float>& x, std::vector<float>* corr);
+
+    int mRepeats;
+    int mMicChannels;
+    int mPeriodSamples;
+    std::vector<float> mProbe;
+    int mRendered;
+    // Captured so far, one vector per mic.
+    std::vector<float> mRef;
+    std::vector<std::vector<float> > mMic;
+};
+
+#endif // UTILS_LATENCYCALIBRATOR_H
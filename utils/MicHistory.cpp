@@ -0,0 +1,95 @@
+//
+// Created by ljliu on 19-3-15.
+//
+
+#include "utils/MicHistory.h"
+
+#include <string.h>
+
+MicHistory::MicHistory() :
+    mBuffer(NULL),
+    mFrameBytes(0),
+    mFrames(0),
+    mHead(0),
+    mCount(0)
+{
+  pthread_mutex_init(&mLock, NULL);
+}
+
+MicHistory::~MicHistory()
+{
+  pthread_mutex_destroy(&mLock);
+}
+
+void MicHistory::attach(char* buffer, int frameBytes, int frames)
+{
+  pthread_mutex_lock(&mLock);
+  mBuffer = buffer;
+  mFrameBytes = buffer != NULL ? frameBytes : 0;
+  mFrames = buffer != NULL ? frames : 0;
+  mHead = 0;
+  mCount = 0;
+  pthread_mutex_unlock(&mLock);
+}
+
+unsigned int MicHistory::head()
+{
+  pthread_mutex_lock(&mLock);
+  unsigned int head = mHead;
+  pthread_mutex_unlock(&mLock);
+  return head;
+}
+
+void MicHistory::push(unsigned int frameIndex, const char* frame)
+{
+  pthread_mutex_lock(&mLock);
+  if (mFrames == 0) {
+    pthread_mutex_unlock(&mLock);
+    return;
+  }
+  if (frameIndex != mHead) {
+    mCount = 0;
+  }
+  memcpy(mBuffer + (size_t)(frameIndex % mFrames) * mFrameBytes, frame,
+         mFrameBytes);
+  mHead = frameIndex + 1;
+  if (mCount < mFrames) {
+    mCount++;
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+int MicHistory::read(unsigned int* next, char* out, int maxFrames,
+                     unsigned int* lost)
+{
+  pthread_mutex_lock(&mLock);
+  unsigned int oldest = mHead - mCount;
+  if ((int)(*next - oldest) < 0) {
+    *lost += oldest - *next;
+    *next = oldest;
+  }
+  int count = (int)(mHead - *next);
+  if (count > maxFrames) {
+    count = maxFrames;
+  }
+  for (int i = 0; i < count; i++) {
+    memcpy(out + (size_t)i * mFrameBytes,
+           mBuffer + (size_t)((*next + i) % mFrames) * mFrameBytes,
+           mFrameBytes);
+  }
+  *next += count > 0 ? count : 0;
+  pthread_mutex_unlock(&mLock);
+  return count > 0 ? count : 0;
+}
+
+bool MicHistory::handOver(unsigned int next,
+                          std::atomic<unsigned int>* liveFrom)
+{
+  pthread_mutex_lock(&mLock);
+  bool caughtUp = next == mHead;
+  if (caughtUp) {
+    liveFrom->store(next);
+  }
+  pthread_mutex_unlock(&mLock);
+  return caughtUp;
+}
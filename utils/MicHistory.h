@@ -0,0 +1,55 @@
+//
+// Created by ljliu on 19-3-15.
+//
+
+#ifndef UTILS_MICHISTORY_H
+#define UTILS_MICHISTORY_H
+
+#include <pthread.h>
+
+#include <atomic>
+
+// Ring of the last raw capture frames, kept so audio from before a decision
+// (e.g. the hotword) can be processed again with what is known now. The
+// memory is handed in by the owner and fixed; frames are pushed by the frame
+// thread and read by any other.
+class MicHistory {
+public:
+    MicHistory();
+    ~MicHistory();
+
+    // Uses |buffer|, |frames| * |frameBytes| bytes owned by the caller, as
+    // the ring and forgets everything held so far. NULL detaches.
+    void attach(char* buffer, int frameBytes, int frames);
+
+    int frameBytes() const { return mFrameBytes; }
+    int capacity() const { return mFrames; }
+    // Index of the frame the next push() stores.
+    unsigned int head();
+
+    // Frame thread only. |frameIndex| follows the previous push, a jump
+    // (restart) empties the ring.
+    void push(unsigned int frameIndex, const char* frame);
+
+    // Copies up to |maxFrames| frames starting at *|next| to |out| and
+    // advances *|next|. Frames already overwritten are skipped and counted
+    // in *|lost|. Returns the number of frames copied.
+    int read(unsigned int* next, char* out, int maxFrames,
+             unsigned int* lost);
+
+    // Hand over from a reader to the live stream: when *|next| is the frame
+    // the next push() stores, sets *|liveFrom| to it and returns true. Runs
+    // under the push lock, so whatever the frame thread does after pushing
+    // that frame sees the new value.
+    bool handOver(unsigned int next, std::atomic<unsigned int>* liveFrom);
+
+private:
+    pthread_mutex_t mLock;
+    char* mBuffer;
+    int mFrameBytes;
+    int mFrames;
+    unsigned int mHead;
+    int mCount;
+};
+
+#endif // UTILS_MICHISTORY_H
@@ -4,20 +4,23 @@
 
 #include "utils/MobPipeline.h"
 
+#include <math.h>
 #include <unistd.h>
+#include <algorithm>
 #include <iostream>
 
 #include "third_party/mobvoidsp/include/mobvoi_dsp.h"
-#include "utils/wav_header.h"
 
 #define LOG_TAG "MobPipeline"
 #include "utils/LogUtils.h"
+#include "utils/TimeUtils.h"
 #include "utils/mobvoi_serial.h"
 
 // #define DETECT_PROCESS_TIME
 
+// Mean square per sample, so levels do not depend on the frame length.
 static unsigned int calculate_energy(const short* buffer, int len) {
-  unsigned int sum = 0;
+  uint64_t sum = 0;
   const short* end = buffer + len;
   const short* buff = buffer;
   while (buff < end) {
@@ -25,25 +28,81 @@ static unsigned int calculate_energy(const short* buffer, int len) {
     buff++;
   }
 
-  return sum;
+  return len > 0 ? (unsigned int)(sum / len) : 0;
+}
+
+// Mean square of one channel of an interleaved block.
+static unsigned int channel_energy(const short* buffer, int frames,
+                                   int channels, int channel) {
+  uint64_t sum = 0;
+  const short* buff = buffer + channel;
+  for (int i = 0; i < frames; i++) {
+    sum += (*buff) * (*buff);
+    buff += channels;
+  }
+
+  return frames > 0 ? (unsigned int)(sum / frames) : 0;
+}
+
+static bool valid_frame_ms(int frameMs) {
+  return frameMs == 10 || frameMs == 16 || frameMs == 20 || frameMs == 32;
+}
+
+// A floor that drops quickly and creeps up slowly.
+static void track_floor(float level, float* floor) {
+  if (*floor <= 0 || level < *floor) {
+    *floor = *floor <= 0 ? level : 0.9f * *floor + 0.1f * level;
+  } else {
+    *floor *= 1.002f;
+  }
+}
+
+// Energy VAD on a mean-square level: a noise floor and a fixed margin
+// above it.
+static bool track_vad(float level, float* floor) {
+  track_floor(level, floor);
+  return level > *floor * kVadRatio && level > kVadMinLevel;
 }
 
 MobPipeline::MobPipeline(speech_callback callback, void* userdata) :
+    MobPipeline(MobPipelineConfig(), callback, userdata)
+{
+}
+
+MobPipeline::MobPipeline(const MobPipelineConfig& config,
+                         speech_callback callback, void* userdata) :
+    mConfig(config),
     mDspInst(NULL),
     mPostDspInst(NULL),
     cb(callback),
     ud(userdata)
 {
   ALOGD("MobPipeline constructer");
-  //10 ms
-  mRecord = new AudioRecord(48000, 2, 10 * 48 * 2 * 2);
+  if (!valid_frame_ms(mConfig.frameMs)) {
+    ALOGE("unsupported frame length %d ms, using 10", mConfig.frameMs);
+    mConfig.frameMs = 10;
+  }
+  mFrameSamples = 16 * mConfig.frameMs;
+  mMicFrameBytes = mFrameSamples * kMicNum * sizeof(short);
+  mEnergyWinFrames = kEnergyWinMs / mConfig.frameMs;
 
-  memset(mEnergyBuffer, 0, sizeof(mEnergyBuffer));
+  if (mConfig.capture) {
+    // One frame per buffer, 48k stereo carries the kMicNum 16k channels.
+    mRecord = new AudioRecord(48000, 2, mConfig.frameMs * 48 * 2 * 2);
+  }
+  mLowPower = mConfig.lowPower;
+
+  pthread_mutex_init(&mCtlLock, NULL);
+  pthread_mutex_init(&mReloadLock, NULL);
+  pthread_mutex_init(&mStatsLock, NULL);
 }
 
 MobPipeline::~MobPipeline()
 {
   ALOGD("MobPipeline destructer");
+  pthread_mutex_destroy(&mCtlLock);
+  pthread_mutex_destroy(&mReloadLock);
+  pthread_mutex_destroy(&mStatsLock);
   if (mRecord != NULL) {
     delete mRecord;
     mRecord = NULL;
@@ -52,108 +111,413 @@ MobPipeline::~MobPipeline()
 
 int MobPipeline::start()
 {
-  if (mRecord == NULL) {
+  if (mConfig.capture && mRecord == NULL) {
     return -1;
   }
 
-  mSerialFD = open_serial("/dev/ttyUSB0", 115200, 8, 1, 'N');
-
-  mDspInst = mobvoi_uplink_init(10, 16000, kMicNum, 16000, 0, kOutNum);
-  const char* path = "/sdcard/mobvoi/dsp";
-  mobvoi_uplink_process_ctl(mDspInst, SET_UPLINK_CONFIG_DIR, (void*)path);
+  int64_t begin = monotonic_us();
 
-#ifdef ENABLE_POST_AEC
-  // mobvoi_uplink_process_ctl(mDspInst, SET_UPLINK_DUMP, 0);
+  if (!mConfig.serialDevice.empty()) {
+    mSerialFD = open_serial(mConfig.serialDevice.c_str(), 115200, 8, 1, 'N');
+  }
 
-  int post_channel = kOutNum / 2 + 1;
-  mPostDspInst =
-      mobvoi_uplink_init(10, 16000, post_channel, 16000, 1, post_channel);
-  path = "/sdcard/mobvoi/dsp_post";
-  mobvoi_uplink_process_ctl(mPostDspInst, SET_UPLINK_CONFIG_DIR, (void*) path);
-  mobvoi_uplink_process_ctl(mPostDspInst, RESUME_AEC, (void*) 0);
-  mobvoi_uplink_process_ctl(mPostDspInst, RESUME_AEC, (void*) 1);
-#endif
+  if (buildStageGraph() != 0) {
+    releaseResources();
+    return -1;
+  }
+  if (mGraph.contains("steer") && !mSteer.loaded()) {
+    std::string weights = mConfig.dspConfigDir + "/" + kSteerWeightFile;
+    if (mSteer.load(weights.c_str()) != 0) {
+      ALOGW("no steered beam without %s", weights.c_str());
+    }
+  }
+  mSteerRunning = false;
 
-  mLooping = true;
-  if (pthread_create(&mThread, NULL, run, this) != 0) {
-    ALOGE("can not create thread");
+  if (createDsp(mConfig.dspConfigDir.c_str(), mConfig.postConfigDir.c_str(),
+                mPostEnabled, mRefEnabled, mConfig.frameMs, &mDspInst,
+                &mPostDspInst) != 0 ||
+      allocFrameBuffers() != 0) {
+    releaseResources();
     return -1;
   }
+  mFrameCount = 0;
+  mLastNoise = -2;
+  mNoiseFloor = 0;
+  mDoaAngle = -1;
+  mDoaAge = 0;
+  mDoaEnergy = 0;
+  mDoaLoudest = -1;
+  mDoaQueries = 0;
+  mDoaEvents = 0;
+  mDoaCached = 0;
+  mEchoDelayMs = mConfig.echoDelayMs;
+  if (mEchoDelayMs < 0) {
+    std::string file = mConfig.dspConfigDir + "/" + kLatencyFile;
+    LatencyResult latency;
+    if (LatencyCalibrator::load(file.c_str(), &latency) == 0) {
+      mEchoDelayMs = LatencyCalibrator::echoDelayMs(latency);
+      ALOGD("echo delay %d ms: %.2f ms measured, jitter %.2f ms, from %s",
+            mEchoDelayMs, latency.delayMs, latency.jitterMs, file.c_str());
+    } else {
+      mEchoDelayMs = 0;
+    }
+  }
+  mEchoCoupling = 0;
+  mRefFrames = 0;
+  mEchoFrames = 0;
+  mSleeping = false;
+  mMicFloor = 0;
+  mQuietFrames = 0;
+  mPreRollHead = 0;
+  mPreRollCount = 0;
+  mWakeStartUs = 0;
+  pthread_mutex_lock(&mStatsLock);
+  memset(&mPower, 0, sizeof(mPower));
+  memset(mPhase, 0, sizeof(mPhase));
+  pthread_mutex_unlock(&mStatsLock);
+  mWatchdog.reset(mConfig.frameMs * 1000, mConfig.maxDegradation);
+  mQuality = kQualityFull;
+  mAsrPhase = false;
+  openDump();
+
+  if (!mConfig.capture) {
+    // Replay pipeline, frames come in through process().
+    return 0;
+  }
+
+  if (mConfig.pool != NULL) {
+    mRecord->setDataCallback(onRecordData, this);
+  } else {
+    mLooping = true;
+    if (pthread_create(&mThread, NULL, run, this) != 0) {
+      ALOGE("can not create thread");
+      mLooping = false;
+      releaseResources();
+      return -1;
+    }
+  }
 
   ALOGD("start record %p", mRecord);
-  return mRecord->startRecording();
+  int ret = mRecord->startRecording();
+  if (ret != 0) {
+    ALOGE("can not start recording");
+    // The loop (or the data callback) is already up, stop() takes it down.
+    stop();
+    return ret;
+  }
+  mLastStartUs = monotonic_us() - begin;
+  ALOGD("start took %lld us", (long long)mLastStartUs);
+  return ret;
 }
 
+// Shutdown order: stop the producer, wake the consumer through the capture
+// layer, let it drain what was already captured (bounded by
+// kStopTimeoutMs), then tear down serial and DSP once nothing can touch
+// them any more.
 int MobPipeline::stop()
 {
-  if (mRecord == NULL) {
-    return -1;
+  int64_t begin = monotonic_us();
+  int ret = 0;
+  if (mRecord != NULL) {
+    mStopDeadlineUs = begin + kStopTimeoutMs * 1000;
+    ALOGD("stop record %p", mRecord);
+    if (mConfig.pool != NULL) {
+      mRecord->setDataCallback(NULL, NULL);
+      ret = mRecord->stop();
+      mConfig.pool->cancel(this);
+      drainFrames();
+    } else {
+      mLooping = false;
+      ret = mRecord->stop();
+      mRecord->interrupt();
+      pthread_join(mThread, NULL);
+    }
   }
 
+  releaseResources();
+
+  mLastStopUs = monotonic_us() - begin;
+  ALOGD("stop took %lld us, drained %d frames",
+        (long long)mLastStopUs, mDrainedFrames);
+  return ret;
+}
+
+// Everything start() acquires, in reverse. Also the way out of a failed
+// start(), so each step copes with what was never set up.
+void MobPipeline::releaseResources()
+{
+  pthread_mutex_lock(&mCtlLock);
   if (mSerialFD >= 0) {
     close(mSerialFD);
+    mSerialFD = -1;
+  }
+  pthread_mutex_unlock(&mCtlLock);
+
+  // A reload still in flight either hands its instances back or waits
+  // for the one it retired; both need the loop to be gone already.
+  pthread_mutex_lock(&mReloadLock);
+  if (mReloading) {
+    mReloadAbort = true;
+    pthread_join(mReloadThread, NULL);
+    mReloading = false;
   }
+  pthread_mutex_unlock(&mReloadLock);
+
+  destroyDsp(mDspInst, mPostDspInst);
+  mDspInst = NULL;
+  mPostDspInst = NULL;
+
+  closeDump();
+  mHistory.attach(NULL, 0, 0);
+  mArena.release();
+  mCleanBuffer = NULL;
+  mPostOutBuffer = NULL;
+  mRefBuffer = NULL;
+  mEnergyBuffer = NULL;
+  mPreRoll = NULL;
+  mPreRollUs = NULL;
+}
+
+// Process frames that were captured before stop() but not consumed yet,
+// giving up at mStopDeadlineUs so stop() stays bounded.
+void MobPipeline::drainFrames()
+{
+  mDrainedFrames = 0;
+  while (monotonic_us() < mStopDeadlineUs) {
+    char* buffer;
+    int64_t captureUs;
+    int size = mRecord->obtainBuffer(&buffer, false, &captureUs);
+    if (size <= 0) {
+      break;
+    }
 
-  mLooping = false;
-  pthread_join(mThread, NULL);
+    process(buffer, size, captureUs);
+    mRecord->releaseBuffer(buffer);
+    mDrainedFrames++;
+  }
+}
 
-  if (mDspInst != NULL) {
-    mobvoi_uplink_cleanup(mDspInst);
-    mDspInst = NULL;
+// With |withRef| the uplink takes the played audio as its one speaker
+// channel and runs its AEC on it, like the post instance does.
+// Returns -1, with nothing left allocated, when an instance can not be
+// created.
+/*static*/ int MobPipeline::createDsp(const char* dspDir,
+                                      const char* postDir, bool withPost,
+                                      bool withRef, int frameMs, void** dsp,
+                                      void** post)
+{
+  *post = NULL;
+  *dsp = mobvoi_uplink_init(frameMs, 16000, kMicNum, 16000,
+                            withRef ? 1 : 0, kOutNum);
+  if (*dsp == NULL) {
+    ALOGE("can not create uplink instance for %s", dspDir);
+    return -1;
+  }
+  mobvoi_uplink_process_ctl(*dsp, SET_UPLINK_CONFIG_DIR, (void*)dspDir);
+  if (withRef) {
+    mobvoi_uplink_process_ctl(*dsp, RESUME_AEC, (void*) 0);
+    mobvoi_uplink_process_ctl(*dsp, RESUME_AEC, (void*) 1);
   }
 
-#ifdef ENABLE_POST_AEC
-  if (mPostDspInst != NULL) {
-    mobvoi_uplink_cleanup(mPostDspInst);
-    mPostDspInst = NULL;
+  if (!withPost) {
+    return 0;
   }
-#endif
 
-  ALOGD("stop record %p", mRecord);
-  return mRecord->stop();
+  // mobvoi_uplink_process_ctl(*dsp, SET_UPLINK_DUMP, 0);
+
+  int post_channel = kOutNum / 2 + 1;
+  *post = mobvoi_uplink_init(frameMs, 16000, post_channel, 16000, 1,
+                             post_channel);
+  if (*post == NULL) {
+    ALOGE("can not create post instance for %s", postDir);
+    mobvoi_uplink_cleanup(*dsp);
+    *dsp = NULL;
+    return -1;
+  }
+  mobvoi_uplink_process_ctl(*post, SET_UPLINK_CONFIG_DIR, (void*)postDir);
+  mobvoi_uplink_process_ctl(*post, RESUME_AEC, (void*) 0);
+  mobvoi_uplink_process_ctl(*post, RESUME_AEC, (void*) 1);
+  return 0;
+}
+
+/*static*/ void MobPipeline::destroyDsp(void* dsp, void* post)
+{
+  if (dsp != NULL) {
+    mobvoi_uplink_cleanup(dsp);
+  }
+
+  if (post != NULL) {
+    mobvoi_uplink_cleanup(post);
+  }
 }
 
-int MobPipeline::GetEnergy(int index, int frame) {
-  int f = (frame - kEnergyWinLen * 4 / 10) % kEnergyWinLen;
-  int sum = 0;
-  for (int i = f; i < (f + kEnergyWinLen / 2); i++) {
-    sum += (mEnergyBuffer[index][i % kEnergyWinLen] / 160);
+int MobPipeline::reload(const char* dspConfigDir, const char* postConfigDir)
+{
+  if (mDspInst == NULL) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&mReloadLock);
+  if (mReloading) {
+    if (!mReloadDone) {
+      pthread_mutex_unlock(&mReloadLock);
+      ALOGW("reload already in progress");
+      return -1;
+    }
+    pthread_join(mReloadThread, NULL);
+    mReloading = false;
+  }
+  if (dspConfigDir != NULL) {
+    mConfig.dspConfigDir = dspConfigDir;
+  }
+  if (postConfigDir != NULL) {
+    mConfig.postConfigDir = postConfigDir;
+  }
+
+  mReloadAbort = false;
+  mReloadDone = false;
+  mReloading = true;
+  int ret = 0;
+  if (pthread_create(&mReloadThread, NULL, runReload, this) != 0) {
+    ALOGE("can not create reload thread");
+    mReloading = false;
+    ret = -1;
   }
+  pthread_mutex_unlock(&mReloadLock);
+  return ret;
+}
 
-  return sum;
+/*static*/ void* MobPipeline::runReload(void* arg)
+{
+  MobPipeline* pipeline = (MobPipeline*)arg;
+  pipeline->doReload();
+  return NULL;
 }
 
-int MobPipeline::GetHotwordAngle(std::vector<double> frames)
+// Builds the new instances off the audio thread, publishes them for the
+// loop to pick up at the next frame boundary, then frees whatever the loop
+// retired. The loop itself only swaps pointers.
+void MobPipeline::doReload()
 {
-  int index = 0;
-  int energy = 0;
-  for (int i = 0; i < frames.size(); i++) {
-    if (frames[i] != 0) {
-      int e = GetEnergy(i, frames[i]);
-      std::cout << i << " " << e << std::endl;
-      if (e > energy) {
-        index = i;
-        energy = e;
+  int64_t begin = monotonic_us();
+
+  std::string dspDir = mConfig.dspConfigDir;
+  DspInstances* fresh = new DspInstances;
+  if (createDsp(dspDir.c_str(), mConfig.postConfigDir.c_str(),
+                mPostEnabled, mRefEnabled, mConfig.frameMs, &fresh->dsp,
+                &fresh->post) != 0) {
+    // The loop keeps running on the instances it has.
+    ALOGE("reload %s failed, keeping the current instances", dspDir.c_str());
+    delete fresh;
+    mReloadDone = true;
+    return;
+  }
+  int64_t built = monotonic_us();
+
+  mPendingDsp.store(fresh);
+
+  DspInstances* retired = NULL;
+  while ((retired = mRetiredDsp.exchange(NULL)) == NULL) {
+    if (mReloadAbort) {
+      // stop() joined the loop first: it either never took the new
+      // instances, which are dropped, or retired the old ones by now.
+      retired = mPendingDsp.exchange(NULL);
+      if (retired == NULL) {
+        retired = mRetiredDsp.exchange(NULL);
       }
+      break;
     }
+    usleep(5 * 1000);
+  }
+  int64_t swapped = monotonic_us();
+  if (retired == NULL) {
+    ALOGW("reload %s aborted with nothing to free", dspDir.c_str());
+    mReloadDone = true;
+    return;
   }
 
-  if (mSerialFD >= 0) {
-    send_command(mSerialFD, 2, CMD_SET_LED_ON, index);
+  pthread_mutex_lock(&mCtlLock);
+  destroyDsp(retired->dsp, retired->post);
+  pthread_mutex_unlock(&mCtlLock);
+  delete retired;
+
+  ALOGD("reload %s: build %lld us, swap after %lld us",
+        dspDir.c_str(), (long long)(built - begin),
+        (long long)(swapped - built));
+  mReloadDone = true;
+}
+
+// Called by the loop at a frame boundary.
+void MobPipeline::swapPendingDsp()
+{
+  DspInstances* fresh = mPendingDsp.exchange(NULL);
+  if (fresh == NULL) {
+    return;
   }
 
-  std::cout << "SelectOneBF: max " << index << std::endl;
+  void* dsp = mDspInst;
+  void* post = mPostDspInst;
+  mDspInst = fresh->dsp;
+  mPostDspInst = fresh->post;
+  fresh->dsp = dsp;
+  fresh->post = post;
+  mRetiredDsp.store(fresh);
+
+  // The cached angle belongs to the old instance.
+  mDoaAngle = -1;
+}
+
+// Every per-frame buffer lives in the arena, sized and placed once here so
+// the loop itself never touches the heap.
+int MobPipeline::allocFrameBuffers()
+{
+  int post_channel = kOutNum / 2 + 1;
+  // One channel more for the steered beam.
+  size_t cleanBytes = mFrameSamples * (kOutNum + 1) * sizeof(short);
+  size_t postBytes = mFrameSamples * post_channel * sizeof(short);
+  size_t refBytes = mFrameSamples * sizeof(short);
+  size_t energyRow =
+      FrameArena::padded(mEnergyWinFrames * sizeof(unsigned long));
+
+  size_t preRollBytes = (size_t)mConfig.preRollFrames * mMicFrameBytes;
+  size_t preRollUsBytes = (size_t)mConfig.preRollFrames * sizeof(int64_t);
+  int historyFrames = mConfig.historyMs / mConfig.frameMs;
+  size_t historyBytes = (size_t)historyFrames * mMicFrameBytes;
 
-  mob_doa_result p;
-  int frame = frames[index];
-  p.offset = mFrameCount > frame ? (mFrameCount - frame) : 0;
-  int ret = mobvoi_uplink_process_ctl(mDspInst, GET_DOA_RESULT, &p);
-  if (ret != MOB_DSP_ERROR_NONE)
-    return INVALID_ANGLE;
+  size_t total = FrameArena::padded(cleanBytes) +
+                 FrameArena::padded(postBytes) +
+                 FrameArena::padded(refBytes) +
+                 energyRow * kOutNum +
+                 FrameArena::padded(preRollBytes) +
+                 FrameArena::padded(preRollUsBytes) +
+                 FrameArena::padded(historyBytes);
+  if (mArena.init(total) != 0) {
+    return -1;
+  }
 
-  ALOGD("%s: %d", __FUNCTION__, (int)p.angle);
+  //16k * 12channels * frameMs;
+  mCleanBuffer = mArena.alloc<short>(mFrameSamples * (kOutNum + 1));
+  mPostOutBuffer = mArena.alloc<short>(mFrameSamples * post_channel);
+  mRefBuffer = mArena.alloc<short>(mFrameSamples);
+  mEnergyStride = energyRow / sizeof(unsigned long);
+  mEnergyBuffer = mArena.alloc<unsigned long>(mEnergyStride * kOutNum);
+  mPreRoll = preRollBytes > 0 ? mArena.alloc<char>(preRollBytes) : NULL;
+  mPreRollUs = preRollBytes > 0
+      ? mArena.alloc<int64_t>(mConfig.preRollFrames) : NULL;
+  mHistory.attach(historyBytes > 0 ? mArena.alloc<char>(historyBytes) : NULL,
+                  mMicFrameBytes, historyFrames);
 
-  return p.angle;
+  ALOGD("frame arena %u bytes", (unsigned)mArena.capacity());
+  return 0;
+}
+
+void MobPipeline::SetLed(int beam)
+{
+  pthread_mutex_lock(&mCtlLock);
+  if (mSerialFD >= 0) {
+    send_command(mSerialFD, 2, CMD_SET_LED_ON, beam);
+  }
+  pthread_mutex_unlock(&mCtlLock);
 }
 
 int MobPipeline::GetMaxNoise(int angle, int frame_idx) {
@@ -187,6 +551,7 @@ int MobPipeline::GetMaxNoise(int angle, int frame_idx) {
     ii = 0;
   }
 #elif kOutNum == 8
+  int ii = -1;
   if (angle >= 0 && angle < 23) {
     ii = 0;
   } else if (angle >= 23 && angle < 68) {
@@ -207,17 +572,22 @@ int MobPipeline::GetMaxNoise(int angle, int frame_idx) {
     ii = 0;
   }
 #endif
+  if (ii < 0) {
+    return -1;
+  }
+
   // std::cout << "ii: " << ii << ", last: " << mLastMaxNoiseIdx
-  //           << ", energy: " << mEnergyBuffer[ii][frame_idx]
+  //           << ", energy: " << energyAt(ii, frame_idx)
   //           << std::endl;
-  if (mEnergyBuffer[ii][frame_idx] > 6000000UL &&
+  // 6000000 over a 160 sample frame, now a mean square.
+  if (energyAt(ii, frame_idx) > 37500UL &&
       (mLastMaxNoiseIdx == ii || ii == (mLastMaxNoiseIdx + 1) % kOutNum ||
        mLastMaxNoiseIdx == (ii + 1) % kOutNum)) {
-    if (mLastMaxNoiseDur < kEnergyWinLen * 2) {
+    if (mLastMaxNoiseDur < mEnergyWinFrames * 2) {
       mLastMaxNoiseDur++;
     }
 
-    if (mLastMaxNoiseDur >= kEnergyWinLen) {
+    if (mLastMaxNoiseDur >= mEnergyWinFrames) {
       mNoiseSelected = true;
       return mLastMaxNoiseIdx;
     }
@@ -239,24 +609,25 @@ int MobPipeline::GetMaxNoise(int angle, int frame_idx) {
 }
 
 void MobPipeline::PostAEC(short* buffer, int noise_idx) {
+  int n = mFrameSamples;
   mobvoi_uplink_send_ref_frames(mPostDspInst,
-      buffer + 160 * noise_idx, 160, 1, 0);
+      buffer + n * noise_idx, n, 1, 0);
 
   int post_channel = kOutNum / 2 + 1;
   for (int i = 0; i < post_channel; i++) {
     mobvoi_uplink_send_mic_frames_per_channel(mPostDspInst,
-        buffer + 160 * ((noise_idx + kOutNum / 4 + i) % kOutNum),
-        160, i, 0);
+        buffer + n * ((noise_idx + kOutNum / 4 + i) % kOutNum),
+        n, i, 0);
   }
 
-  short out[kOutNum / 2 + 1][160] = {0};
+  short* out = mPostOutBuffer;
   mobvoi_uplink_process(mPostDspInst,
-      NULL, 160 * post_channel, post_channel, 0, (short*) out, post_channel);
+      NULL, n * post_channel, post_channel, 0, out, post_channel);
 
   for (int i = 0; i < post_channel; i++) {
-    memcpy(buffer + 160 * ((noise_idx + kOutNum / 4 + i) % kOutNum),
-           out[i],
-           160 * sizeof(short));
+    memcpy(buffer + n * ((noise_idx + kOutNum / 4 + i) % kOutNum),
+           out + n * i,
+           n * sizeof(short));
   }
 }
 
@@ -267,141 +638,688 @@ static inline int64_t current_timestamp() {
   return milliseconds;
 }
 
-void MobPipeline::doLoop()
+void MobPipeline::openDump()
 {
-  //16k * 12channels * 10ms;
-  short* cleanBuffer = new short[10 * 16 * kOutNum];
+#ifdef MOB_DUMP_AUDIO
+  wav_header_init(&mMicWav);
+  wav_header_init(&mCleanWav);
+
+  std::string dir = mConfig.dumpDir + "/";
+  mDumpMicFP = fopen((dir + "mic_audio.wav").c_str(), "wb");
+  fwrite(&mMicWav, sizeof(wav_header), 1, mDumpMicFP);
+  mDumpCleanFP = fopen((dir + "clean_audio.wav").c_str(), "wb");
+  fwrite(&mCleanWav, sizeof(wav_header), 1, mDumpCleanFP);
+
+  mDumpBytes = 0;
+#endif
+}
 
+void MobPipeline::closeDump()
+{
 #ifdef MOB_DUMP_AUDIO
-  wav_header micWav;
-  wav_header_init(&micWav);
-  wav_header cleanWav;
-  wav_header_init(&cleanWav);
-
-  //wav_header header;
-  //wav_header_init(&header);
-  mDumpMicFP = fopen("/sdcard/dump/mic_audio.wav", "wb");
-  fwrite(&micWav, sizeof(wav_header), 1, mDumpMicFP);
-  mDumpCleanFP = fopen("/sdcard/dump/clean_audio.wav", "wb");
-  fwrite(&cleanWav, sizeof(wav_header), 1, mDumpCleanFP);
-
-  int dataBytes = 0;
+  if (mDumpMicFP == NULL || mDumpCleanFP == NULL) {
+    return;
+  }
+  int dataBytes = mDumpBytes;
+  printf("dataBytes %d\n", dataBytes);
+  int dataBytesPerChannel = dataBytes / kMicNum;
+  mMicWav.num_channels = kMicNum;
+  mMicWav.sample_rate = 16000;
+  mMicWav.byte_rate = 16000 * kMicNum * 2;
+  mMicWav.bit_depth = 16;
+  mMicWav.sample_alignment =
+      mMicWav.num_channels * mMicWav.bit_depth / (short)8;
+  mMicWav.wav_size =
+      (dataBytesPerChannel * mMicWav.num_channels + sizeof(wav_header) - 8);
+  mMicWav.data_bytes = dataBytesPerChannel * mMicWav.num_channels;
+  rewind(mDumpMicFP);
+  fwrite(&mMicWav, sizeof(wav_header), 1, mDumpMicFP);
+
+  mCleanWav.num_channels = kOutNum;
+  mCleanWav.sample_rate = 16000;
+  mCleanWav.byte_rate = 16000 * kOutNum * 2;
+  mCleanWav.bit_depth = 16;
+  mCleanWav.sample_alignment =
+      mCleanWav.num_channels * mCleanWav.bit_depth / (short)8;
+  mCleanWav.wav_size =
+      (dataBytesPerChannel * mCleanWav.num_channels + sizeof(wav_header) - 8);
+  mCleanWav.data_bytes = dataBytesPerChannel * mCleanWav.num_channels;
+  rewind(mDumpCleanFP);
+  fwrite(&mCleanWav, sizeof(wav_header), 1, mDumpCleanFP);
+  if (mDumpMicFP) {
+    fclose(mDumpMicFP);
+    mDumpMicFP = NULL;
+  }
+  if (mDumpCleanFP) {
+    fclose(mDumpCleanFP);
+    mDumpCleanFP = NULL;
+  }
 #endif
+}
 
-  while(mLooping) {
-    char* buffer;
-    int size = mRecord->obtainBuffer(&buffer, true);
-    if (size <= 0) {
-      continue;
+/*static*/ const StageDesc MobPipeline::sStageTable[] = {
+  { "echo_ref",     kLayoutNone,           kLayoutNone,       stageEchoRef,
+    NULL },
+  { "uplink",       kLayoutMicInterleaved, kLayoutBeamPlanar, stageUplink,
+    "?echo_ref" },
+  { "energy",       kLayoutBeamPlanar,     kLayoutNone,       stageEnergy,
+    NULL },
+  { "echo_gate",    kLayoutNone,           kLayoutNone,       stageEchoGate,
+    "energy,?echo_ref" },
+  { "doa",          kLayoutNone,           kLayoutNone,       stageDoa,
+    "?energy" },
+  { "steer",        kLayoutNone,           kLayoutNone,       stageSteer,
+    NULL },
+  { "noise_select", kLayoutNone,           kLayoutNone,       stageNoiseSelect,
+    "energy,doa" },
+  { "post_aec",     kLayoutBeamPlanar,     kLayoutBeamPlanar, stagePostAec,
+    "noise_select" },
+  { "callback",     kLayoutBeamPlanar,     kLayoutNone,       stageCallback,
+    NULL },
+};
+
+// Graph from config.stages, else PipelineParam in <dsp dir>/pipeline.cfg,
+// else the built-in chain.
+int MobPipeline::buildStageGraph()
+{
+  char spec[256];
+  std::string cfg = mConfig.dspConfigDir + "/pipeline.cfg";
+  if (!mConfig.stages.empty()) {
+    snprintf(spec, sizeof(spec), "%s", mConfig.stages.c_str());
+  } else if (load_stage_spec(cfg.c_str(), spec, sizeof(spec)) != 0) {
+    snprintf(spec, sizeof(spec), "%s", kDefaultStages);
+  }
+
+  ALOGD("stages: %s", spec);
+  if (mGraph.build(spec, sStageTable,
+                   sizeof(sStageTable) / sizeof(sStageTable[0]),
+                   this, kLayoutMicInterleaved) != 0) {
+    ALOGE("invalid stage graph: %s", spec);
+    return -1;
+  }
+
+  mPostEnabled = mGraph.contains("post_aec");
+  mRefEnabled = mGraph.contains("echo_ref");
+  if (!mGraph.contains("callback")) {
+    ALOGW("no callback stage, clean audio is not delivered");
+  }
+  return 0;
+}
+
+// What the speaker played into this frame: the capture span ends about at
+// captureUs and its echo left the speaker mEchoDelayMs earlier. Has to run
+// before uplink, which consumes the reference together with the mics.
+/*static*/ int MobPipeline::stageEchoRef(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  int n = self->mFrameSamples;
+  short* ref = self->mRefBuffer;
+  EchoReference* echoRef = self->mEchoRef.load();
+  int played = 0;
+  if (echoRef != NULL) {
+    int64_t startUs = ctx->meta->captureUs -
+        (self->mConfig.frameMs + self->mEchoDelayMs) * 1000LL;
+    played = echoRef->read(startUs, ref, n);
+  } else {
+    memset(ref, 0, n * sizeof(short));
+  }
+
+  mobvoi_uplink_send_ref_frames(self->mDspInst, ref, n, 1, 0);
+  ctx->refEnergy = played > 0 ? calculate_energy(ref, n) : 0;
+  if (played > 0) {
+    self->mRefFrames++;
+  }
+  return 0;
+}
+
+/*static*/ int MobPipeline::stageUplink(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  int processedSamples =
+      mobvoi_uplink_process(self->mDspInst,
+                            ctx->mic,
+                            ctx->micSamples,
+                            6, // 6 * 16000 == 2 * 48000
+                            0,
+                            ctx->beams,
+                            kOutNum);
+  ctx->samplesPerChannel = processedSamples / kOutNum;
+  return 0;
+}
+
+/*static*/ int MobPipeline::stageEnergy(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  int n = ctx->samplesPerChannel;
+  unsigned int loudest = 0;
+  for (int i = 0; i < kOutNum; i++) {
+    unsigned int energy = calculate_energy(ctx->beams + n * i, n);
+    self->energyAt(i, ctx->energySlot) = energy;
+    ctx->meta->beamEnergy[i] = energy;
+    if (energy > loudest) {
+      loudest = energy;
     }
+  }
 
-#ifdef MOB_DUMP_AUDIO
-    dataBytes += size;
-    fwrite(buffer, size, 1, mDumpMicFP);
+  // Cheap VAD on the loudest beam.
+  ctx->meta->vad = track_vad((float)loudest, &self->mNoiseFloor);
+  return 0;
+}
+
+// Marks frames where the loudest beam is hardly more than the reference
+// coupled into the mics. The coupling (beam over reference energy) is
+// tracked as a floor over frames with playback: residual echo after the
+// AEC sets it, speech on top of the playback lifts the ratio above it.
+/*static*/ int MobPipeline::stageEchoGate(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  FrameMeta* meta = ctx->meta;
+  meta->refEnergy = ctx->refEnergy;
+  if (ctx->refEnergy < kEchoMinLevel) {
+    return 0;
+  }
+
+  unsigned int loudest = 0;
+  for (int i = 0; i < kOutNum; i++) {
+    if (meta->beamEnergy[i] > loudest) {
+      loudest = meta->beamEnergy[i];
+    }
+  }
+  float ratio = (float)loudest / ctx->refEnergy;
+  track_floor(ratio, &self->mEchoCoupling);
+  meta->echo = ratio < self->mEchoCoupling * kEchoGateRatio;
+  if (meta->echo) {
+    self->mEchoFrames++;
+  }
+  return 0;
+}
+
+// The angle only feeds noise selection, which already holds its choice
+// for a whole energy window, so it is sampled instead of queried per frame:
+// every doaDecimation frames, or right away when the sound field changes
+// (see doaDue()). Frames in between get the cached result.
+/*static*/ int MobPipeline::stageDoa(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  if (!self->doaDue(ctx)) {
+    self->mDoaAge++;
+    self->mDoaCached++;
+    ctx->doaAngle = self->mDoaAngle;
+    return 0;
+  }
+
+  mob_doa_result res;
+  res.offset = 0;
+  int ret = mobvoi_uplink_process_ctl(self->mDspInst, GET_DOA_RESULT, &res);
+  if (ret == MOB_DSP_ERROR_NONE) {
+    self->mDoaAngle = (int)res.angle;
+  }
+  self->mDoaQueries++;
+  self->mDoaAge = 1;
+  ctx->doaAngle = self->mDoaAngle;
+  return 0;
+}
+
+// Decides whether this frame queries the DSP, and remembers the energy
+// picture of the frames that do. Needs the energy stage for events; without
+// it only the decimation applies.
+bool MobPipeline::doaDue(const FrameContext* ctx)
+{
+  unsigned long total = 0;
+  unsigned int loudestEnergy = 0;
+  int loudest = -1;
+  for (int i = 0; i < kOutNum; i++) {
+    unsigned int energy = ctx->meta->beamEnergy[i];
+    total += energy;
+    if (energy > loudestEnergy) {
+      loudestEnergy = energy;
+      loudest = i;
+    }
+  }
+
+  bool due = mDoaAngle < 0 || mDoaAge >= mConfig.doaDecimation;
+  if (!due && mConfig.doaEnergyJump > 0 && total > 0 &&
+      mDoaAge >= kDoaEventGap) {
+    float jump = mConfig.doaEnergyJump;
+    bool event = total > mDoaEnergy * jump || total * jump < mDoaEnergy ||
+        (ctx->meta->vad && loudest != mDoaLoudest);
+    if (event) {
+      mDoaEvents++;
+      due = true;
+    }
+  }
+
+  if (due) {
+    mDoaEnergy = total;
+    mDoaLoudest = loudest;
+  }
+  return due;
+}
+
+/*static*/ int MobPipeline::stageNoiseSelect(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  if (ctx->doaAngle < 0) {
+    return 0;
+  }
+
+  int noise_idx = self->GetMaxNoise(ctx->doaAngle, ctx->energySlot);
+  if (self->mLastNoise != noise_idx) {
+    self->mLastNoise = noise_idx;
+    std::cout << "Noise channel: " << noise_idx
+              << ", energy: "
+              << (noise_idx >= 0 ? self->energyAt(noise_idx, ctx->energySlot)
+                                 : 0)
+              << ", doa: " << ctx->doaAngle
+              << std::endl;
+  }
+  ctx->noiseIdx = noise_idx;
+  return 0;
+}
+
+// Reads the raw mics, so its place in the chain only matters for timing;
+// the beam goes behind the DSP beams in the same buffer.
+/*static*/ int MobPipeline::stageSteer(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  if (!self->mSteerOn) {
+    self->mSteerRunning = false;
+    return 0;
+  }
+  if (!self->mSteerRunning) {
+    // Do not overlap-add into whatever was left from the last time.
+    self->mSteer.reset();
+    self->mSteerRunning = true;
+  }
+  int n = ctx->micSamples / kMicNum;
+  if (ctx->samplesPerChannel > 0 && ctx->samplesPerChannel < n) {
+    n = ctx->samplesPerChannel;
+  }
+  if (self->mSteer.process(ctx->mic, n,
+                           ctx->beams + kSteeredChannel * n) == n) {
+    ctx->steerAngle = self->mSteer.angle();
+  }
+  return 0;
+}
+
+int MobPipeline::steerBeam(int angle)
+{
+  if (angle < 0) {
+    mSteerOn = false;
+    return -1;
+  }
+  if (!mGraph.contains("steer")) {
+    return -1;
+  }
+  int steered = mSteer.steer(angle);
+  mSteerOn = steered >= 0;
+  return steered;
+}
+
+/*static*/ int MobPipeline::stagePostAec(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+  if (ctx->noiseIdx >= 0 && ctx->noiseIdx < kOutNum) {
+    self->PostAEC(ctx->beams, ctx->noiseIdx);
+    ctx->postAecActive = true;
+  }
+  return 0;
+}
+
+/*static*/ int MobPipeline::stageCallback(void* owner, FrameContext* ctx)
+{
+  MobPipeline* self = (MobPipeline*)owner;
+#ifdef FRAME_ARENA_COUNT_ALLOCS
+  // The consumer may allocate as it likes; only our own stages are checked.
+  int64_t before = FrameArena::threadAllocations();
 #endif
 
-#ifdef DETECT_PROCESS_TIME
-    uint64_t start = current_timestamp();
+  FrameMeta* meta = ctx->meta;
+  meta->doaAngle = ctx->doaAngle;
+  meta->noiseIdx = ctx->noiseIdx;
+  meta->postAecActive = ctx->postAecActive;
+  meta->steerAngle = ctx->steerAngle;
+  meta->processUs = monotonic_us() - ctx->startUs;
+
+  int n = ctx->samplesPerChannel;
+  int channels = kOutNum + (ctx->steerAngle >= 0 ? 1 : 0);
+  BeamFrame frame(ctx->beams, channels, n, n, 16000, ctx->frameIndex);
+  self->cb(self->ud, frame, *meta);
+
+#ifdef FRAME_ARENA_COUNT_ALLOCS
+  self->mConsumerAllocations += FrameArena::threadAllocations() - before;
+#endif
+  return 0;
+}
+
+int MobPipeline::process(const char* buffer, int size, int64_t captureUs)
+{
+  swapPendingDsp();
+
+#ifdef MOB_DUMP_AUDIO
+  mDumpBytes += size;
+  fwrite(buffer, size, 1, mDumpMicFP);
 #endif
 
-    int processedSamples =
-        mobvoi_uplink_process(mDspInst,
-                              (const short*)buffer,
-                              size >> 1,
-                              6, // 6 * 16000 == 2 * 48000
-                              0,
-                              cleanBuffer,
-                              kOutNum);
-
-    int cur_frame = mFrameCount % kEnergyWinLen;
-    for (int i = 0; i < kOutNum; i++) {
-      mEnergyBuffer[i][cur_frame] =
-          calculate_energy(cleanBuffer + 160 * i, 160);
+  int64_t begin = monotonic_us();
+  if (captureUs == 0) {
+    captureUs = begin;
+  }
+  if (lowPowerStep(buffer, size, captureUs)) {
+    pthread_mutex_lock(&mStatsLock);
+    mPower.sleepFrames++;
+    mPower.sleepUs += monotonic_us() - begin;
+    pthread_mutex_unlock(&mStatsLock);
+    return 0;
+  }
+
+  int ret = mPreRollCount > 0 ? catchUp(buffer, size, captureUs, begin)
+                              : runFrame(buffer, size, captureUs);
+
+  int64_t end = monotonic_us();
+  int phase = mAsrPhase ? 1 : 0;
+  bool caughtUp = mWakeStartUs != 0 && mPreRollCount == 0;
+  pthread_mutex_lock(&mStatsLock);
+  mPower.awakeFrames++;
+  mPower.awakeUs += end - begin;
+  if (caughtUp) {
+    mPower.lastWakeUs = end - mWakeStartUs;
+    if (mPower.lastWakeUs > mPower.maxWakeUs) {
+      mPower.maxWakeUs = mPower.lastWakeUs;
     }
+  }
+  mPhase[phase].frames++;
+  mPhase[phase].us += end - begin;
+  pthread_mutex_unlock(&mStatsLock);
 
-#ifdef ENABLE_POST_AEC
-    static int last_noise = -2;
-    mob_doa_result res;
-    res.offset = 0;
-    int ret = mobvoi_uplink_process_ctl(mDspInst, GET_DOA_RESULT, &res);
-    if (ret == MOB_DSP_ERROR_NONE) {
-      int noise_idx = GetMaxNoise((int)res.angle, cur_frame);
-      if (last_noise != noise_idx) {
-        last_noise = noise_idx;
-        std::cout << "Noise channel: " << noise_idx
-                  << ", energy: " << mEnergyBuffer[noise_idx][cur_frame]
-                  << ", doa: " << (int)res.angle
-                  << std::endl;
-      }
-      if (noise_idx >= 0 && noise_idx < kOutNum) {
-        PostAEC(cleanBuffer, noise_idx);
-      }
+  if (caughtUp) {
+    ALOGD("low power: caught up in %lld us", (long long)(end - mWakeStartUs));
+    mWakeStartUs = 0;
+  } else if (mWakeStartUs == 0) {
+    // Catching up on the pre-roll after a wake is not overload.
+    const char* cause = NULL;
+    int level = mWatchdog.update(end - begin, &cause);
+    if (level != mQuality) {
+      applyQuality(level, cause);
+    }
+  }
+  return ret;
+}
+
+// Steps of the degradation ladder. Every level keeps the cuts of the ones
+// before it; the hotword subset is up to the consumer via FrameMeta.quality.
+void MobPipeline::applyQuality(int level, const char* cause)
+{
+  ALOGW("quality %s -> %s: %s", quality_name(mQuality), quality_name(level),
+        cause);
+  if (mPostEnabled) {
+    mGraph.setEnabled("post_aec", level < kQualityNoPostAec);
+  }
+  mQuality = level;
+}
+
+// Low-power listening. Returns true when the frame was absorbed while
+// asleep, false when it has to go through the chain. Waking leaves the
+// pre-roll for catchUp(), which runs it ahead of the caller's frame.
+bool MobPipeline::lowPowerStep(const char* buffer, int size,
+                               int64_t captureUs)
+{
+  if (!mLowPower && !mSleeping) {
+    return false;
+  }
+  if (size != mMicFrameBytes) {
+    // Only whole capture blocks are buffered; anything else stays awake.
+    return false;
+  }
+
+  const short* mic = (const short*)buffer;
+  int frames = size / (2 * kMicNum);
+  unsigned int energy =
+      std::max(channel_energy(mic, frames, kMicNum, kWakeMicA),
+               channel_energy(mic, frames, kMicNum, kWakeMicB));
+  bool active = track_vad((float)energy, &mMicFloor) || mHoldAwake;
+
+  if (!mSleeping) {
+    mQuietFrames = active ? 0 : mQuietFrames + 1;
+    if (mLowPower && mQuietFrames >= mConfig.lowPowerHangFrames &&
+        mPreRollCount == 0) {
+      mSleeping = true;
+      mPreRollHead = 0;
+      mPreRollCount = 0;
+      ALOGD("low power: sleep at frame %u", mFrameCount);
     }
+    return false;
+  }
+
+  if (!active && mLowPower) {
+    pushPreRoll(buffer, captureUs);
+    return true;
+  }
+
+  mWakeStartUs = monotonic_us();
+  mSleeping = false;
+  mQuietFrames = 0;
+  pthread_mutex_lock(&mStatsLock);
+  mPower.wakeups++;
+  pthread_mutex_unlock(&mStatsLock);
+  ALOGD("low power: wake at frame %u, %d frames to replay", mFrameCount,
+        mPreRollCount);
+  return false;
+}
+
+// After a wake the pre-roll is a backlog in front of the live frames. Each
+// call replays from it within kPreRollBudget of a frame period, oldest
+// first, and queues the live frame behind it; at least kPreRollMinFrames
+// per call so the backlog shrinks. A wake costs a few busy frames instead
+// of one taking preRollFrames periods.
+int MobPipeline::catchUp(const char* buffer, int size, int64_t captureUs,
+                         int64_t begin)
+{
+  if (size != mMicFrameBytes) {
+    // Only whole blocks are queued; this one waits for the backlog.
+    while (mPreRollCount > 0) {
+      replayPreRoll();
+    }
+    return runFrame(buffer, size, captureUs);
+  }
+
+  int64_t budgetUs = mConfig.frameMs * 1000LL * kPreRollBudget / 100;
+  int ret = replayPreRoll();
+  pushPreRoll(buffer, captureUs);
+  for (int replayed = 1; mPreRollCount > 0; replayed++) {
+    if (replayed >= kPreRollMinFrames &&
+        monotonic_us() - begin >= budgetUs) {
+      break;
+    }
+    ret = replayPreRoll();
+  }
+  return ret;
+}
+
+// Keeps the newest preRollFrames capture blocks with their timestamps.
+void MobPipeline::pushPreRoll(const char* buffer, int64_t captureUs)
+{
+  if (mConfig.preRollFrames <= 0) {
+    return;
+  }
+  memcpy(mPreRoll + mPreRollHead * mMicFrameBytes, buffer, mMicFrameBytes);
+  mPreRollUs[mPreRollHead] = captureUs;
+  mPreRollHead = (mPreRollHead + 1) % mConfig.preRollFrames;
+  if (mPreRollCount < mConfig.preRollFrames) {
+    mPreRollCount++;
+  }
+}
+
+// Runs the oldest buffered block, stamped with its own capture time so the
+// echo reference and FrameMeta line up with when it was heard.
+int MobPipeline::replayPreRoll()
+{
+  int slot = (mPreRollHead - mPreRollCount + mConfig.preRollFrames) %
+      mConfig.preRollFrames;
+  mPreRollCount--;
+  return runFrame(mPreRoll + slot * mMicFrameBytes, mMicFrameBytes,
+                  mPreRollUs[slot]);
+}
+
+// One frame through the stage graph.
+int MobPipeline::runFrame(const char* buffer, int size, int64_t captureUs)
+{
+#ifdef FRAME_ARENA_COUNT_ALLOCS
+  int64_t allocations = FrameArena::threadAllocations();
+  mConsumerAllocations = 0;
 #endif
 
 #ifdef DETECT_PROCESS_TIME
-    uint64_t end1 = current_timestamp();
+  uint64_t start = current_timestamp();
 #endif
 
-    cb(ud, (char*)cleanBuffer, 160 * 2 * kOutNum);
+  FrameMeta* meta = &mMeta;
+  memset(meta, 0, sizeof(*meta));
+  meta->frameIndex = mFrameCount;
+  meta->captureUs = captureUs;
+  meta->quality = mQuality;
+  meta->frameMs = mConfig.frameMs;
+
+  FrameContext ctx;
+  ctx.meta = meta;
+  ctx.mic = (const short*)buffer;
+  ctx.micSamples = size >> 1;
+  ctx.beams = mCleanBuffer;
+  ctx.samplesPerChannel = 0;
+  ctx.frameIndex = mFrameCount;
+  ctx.energySlot = mFrameCount % mEnergyWinFrames;
+  ctx.doaAngle = -1;
+  ctx.noiseIdx = -1;
+  ctx.steerAngle = -1;
+  ctx.refEnergy = 0;
+  ctx.postAecActive = false;
+  ctx.startUs = monotonic_us();
+  // Before the stages, so the callback of this frame can already find it.
+  mHistory.push(mFrameCount, buffer);
+  mGraph.run(&ctx);
 
 #ifdef DETECT_PROCESS_TIME
-    uint64_t end2 = current_timestamp();
+  uint64_t end = current_timestamp();
 
-    if (end2 - start > 10) {
-      std::cout << "Process too long: " << (end2 - start)
-                << ", " << (end1 - start) << std::endl;
-    }
+  if (end - start > 10) {
+    std::cout << "Process too long: " << (end - start) << std::endl;
+  }
 #endif
 
-    mFrameCount++;
+  mFrameCount++;
+
+#ifdef FRAME_ARENA_COUNT_ALLOCS
+  int64_t own = FrameArena::threadAllocations() - allocations -
+      mConsumerAllocations;
+  if (mFrameCount > kWarmupFrames && own != 0) {
+    ALOGE("frame %u: %lld heap allocations in steady state", mFrameCount,
+          (long long)own);
+  }
+#endif
 
 #ifdef MOB_DUMP_AUDIO
-    int samplesPerChannel = processedSamples / kOutNum;
-    for (int i = 0; i < samplesPerChannel; i++) {
-      for (int j = 0; j < kOutNum; j++) {
-        fwrite(cleanBuffer + i + samplesPerChannel * j , 2, 1, mDumpCleanFP);
-      }
+  int samplesPerChannel = ctx.samplesPerChannel;
+  for (int i = 0; i < samplesPerChannel; i++) {
+    for (int j = 0; j < kOutNum; j++) {
+      fwrite(mCleanBuffer + i + samplesPerChannel * j , 2, 1, mDumpCleanFP);
     }
+  }
 #endif
 
-    mRecord->releaseBuffer(buffer);
+  return ctx.samplesPerChannel * kOutNum;
+}
+
+void MobPipeline::getPowerStats(PowerStats* stats) const
+{
+  pthread_mutex_lock(&mStatsLock);
+  *stats = mPower;
+  pthread_mutex_unlock(&mStatsLock);
+}
+
+void MobPipeline::dumpStageStats()
+{
+  mGraph.dumpStats("[stage]");
+  if (mGraph.contains("doa")) {
+    unsigned int frames = mDoaQueries + mDoaCached;
+    printf("[stage] doa: %u queries (%u on energy events), %u cached, "
+           "%.1f%% of frames\n",
+           mDoaQueries, mDoaEvents, mDoaCached,
+           frames > 0 ? 100.0 * mDoaQueries / frames : 0.0);
+  }
+
+  if (mGraph.contains("steer")) {
+    mSteer.dumpStats();
   }
 
-  delete [] cleanBuffer;
+  if (mRefEnabled) {
+    EchoReference* echoRef = mEchoRef.load();
+    EchoRefStats ref;
+    memset(&ref, 0, sizeof(ref));
+    if (echoRef != NULL) {
+      echoRef->getStats(&ref);
+    }
+    printf("[stage] echo_ref: delay %d ms, %u frames with playback, %u gated "
+           "as echo, %lld samples published, %u resyncs\n",
+           mEchoDelayMs, mRefFrames, mEchoFrames,
+           (long long)ref.publishedSamples, ref.resyncs);
+  }
 
-#ifdef MOB_DUMP_AUDIO
-  printf("dataBytes %d\n", dataBytes);
-  int dataBytesPerChannel = dataBytes / kMicNum;
-  micWav.num_channels = kMicNum;
-  micWav.sample_rate = 16000;
-  micWav.byte_rate = 16000 * kMicNum * 2;
-  micWav.bit_depth = 16;
-  micWav.sample_alignment = micWav.num_channels * micWav.bit_depth / (short)8;
-  micWav.wav_size =
-      (dataBytesPerChannel * micWav.num_channels + sizeof(wav_header) - 8);
-  micWav.data_bytes = dataBytesPerChannel * micWav.num_channels;
-  rewind(mDumpMicFP);
-  fwrite(&micWav, sizeof(wav_header), 1, mDumpMicFP);
-
-  cleanWav.num_channels = kOutNum;
-  cleanWav.sample_rate = 16000;
-  cleanWav.byte_rate = 16000 * kOutNum * 2;
-  cleanWav.bit_depth = 16;
-  cleanWav.sample_alignment =
-      cleanWav.num_channels * cleanWav.bit_depth / (short)8;
-  cleanWav.wav_size =
-      (dataBytesPerChannel * cleanWav.num_channels + sizeof(wav_header) - 8);
-  cleanWav.data_bytes = dataBytesPerChannel * cleanWav.num_channels;
-  rewind(mDumpCleanFP);
-  fwrite(&cleanWav, sizeof(wav_header), 1, mDumpCleanFP);
-  if (mDumpMicFP) {
-    fclose(mDumpMicFP);
+  WatchdogStats watchdog;
+  mWatchdog.getStats(&watchdog);
+  printf("[watchdog] %s, %u of %u frames over budget, worst slack %lld us, "
+         "%u transitions\n",
+         quality_name(watchdog.level), watchdog.misses, watchdog.frames,
+         (long long)watchdog.worstSlackUs, watchdog.transitions);
+
+  PhaseStats phases[2];
+  PowerStats power;
+  pthread_mutex_lock(&mStatsLock);
+  memcpy(phases, mPhase, sizeof(phases));
+  power = mPower;
+  pthread_mutex_unlock(&mStatsLock);
+
+  // Both with all beams computed; the ASR average differs only by what
+  // the stages themselves do differently, e.g. steering.
+  static const char* phaseNames[] = { "hotword", "asr" };
+  for (int i = 0; i < 2; i++) {
+    const PhaseStats& phase = phases[i];
+    printf("[phase] %s: %u frames, avg %lld us\n", phaseNames[i],
+           phase.frames,
+           phase.frames > 0 ? (long long)(phase.us / phase.frames) : 0LL);
   }
-  if (mDumpCleanFP) {
-    fclose(mDumpCleanFP);
+
+  printf("[power] sleep %u frames avg %lld us, awake %u frames avg %lld us, "
+         "%u wakeups, wake latency last %lld us max %lld us\n",
+         power.sleepFrames,
+         power.sleepFrames > 0 ?
+             (long long)(power.sleepUs / power.sleepFrames) : 0LL,
+         power.awakeFrames,
+         power.awakeFrames > 0 ?
+             (long long)(power.awakeUs / power.awakeFrames) : 0LL,
+         power.wakeups, (long long)power.lastWakeUs,
+         (long long)power.maxWakeUs);
+}
+
+void MobPipeline::doLoop()
+{
+  while(mLooping) {
+    char* buffer;
+    int64_t captureUs;
+    int size = mRecord->obtainBuffer(&buffer, true, &captureUs);
+    if (size < 0) {
+      // Interrupted by stop() with nothing left to read.
+      break;
+    }
+    if (size == 0) {
+      continue;
+    }
+
+    process(buffer, size, captureUs);
+
+    mRecord->releaseBuffer(buffer);
   }
-#endif
+
+  drainFrames();
 }
 
 /*static*/ void* MobPipeline::run(void *arg)
@@ -412,3 +1330,28 @@ void MobPipeline::doLoop()
   pipeline->doLoop();
   return NULL;
 }
+
+// Recorder callback in pool mode: each filled buffer becomes one job that
+// must finish before the next buffer is due.
+/*static*/ void MobPipeline::onRecordData(void* context)
+{
+  MobPipeline* pipeline = (MobPipeline*)context;
+  pipeline->mConfig.pool->submit(pipeline, runPoolFrame, pipeline,
+                                 monotonic_us() +
+                                     pipeline->mConfig.frameMs * 1000);
+}
+
+/*static*/ void MobPipeline::runPoolFrame(void* arg)
+{
+  MobPipeline* pipeline = (MobPipeline*)arg;
+  char* buffer;
+  int64_t captureUs;
+  int size = pipeline->mRecord->obtainBuffer(&buffer, false, &captureUs);
+  if (size <= 0) {
+    return;
+  }
+
+  pipeline->process(buffer, size, captureUs);
+
+  pipeline->mRecord->releaseBuffer(buffer);
+}
@@ -5,63 +5,416 @@
 #ifndef UTILS_MOBPIPELINE_H
 #define UTILS_MOBPIPELINE_H
 
+#include <atomic>
+#include <string>
 #include <vector>
 
+#include <stdint.h>
 #include <stdio.h>
 #include <pthread.h>
 
 #include "utils/AudioRecord.h"
+#include "utils/DeadlineWatchdog.h"
+#include "utils/EchoReference.h"
+#include "utils/FrameArena.h"
+#include "utils/FrameView.h"
+#include "utils/LatencyCalibrator.h"
+#include "utils/MicHistory.h"
+#include "utils/PipelineWorkerPool.h"
+#include "utils/StageGraph.h"
+#include "utils/SteeredBeamformer.h"
 
 // #define kMicNum (4)
 #define kMicNum (6)
 #define kOutNum (kMicNum * 2)
 
-#define kEnergyWinLen 200
+// Beam energy history used for noise beam selection, and its length in
+// frames at the shortest frame.
+#define kEnergyWinMs 2000
+#define kEnergyWinLen (kEnergyWinMs / kMinFrameMs)
 
-#define ENABLE_POST_AEC
+// Supported DSP frame lengths; see MobPipelineConfig::frameMs.
+#define kMinFrameMs 10
+#define kMaxFrameMs 32
+
+// Energy VAD: loudest beam this far above the tracked floor, and above an
+// absolute mean-square level.
+#define kVadRatio 4.0f
+#define kVadMinLevel 1000.0f
+
+// Raw capture channels watched in low-power mode, opposite on the ring.
+#define kWakeMicA 0
+#define kWakeMicB (kMicNum / 2)
+
+// Degraded modes keep every kSubsetStride-th beam, starting at beam 0.
+#define kSubsetStride 2
+
+// While the steer stage is on, the callback frame carries one more channel
+// after the DSP beams: the beam synthesized towards steerBeam()'s angle.
+// It is built from the raw mics, without the DSP's AEC and gain.
+#define kSteeredChannel kOutNum
+// Weight table of the fixed beams, in the DSP config dir.
+#define kSteerWeightFile "6mic_ring_80mm_weights.txt"
+
+// Echo gate: a frame is echo when the loudest beam is within this factor of
+// the tracked echo coupling (beam over reference energy), while the
+// reference is above an absolute mean-square level.
+#define kEchoGateRatio 2.0f
+#define kEchoMinLevel 1000.0f
+
+// Minimum frames between two event driven DOA queries.
+#define kDoaEventGap 3
+
+// Pre-roll replay after a wake: share of a frame period spent on it per
+// frame, and the least frames replayed per frame whatever the time.
+#define kPreRollBudget 50
+#define kPreRollMinFrames 2
+
+// Frames after start() before the zero-allocation check of
+// FRAME_ARENA_COUNT_ALLOCS builds kicks in.
+#define kWarmupFrames 100
+
+// Upper bound for draining captured frames in stop().
+#define kStopTimeoutMs 100
+
+// Uplink processing chain when neither MobPipelineConfig::stages nor
+// pipeline.cfg in the DSP config dir says otherwise.
+#define kDefaultStages \
+    "echo_ref,uplink,energy,echo_gate,doa,steer,noise_select,post_aec," \
+    "callback"
 
 // #define MOB_DUMP_AUDIO
 
-typedef void (*speech_callback)(void* ud, char* buffer, int length);
+#ifdef MOB_DUMP_AUDIO
+#include "utils/wav_header.h"
+#endif
+
+// Side information computed for one frame, delivered together with its
+// audio so consumers never have to query the pipeline.
+struct FrameMeta {
+    unsigned int frameIndex;
+    int frameMs;
+    int64_t captureUs;         // monotonic_us() at the end of its capture
+    int processUs;             // stage time before the callback
+    int doaAngle;              // degrees, -1 when unknown
+    int noiseIdx;              // beam fed to PostAEC as noise, -1 if none
+    bool postAecActive;
+    bool vad;                  // energy based voice activity
+    int quality;               // QualityLevel the frame was processed at
+    int steerAngle;            // kSteeredChannel look direction, -1 if none
+    unsigned int refEnergy;    // played reference, mean square per sample
+    bool echo;                 // mostly playback echo, see kEchoGateRatio
+    unsigned int beamEnergy[kOutNum];  // mean square per sample
+};
+
+// Clean beams of one frame, kOutNum planar channels (plus kSteeredChannel
+// while steering), and their metadata.
+// Both are only valid during the call; take sub-views (frame.channel(i))
+// instead of offsets and copy the meta if it is needed later.
+typedef void (*speech_callback)(void* ud, const BeamFrame& frame,
+                                const FrameMeta& meta);
+
+// Everything that used to be hard-coded per process. Each MobPipeline owns
+// its own copy, so several arrays (or replay streams) can run side by side.
+struct MobPipelineConfig {
+    // Serial port of the LED ring, empty to disable.
+    std::string serialDevice = "/dev/ttyUSB0";
+    std::string dspConfigDir = "/sdcard/mobvoi/dsp";
+    std::string postConfigDir = "/sdcard/mobvoi/dsp_post";
+    // Where MOB_DUMP_AUDIO writes mic_audio.wav and clean_audio.wav.
+    std::string dumpDir = "/sdcard/dump";
+    // Open the OpenSL recorder. Replay pipelines turn this off and push
+    // frames through process().
+    bool capture = true;
+    // Shared workers; NULL runs the pipeline on a dedicated thread.
+    PipelineWorkerPool* pool = nullptr;
+    // Comma separated stage names; empty reads pipeline.cfg.
+    std::string stages;
+    // DSP frame length in ms: 10, 16, 20 or 32. Longer frames trade
+    // latency for fewer calls; capture period, DSP init, energy windows and
+    // the callback all follow it. Counts below are in frames.
+    int frameMs = 10;
+    // Query GET_DOA_RESULT every doaDecimation frames and reuse the cached
+    // angle in between; 1 queries every frame.
+    int doaDecimation = 10;
+    // Query early when the total beam energy moves by more than this
+    // factor (either way) since the last query, or the loudest beam
+    // changes during speech. 0 disables event queries.
+    float doaEnergyJump = 4.0f;
+    // Low-power listening: after lowPowerHangFrames quiet frames only an
+    // energy VAD on two raw mics runs. The first active frame wakes the
+    // chain, which then works through up to preRollFrames of buffered
+    // capture ahead of the live frames (a few per frame, see catchUp()) so
+    // the start of the wake word still reaches the hotword.
+    bool lowPower = false;
+    int lowPowerHangFrames = 200;
+    int preRollFrames = 30;
+    // Deepest QualityLevel the deadline watchdog may step down to under
+    // sustained overload; kQualityFull turns degradation off.
+    int maxDegradation = kQualityHotwordSubset;
+    // Keep this many ms of raw capture in micHistory(), e.g. to re-beamform
+    // what was said before the hotword was confirmed. 0 keeps none.
+    int historyMs = 0;
+    // Speaker to mic delay of the played reference, output and input
+    // latency included. Negative takes it from kLatencyFile in the DSP
+    // config dir (written by test_loopback) less a jitter margin, see
+    // LatencyCalibrator::echoDelayMs(), 0 without one. 0 hands the
+    // canceller the reference early, which it tolerates better than late.
+    int echoDelayMs = -1;
+};
+
+// process() time outside and during an ASR phase, see markAsrPhase().
+struct PhaseStats {
+    unsigned int frames;
+    int64_t us;
+};
+
+// Time spent in process() per mode, and wake transitions.
+struct PowerStats {
+    unsigned int sleepFrames;
+    int64_t sleepUs;
+    unsigned int awakeFrames;
+    int64_t awakeUs;
+    unsigned int wakeups;
+    int64_t lastWakeUs;        // wake detection until the pre-roll is done
+    int64_t maxWakeUs;
+};
 
 class MobPipeline {
 public:
     MobPipeline(speech_callback callback, void* ud);
+    MobPipeline(const MobPipelineConfig& config,
+                speech_callback callback, void* ud);
     ~MobPipeline();
 
     int start();
     int stop();
-    int GetEnergy(int index, int frame);
-    int GetHotwordAngle(std::vector<double> frames);
+
+    // Run one frameMs block of interleaved mic samples through the chain.
+    // |captureUs| is monotonic_us() at the end of the block's capture (see
+    // AudioRecord::obtainBuffer()); 0 takes the time of the call, for
+    // replayed audio.
+    int process(const char* buffer, int size, int64_t captureUs = 0);
+
+    const MobPipelineConfig& config() const { return mConfig; }
+    int frameMs() const { return mConfig.frameMs; }
+    // Samples per channel of one frame at 16k.
+    int frameSamples() const { return mFrameSamples; }
+    // Bytes of one capture block, kMicNum interleaved channels at 16k.
+    int micFrameBytes() const { return mMicFrameBytes; }
+
+    // Rebuild the DSP instances from the (possibly new) config dirs on a
+    // background thread and swap them in at the next frame boundary. NULL
+    // keeps the current dir. Returns -1 if not started or already busy.
+    int reload(const char* dspConfigDir = NULL,
+               const char* postConfigDir = NULL);
+
+    // Duration of the last start()/stop(), for restart-cycle profiling.
+    int64_t lastStartUs() const { return mLastStartUs; }
+    int64_t lastStopUs() const { return mLastStopUs; }
+
+    // Bytes held by the per-frame buffers (frame arena) while started.
+    size_t memoryFootprint() const { return mArena.capacity(); }
+
+    // Per-stage call count and time since start().
+    void dumpStageStats();
+    StageGraph& stageGraph() { return mGraph; }
+    // Toggle low-power listening at runtime; holdAwake() keeps the chain
+    // running regardless (e.g. while a dialog is open). Any thread.
+    void setLowPower(bool enable) { mLowPower = enable; }
+    void holdAwake(bool hold) { mHoldAwake = hold; }
+    bool sleeping() const { return mSleeping; }
+    void getPowerStats(PowerStats* stats) const;
+
+    // Books process() time from the next frame on under the ASR phase of
+    // the [phase] lines in dumpStageStats(), until cleared. Any thread.
+    // Only for the stats: the DSP computes all kOutNum beams either way,
+    // the uplink library cannot drop beams at runtime, so ASR saves no DSP
+    // CPU.
+    void markAsrPhase(bool asr) { mAsrPhase = asr; }
+
+    // Current QualityLevel picked by the deadline watchdog.
+    int quality() const { return mQuality; }
+    void getWatchdogStats(WatchdogStats* stats) const {
+        mWatchdog.getStats(stats);
+    }
+
+    // Synthesize kSteeredChannel towards |angle| degrees, the DOA
+    // convention; -1 turns it off. A direction not cached yet is designed on
+    // the calling thread (well under a millisecond per step) while frames
+    // keep the previous one. Returns the angle used, quantized to
+    // kSteerAngleStep, or -1 without a steer stage or weight table.
+    int steerBeam(int angle);
+    void getSteerStats(SteerStats* stats) { mSteer.getStats(stats); }
+
+    // Raw capture of the last historyMs, indexed by FrameMeta::frameIndex.
+    // Filled while started; sleeping frames are not part of it.
+    MicHistory& micHistory() { return mHistory; }
+
+    // Played audio for the echo_ref stage, e.g. attached to the TTS
+    // player; NULL feeds silence. Any thread.
+    void setEchoReference(EchoReference* ref) { mEchoRef = ref; }
+
+    // Point the LED ring at |beam|.
+    void SetLed(int beam);
 
     int GetMaxNoise(int angle, int frame_idx);
     void PostAEC(short* buffer, int noise_idx);
 
 private:
+    struct DspInstances {
+        void* dsp;
+        void* post;
+    };
+
+    static int createDsp(const char* dspDir, const char* postDir,
+                         bool withPost, bool withRef, int frameMs,
+                         void** dsp, void** post);
+    static void destroyDsp(void* dsp, void* post);
+    static void* runReload(void* arg);
+    void doReload();
+    void swapPendingDsp();
+    int runFrame(const char* buffer, int size, int64_t captureUs);
+    bool lowPowerStep(const char* buffer, int size, int64_t captureUs);
+    int catchUp(const char* buffer, int size, int64_t captureUs,
+                int64_t begin);
+    void pushPreRoll(const char* buffer, int64_t captureUs);
+    int replayPreRoll();
+
+    static const StageDesc sStageTable[];
+    int buildStageGraph();
+    static int stageEchoRef(void* owner, FrameContext* ctx);
+    static int stageUplink(void* owner, FrameContext* ctx);
+    static int stageEnergy(void* owner, FrameContext* ctx);
+    static int stageEchoGate(void* owner, FrameContext* ctx);
+    static int stageDoa(void* owner, FrameContext* ctx);
+    static int stageNoiseSelect(void* owner, FrameContext* ctx);
+    static int stageSteer(void* owner, FrameContext* ctx);
+    static int stagePostAec(void* owner, FrameContext* ctx);
+    static int stageCallback(void* owner, FrameContext* ctx);
+
     static void* run(void* arg);
     void doLoop();
+    void drainFrames();
+    void releaseResources();
+    int allocFrameBuffers();
+    unsigned long& energyAt(int beam, int frame) {
+        return mEnergyBuffer[beam * mEnergyStride + frame];
+    }
+    static void onRecordData(void* context);
+    static void runPoolFrame(void* arg);
+    void openDump();
+    void closeDump();
 
+    MobPipelineConfig mConfig;
+    int mFrameSamples = 0;
+    int mMicFrameBytes = 0;
+    int mEnergyWinFrames = 0;
     AudioRecord* mRecord = nullptr;
 
     void* mDspInst = nullptr;
     void* mPostDspInst = nullptr;
 
+    // Hot reload: the reload thread parks new instances in mPendingDsp,
+    // the loop swaps them in and hands the old ones back via mRetiredDsp.
+    std::atomic<DspInstances*> mPendingDsp{nullptr};
+    std::atomic<DspInstances*> mRetiredDsp{nullptr};
+    pthread_t mReloadThread;
+    bool mReloading = false;
+    std::atomic<bool> mReloadDone{false};
+    std::atomic<bool> mReloadAbort{false};
+    // Serializes control calls from other threads against freeing a
+    // retired instance.
+    pthread_mutex_t mCtlLock;
+    // Serializes reload() against stop() joining the reload thread.
+    pthread_mutex_t mReloadLock;
+
     pthread_t mThread;
-    bool mLooping = false;
+    std::atomic<bool> mLooping{false};
+    int64_t mStopDeadlineUs = 0;
+    int mDrainedFrames = 0;
+    int64_t mLastStartUs = 0;
+    int64_t mLastStopUs = 0;
 
     speech_callback cb = nullptr;
     void* ud = nullptr;
     int mSerialFD = -1;
 
+    StageGraph mGraph;
+    bool mPostEnabled = false;
+    bool mRefEnabled = false;
+    int64_t mConsumerAllocations = 0;
+    FrameMeta mMeta;
+
+    FrameArena mArena;
+    short* mCleanBuffer = nullptr;
+    short* mPostOutBuffer = nullptr;
+    short* mRefBuffer = nullptr;
+    // kOutNum rows of mEnergyWinFrames, each row padded to a cache line.
+    unsigned long* mEnergyBuffer = nullptr;
+    int mEnergyStride = 0;
+
     unsigned int mFrameCount = 0;
-    unsigned long mEnergyBuffer[kOutNum][kEnergyWinLen] = {0};
     int mLastMaxNoiseIdx = -1;
     int mLastMaxNoiseDur = 0;
     bool mNoiseSelected = false;
+    int mLastNoise = -2;
+    float mNoiseFloor = 0;
+
+    // Played reference, see stageEchoRef() and stageEchoGate().
+    std::atomic<EchoReference*> mEchoRef{nullptr};
+    int mEchoDelayMs = 0;      // resolved echoDelayMs
+    float mEchoCoupling = 0;
+    unsigned int mRefFrames = 0;
+    unsigned int mEchoFrames = 0;
+
+    // DOA sampling, see stageDoa().
+    bool doaDue(const FrameContext* ctx);
+    int mDoaAngle = -1;
+    int mDoaAge = 0;
+    unsigned long mDoaEnergy = 0;
+    int mDoaLoudest = -1;
+    unsigned int mDoaQueries = 0;
+    unsigned int mDoaEvents = 0;
+    unsigned int mDoaCached = 0;
+
+    // Steered beam, see steerBeam().
+    SteeredBeamformer mSteer;
+    std::atomic<bool> mSteerOn{false};
+    bool mSteerRunning = false;
+
+    // Deadline watchdog, see applyQuality().
+    void applyQuality(int level, const char* cause);
+    DeadlineWatchdog mWatchdog;
+    std::atomic<int> mQuality{kQualityFull};
+    // See markAsrPhase().
+    std::atomic<bool> mAsrPhase{false};
+    // process() time outside / during ASR. Guarded by mStatsLock, like
+    // mPower.
+    PhaseStats mPhase[2];
+
+    // Low-power mode, see lowPowerStep().
+    std::atomic<bool> mLowPower{false};
+    std::atomic<bool> mHoldAwake{false};
+    std::atomic<bool> mSleeping{false};
+    float mMicFloor = 0;
+    int mQuietFrames = 0;
+    char* mPreRoll = nullptr;
+    int64_t* mPreRollUs = nullptr;
+    MicHistory mHistory;
+    int mPreRollHead = 0;
+    int mPreRollCount = 0;
+    int64_t mWakeStartUs = 0;
+    PowerStats mPower;
+    // Held only to copy the counters in and out, never across a frame.
+    mutable pthread_mutex_t mStatsLock;
 
 #ifdef MOB_DUMP_AUDIO
     FILE* mDumpMicFP = nullptr;
     FILE* mDumpCleanFP = nullptr;
+    wav_header mMicWav;
+    wav_header mCleanWav;
+    int mDumpBytes = 0;
 #endif //MOB_DUMP_AUDIO
 };
 
@@ -3,32 +3,143 @@
 //
 
 #include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #include "NativeAudioBase.h"
 
-NativeAudioBase::NativeAudioBase()
+#define LOG_TAG "NativeAudioBase"
+#include "LogUtils.h"
+#include "TimeUtils.h"
+
+static pthread_mutex_t sEngineLock = PTHREAD_MUTEX_INITIALIZER;
+static SLObjectItf sEngineObject = NULL;
+static SLEngineItf sEngineEngine = NULL;
+static SLObjectItf sOutputMixObject = NULL;
+static AudioEngineStats sStats;
+
+NativeAudioBase::NativeAudioBase() :
+    mEngineEngine(NULL)
 {
-    SLresult result;
-    // create engine
-    result = slCreateEngine(&mEngineObject, 0, NULL, 0, NULL, NULL);
-    assert(SL_RESULT_SUCCESS == result);
-
-    // realize the engine
-    result = (*mEngineObject)->Realize(mEngineObject, SL_BOOLEAN_FALSE);
-    assert(SL_RESULT_SUCCESS == result);
-
-    // get the engine interface, which is needed in order to create other objects
-    result = (*mEngineObject)->GetInterface(mEngineObject, SL_IID_ENGINE, &mEngineEngine);
-    assert(SL_RESULT_SUCCESS == result);
+    // Only count the user here; the engine is realized on first use.
+    pthread_mutex_lock(&sEngineLock);
+    sStats.users++;
+    pthread_mutex_unlock(&sEngineLock);
 }
 
 NativeAudioBase::~NativeAudioBase()
 {
-    // destroy engine object, and invalidate all associated interfaces
-    if (mEngineObject != NULL) {
-        (*mEngineObject)->Destroy(mEngineObject);
-        mEngineObject = NULL;
-        mEngineEngine = NULL;
+    pthread_mutex_lock(&sEngineLock);
+    if (--sStats.users == 0) {
+        // destroy output mix and engine objects, and invalidate all
+        // associated interfaces
+        if (sOutputMixObject != NULL) {
+            (*sOutputMixObject)->Destroy(sOutputMixObject);
+            sOutputMixObject = NULL;
+        }
+        if (sEngineObject != NULL) {
+            (*sEngineObject)->Destroy(sEngineObject);
+            sEngineObject = NULL;
+            sEngineEngine = NULL;
+        }
+    }
+    pthread_mutex_unlock(&sEngineLock);
+    mEngineEngine = NULL;
+}
+
+int NativeAudioBase::acquireEngine()
+{
+    pthread_mutex_lock(&sEngineLock);
+    if (sEngineEngine == NULL) {
+        int64_t begin = monotonic_us();
+        SLresult result;
+        // create engine
+        result = slCreateEngine(&sEngineObject, 0, NULL, 0, NULL, NULL);
+        if (SL_RESULT_SUCCESS == result) {
+            // realize the engine
+            result = (*sEngineObject)->Realize(sEngineObject, SL_BOOLEAN_FALSE);
+        }
+        if (SL_RESULT_SUCCESS == result) {
+            // get the engine interface, which is needed in order to create
+            // other objects
+            result = (*sEngineObject)->GetInterface(sEngineObject, SL_IID_ENGINE,
+                                                    &sEngineEngine);
+        }
+        if (SL_RESULT_SUCCESS != result) {
+            ALOGE("failed to create the OpenSL engine: %d", (int)result);
+            if (sEngineObject != NULL) {
+                (*sEngineObject)->Destroy(sEngineObject);
+                sEngineObject = NULL;
+            }
+            sEngineEngine = NULL;
+            pthread_mutex_unlock(&sEngineLock);
+            return -1;
+        }
+        sStats.engineCreates++;
+        sStats.engineCreateUs = monotonic_us() - begin;
+    }
+    mEngineEngine = sEngineEngine;
+    pthread_mutex_unlock(&sEngineLock);
+    return 0;
+}
+
+SLObjectItf NativeAudioBase::acquireOutputMix()
+{
+    if (acquireEngine() != 0) {
+        return NULL;
+    }
+
+    pthread_mutex_lock(&sEngineLock);
+    if (sOutputMixObject == NULL) {
+        int64_t begin = monotonic_us();
+        // create output mix
+        SLresult result = (*sEngineEngine)->CreateOutputMix(sEngineEngine,
+                                                            &sOutputMixObject,
+                                                            0, NULL, NULL);
+        if (SL_RESULT_SUCCESS == result) {
+            // realize the output mix
+            result = (*sOutputMixObject)->Realize(sOutputMixObject,
+                                                  SL_BOOLEAN_FALSE);
+        }
+        if (SL_RESULT_SUCCESS != result) {
+            ALOGE("failed to create the output mix: %d", (int)result);
+            if (sOutputMixObject != NULL) {
+                (*sOutputMixObject)->Destroy(sOutputMixObject);
+                sOutputMixObject = NULL;
+            }
+        } else {
+            sStats.mixCreates++;
+            sStats.mixCreateUs = monotonic_us() - begin;
+        }
+    }
+    SLObjectItf mix = sOutputMixObject;
+    pthread_mutex_unlock(&sEngineLock);
+    return mix;
+}
+
+/*static*/ void NativeAudioBase::getEngineStats(AudioEngineStats* stats)
+{
+    pthread_mutex_lock(&sEngineLock);
+    *stats = sStats;
+    pthread_mutex_unlock(&sEngineLock);
+}
+
+/*static*/ SLuint32 NativeAudioBase::toSLSampleRate(unsigned rate)
+{
+    switch (rate) {
+    case 8000: return SL_SAMPLINGRATE_8;
+    case 11025: return SL_SAMPLINGRATE_11_025;
+    case 12000: return SL_SAMPLINGRATE_12;
+    case 16000: return SL_SAMPLINGRATE_16;
+    case 22050: return SL_SAMPLINGRATE_22_05;
+    case 24000: return SL_SAMPLINGRATE_24;
+    case 32000: return SL_SAMPLINGRATE_32;
+    case 44100: return SL_SAMPLINGRATE_44_1;
+    case 48000: return SL_SAMPLINGRATE_48;
+    case 64000: return SL_SAMPLINGRATE_64;
+    case 88200: return SL_SAMPLINGRATE_88_2;
+    case 96000: return SL_SAMPLINGRATE_96;
+    case 192000: return SL_SAMPLINGRATE_192;
+    default: return 0;
     }
 }
@@ -5,17 +5,43 @@
 #ifndef UTILS_NATIVE_AUDIOBASE_H
 #define UTILS_NATIVE_AUDIOBASE_H 
 
+#include <stdint.h>
+
 #include <SLES/OpenSLES.h>
 #include <SLES/OpenSLES_Android.h>
 
+// Process wide OpenSL objects, see NativeAudioBase.
+struct AudioEngineStats {
+    int users;                 // live record/playback objects
+    unsigned int engineCreates;
+    int64_t engineCreateUs;    // last slCreateEngine + Realize
+    unsigned int mixCreates;
+    int64_t mixCreateUs;       // last CreateOutputMix + Realize
+};
+
+// Every record and playback object shares one engine and one output mix.
+// Both are reference counted by the objects alive: created and realized on
+// first use, destroyed with the last object. Creating another player then
+// costs only its own CreateAudioPlayer/Realize.
 class NativeAudioBase
 {
 public:
     NativeAudioBase();
     ~NativeAudioBase();
 
+    static void getEngineStats(AudioEngineStats* stats);
+
+    // SL_SAMPLINGRATE_* for |rate| in Hz, 0 when OpenSL has none for it.
+    static SLuint32 toSLSampleRate(unsigned rate);
+
 protected:
-    SLObjectItf mEngineObject;
+    // Realize the shared engine if needed and set mEngineEngine. Returns 0,
+    // or -1 when the engine cannot be created.
+    int acquireEngine();
+    // The shared output mix, realized on first use; NULL on failure. Not
+    // to be destroyed by the caller.
+    SLObjectItf acquireOutputMix();
+
     SLEngineItf mEngineEngine;
 };
 
@@ -0,0 +1,211 @@
+//
+// Created by ljliu on 19-3-19.
+//
+
+#include "utils/PcmQueue.h"
+
+#include <assert.h>
+#include <string.h>
+
+#include "utils/TimeUtils.h"
+
+PcmQueue::PcmQueue(int capacityBytes) :
+    mBuffer(new char[capacityBytes]),
+    mCapacity(capacityBytes),
+    mNotifyLock(NULL),
+    mNotifyCond(NULL)
+{
+  pthread_mutex_init(&mLock, NULL);
+  pthread_cond_init(&mCond, NULL);
+  reset();
+}
+
+PcmQueue::~PcmQueue()
+{
+  pthread_cond_destroy(&mCond);
+  pthread_mutex_destroy(&mLock);
+  delete [] mBuffer;
+}
+
+void PcmQueue::reset()
+{
+  pthread_mutex_lock(&mLock);
+  mReadPos = 0;
+  mLevel = 0;
+  mClosed = false;
+  mAborted = false;
+  memset(&mStats, 0, sizeof(mStats));
+  pthread_mutex_unlock(&mLock);
+}
+
+void PcmQueue::setNotify(pthread_mutex_t* lock, pthread_cond_t* cond)
+{
+  mNotifyLock = lock;
+  mNotifyCond = cond;
+}
+
+// After mLock is released, so the watcher may look at the queue while
+// holding its own lock.
+void PcmQueue::notify()
+{
+  if (mNotifyCond == NULL) {
+    return;
+  }
+  pthread_mutex_lock(mNotifyLock);
+  pthread_cond_broadcast(mNotifyCond);
+  pthread_mutex_unlock(mNotifyLock);
+}
+
+int PcmQueue::acquireWrite(char** buffer)
+{
+  pthread_mutex_lock(&mLock);
+  while (mLevel == mCapacity && !mAborted) {
+    pthread_cond_wait(&mCond, &mLock);
+  }
+  if (mAborted) {
+    pthread_mutex_unlock(&mLock);
+    return 0;
+  }
+  if (mLevel == 0) {
+    // Empty: start over at the front for the largest region.
+    mReadPos = 0;
+  }
+  int writePos = (mReadPos + mLevel) % mCapacity;
+  // Up to the end of the ring or the reader, whichever comes first.
+  int size = writePos >= mReadPos ? mCapacity - writePos
+                                  : mReadPos - writePos;
+  *buffer = mBuffer + writePos;
+  pthread_mutex_unlock(&mLock);
+  return size;
+}
+
+void PcmQueue::commitWrite(int bytes)
+{
+  if (bytes <= 0) {
+    return;
+  }
+  pthread_mutex_lock(&mLock);
+  assert(mLevel + bytes <= mCapacity);
+  mLevel += bytes;
+  mStats.writtenBytes += bytes;
+  if (mLevel > mStats.maxLevel) {
+    mStats.maxLevel = mLevel;
+  }
+  pthread_cond_broadcast(&mCond);
+  pthread_mutex_unlock(&mLock);
+  notify();
+}
+
+void PcmQueue::close()
+{
+  pthread_mutex_lock(&mLock);
+  mClosed = true;
+  pthread_cond_broadcast(&mCond);
+  pthread_mutex_unlock(&mLock);
+  notify();
+}
+
+void PcmQueue::abort()
+{
+  pthread_mutex_lock(&mLock);
+  mAborted = true;
+  pthread_cond_broadcast(&mCond);
+  pthread_mutex_unlock(&mLock);
+  notify();
+}
+
+int PcmQueue::prime(int bytes)
+{
+  if (bytes > mCapacity) {
+    bytes = mCapacity;
+  }
+  pthread_mutex_lock(&mLock);
+  while (mLevel < bytes && !mClosed && !mAborted) {
+    pthread_cond_wait(&mCond, &mLock);
+  }
+  int level = mLevel;
+  pthread_mutex_unlock(&mLock);
+  return level;
+}
+
+int PcmQueue::read(char* out, int maxBytes, int minBytes)
+{
+  // 0 is kept for the end of the stream.
+  if (minBytes < 1) {
+    minBytes = 1;
+  } else if (minBytes > mCapacity) {
+    minBytes = mCapacity;
+  }
+  pthread_mutex_lock(&mLock);
+  if (mLevel < minBytes && !mClosed && !mAborted) {
+    int64_t begin = monotonic_us();
+    while (mLevel < minBytes && !mClosed && !mAborted) {
+      pthread_cond_wait(&mCond, &mLock);
+    }
+    mStats.stalls++;
+    mStats.stallUs += monotonic_us() - begin;
+  }
+  if (mAborted) {
+    pthread_mutex_unlock(&mLock);
+    return 0;
+  }
+
+  int size = copyOutLocked(out, maxBytes);
+  pthread_mutex_unlock(&mLock);
+  return size;
+}
+
+int PcmQueue::tryRead(char* out, int maxBytes)
+{
+  pthread_mutex_lock(&mLock);
+  if (mAborted || (mClosed && mLevel == 0)) {
+    pthread_mutex_unlock(&mLock);
+    return -1;
+  }
+
+  int size = copyOutLocked(out, maxBytes);
+  pthread_mutex_unlock(&mLock);
+  return size;
+}
+
+bool PcmQueue::readable()
+{
+  pthread_mutex_lock(&mLock);
+  bool readable = mLevel > 0 || mClosed || mAborted;
+  pthread_mutex_unlock(&mLock);
+  return readable;
+}
+
+int PcmQueue::copyOutLocked(char* out, int maxBytes)
+{
+  int size = mLevel < maxBytes ? mLevel : maxBytes;
+  if (size <= 0) {
+    return 0;
+  }
+  int first = mCapacity - mReadPos;
+  if (first > size) {
+    first = size;
+  }
+  memcpy(out, mBuffer + mReadPos, first);
+  memcpy(out + first, mBuffer, size - first);
+  mReadPos = (mReadPos + size) % mCapacity;
+  mLevel -= size;
+  mStats.readBytes += size;
+  pthread_cond_broadcast(&mCond);
+  return size;
+}
+
+int PcmQueue::level()
+{
+  pthread_mutex_lock(&mLock);
+  int level = mLevel;
+  pthread_mutex_unlock(&mLock);
+  return level;
+}
+
+void PcmQueue::getStats(PcmQueueStats* stats)
+{
+  pthread_mutex_lock(&mLock);
+  *stats = mStats;
+  pthread_mutex_unlock(&mLock);
+}
@@ -0,0 +1,88 @@
+//
+// Created by ljliu on 19-3-19.
+//
+
+#ifndef UTILS_PCMQUEUE_H
+#define UTILS_PCMQUEUE_H
+
+#include <pthread.h>
+#include <stdint.h>
+
+struct PcmQueueStats {
+    int64_t writtenBytes;
+    int64_t readBytes;
+    int maxLevel;              // bytes
+    // read() found less than it asked for and the stream still open.
+    unsigned int stalls;
+    int64_t stallUs;
+};
+
+// Bounded byte ring between one producer and one consumer thread, e.g. a
+// synthesizer and the player. The producer writes in place, like
+// AudioPlayer::lease()/commit():
+//
+//   while ((n = queue.acquireWrite(&p)) > 0) { fill p; queue.commitWrite(k); }
+//   queue.close();
+//
+// and the consumer, after an optional prime(), copies out with read() until
+// it returns 0.
+class PcmQueue {
+public:
+    explicit PcmQueue(int capacityBytes);
+    ~PcmQueue();
+
+    // Empty and open again, stats cleared. Neither side may be active.
+    void reset();
+    // For a consumer watching several queues: |cond| is also broadcast,
+    // under |lock|, when data or the end of the stream arrives. Set before
+    // either side runs; |lock| must not be held when calling into the
+    // queue's producer side or abort().
+    void setNotify(pthread_mutex_t* lock, pthread_cond_t* cond);
+
+    // Producer: the largest contiguous free region, waiting while the ring
+    // is full. Returns its size, 0 once aborted.
+    int acquireWrite(char** buffer);
+    void commitWrite(int bytes);
+    // End of stream; the consumer gets what is left, then 0.
+    void close();
+
+    // Either side: wakes up and ends both.
+    void abort();
+
+    // Consumer: waits until |bytes| are buffered, or the stream ended,
+    // without counting a stall. Returns the level.
+    int prime(int bytes);
+
+    // Consumer: waits until |minBytes| are buffered (or the stream ended)
+    // and copies up to |maxBytes| to |out|. Returns the bytes copied, 0 at
+    // the end of the stream.
+    int read(char* out, int maxBytes, int minBytes);
+
+    // Consumer: copies up to |maxBytes| of what is buffered without
+    // waiting. Returns the bytes copied, 0 while the stream is open but
+    // empty, -1 once it ended (closed and empty, or aborted).
+    int tryRead(char* out, int maxBytes);
+    // Consumer: tryRead() would not return 0.
+    bool readable();
+
+    int level();
+    void getStats(PcmQueueStats* stats);
+
+private:
+    int copyOutLocked(char* out, int maxBytes);
+    void notify();
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    char* mBuffer;
+    int mCapacity;
+    int mReadPos;
+    int mLevel;
+    bool mClosed;
+    bool mAborted;
+    PcmQueueStats mStats;
+    pthread_mutex_t* mNotifyLock;
+    pthread_cond_t* mNotifyCond;
+};
+
+#endif // UTILS_PCMQUEUE_H
@@ -0,0 +1,190 @@
+//
+// Created by ljliu on 19-3-4.
+//
+
+#include "utils/PipelineWorkerPool.h"
+
+#include <string.h>
+
+#include <algorithm>
+
+#define LOG_TAG "PipelineWorkerPool"
+#include "utils/LogUtils.h"
+#include "utils/TimeUtils.h"
+
+PipelineWorkerPool::PipelineWorkerPool(int threads, int maxPendingJobs) :
+    mThreadCount(threads),
+    mMaxPending(maxPendingJobs)
+{
+  // Reserve everything up front so submit() never allocates on the
+  // audio callback path.
+  mJobs.reserve(maxPendingJobs);
+  mBusyKeys.reserve(threads);
+  memset(&mStats, 0, sizeof(mStats));
+  pthread_mutex_init(&mLock, NULL);
+  pthread_cond_init(&mCond, NULL);
+  pthread_cond_init(&mIdleCond, NULL);
+}
+
+PipelineWorkerPool::~PipelineWorkerPool()
+{
+  stop();
+  pthread_mutex_destroy(&mLock);
+  pthread_cond_destroy(&mCond);
+  pthread_cond_destroy(&mIdleCond);
+}
+
+int PipelineWorkerPool::start()
+{
+  pthread_mutex_lock(&mLock);
+  if (mRunning) {
+    pthread_mutex_unlock(&mLock);
+    return 0;
+  }
+  mRunning = true;
+  pthread_mutex_unlock(&mLock);
+
+  for (int i = 0; i < mThreadCount; i++) {
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run, this) != 0) {
+      ALOGE("can not create worker %d", i);
+      stop();
+      return -1;
+    }
+    mThreads.push_back(thread);
+  }
+
+  ALOGD("worker pool started with %d threads", mThreadCount);
+  return 0;
+}
+
+void PipelineWorkerPool::stop()
+{
+  pthread_mutex_lock(&mLock);
+  mRunning = false;
+  mJobs.clear();
+  pthread_cond_broadcast(&mCond);
+  pthread_mutex_unlock(&mLock);
+
+  for (size_t i = 0; i < mThreads.size(); i++) {
+    pthread_join(mThreads[i], NULL);
+  }
+  mThreads.clear();
+}
+
+int PipelineWorkerPool::submit(const void* key, pool_job job, void* arg,
+                               int64_t deadlineUs)
+{
+  pthread_mutex_lock(&mLock);
+  if (!mRunning || (int)mJobs.size() >= mMaxPending) {
+    mStats.dropped++;
+    pthread_mutex_unlock(&mLock);
+    return -1;
+  }
+
+  Job j = {key, job, arg, deadlineUs};
+  mJobs.push_back(j);
+  pthread_cond_signal(&mCond);
+  pthread_mutex_unlock(&mLock);
+  return 0;
+}
+
+void PipelineWorkerPool::cancel(const void* key)
+{
+  pthread_mutex_lock(&mLock);
+  for (size_t i = 0; i < mJobs.size();) {
+    if (mJobs[i].key == key) {
+      mJobs.erase(mJobs.begin() + i);
+    } else {
+      i++;
+    }
+  }
+
+  while (isBusy(key)) {
+    pthread_cond_wait(&mIdleCond, &mLock);
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+void PipelineWorkerPool::getStats(PoolStats* stats)
+{
+  pthread_mutex_lock(&mLock);
+  *stats = mStats;
+  pthread_mutex_unlock(&mLock);
+}
+
+bool PipelineWorkerPool::isBusy(const void* key)
+{
+  return std::find(mBusyKeys.begin(), mBusyKeys.end(), key) !=
+      mBusyKeys.end();
+}
+
+// Called with mLock held. Returns the index of the runnable job with the
+// earliest deadline, or -1. A job is runnable when its key is idle and it
+// is the oldest pending job of that key.
+int PipelineWorkerPool::pickJob()
+{
+  int best = -1;
+  for (size_t i = 0; i < mJobs.size(); i++) {
+    const Job& job = mJobs[i];
+    if (isBusy(job.key)) {
+      continue;
+    }
+
+    bool head = true;
+    for (size_t k = 0; k < i; k++) {
+      if (mJobs[k].key == job.key) {
+        head = false;
+        break;
+      }
+    }
+    if (!head) {
+      continue;
+    }
+
+    if (best < 0 || job.deadlineUs < mJobs[best].deadlineUs) {
+      best = i;
+    }
+  }
+  return best;
+}
+
+void PipelineWorkerPool::doWork()
+{
+  pthread_mutex_lock(&mLock);
+  while (mRunning) {
+    int index = pickJob();
+    if (index < 0) {
+      pthread_cond_wait(&mCond, &mLock);
+      continue;
+    }
+
+    Job job = mJobs[index];
+    mJobs.erase(mJobs.begin() + index);
+    mBusyKeys.push_back(job.key);
+    pthread_mutex_unlock(&mLock);
+
+    job.func(job.arg);
+    int64_t lateness = monotonic_us() - job.deadlineUs;
+
+    pthread_mutex_lock(&mLock);
+    mBusyKeys.erase(std::find(mBusyKeys.begin(), mBusyKeys.end(), job.key));
+    mStats.jobs++;
+    if (lateness > 0) {
+      mStats.deadlineMisses++;
+      mStats.maxLatenessUs = std::max(mStats.maxLatenessUs, lateness);
+    }
+    // The key is free again: wake a worker for its next job and anyone
+    // waiting in cancel().
+    pthread_cond_broadcast(&mIdleCond);
+    pthread_cond_signal(&mCond);
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+/*static*/ void* PipelineWorkerPool::run(void* arg)
+{
+  PipelineWorkerPool* pool = (PipelineWorkerPool*)arg;
+  pool->doWork();
+  return NULL;
+}
@@ -0,0 +1,68 @@
+//
+// Created by ljliu on 19-3-4.
+//
+
+#ifndef UTILS_PIPELINEWORKERPOOL_H
+#define UTILS_PIPELINEWORKERPOOL_H
+
+#include <stdint.h>
+#include <pthread.h>
+
+#include <vector>
+
+typedef void (*pool_job)(void* arg);
+
+struct PoolStats {
+    int64_t jobs;
+    int64_t deadlineMisses;
+    int64_t maxLatenessUs;
+    int64_t dropped;
+};
+
+// Fixed-size pool of worker threads shared by several MobPipeline
+// instances. Jobs carry a key (usually the pipeline): jobs with the same
+// key run one at a time in submission order, and among the runnable ones
+// the earliest deadline goes first.
+class PipelineWorkerPool {
+public:
+    PipelineWorkerPool(int threads, int maxPendingJobs = 256);
+    ~PipelineWorkerPool();
+
+    int start();
+    void stop();
+
+    int submit(const void* key, pool_job job, void* arg, int64_t deadlineUs);
+    // Drop pending jobs of |key| and wait until none of them is running.
+    void cancel(const void* key);
+
+    void getStats(PoolStats* stats);
+    int threadCount() const { return mThreadCount; }
+
+private:
+    struct Job {
+        const void* key;
+        pool_job func;
+        void* arg;
+        int64_t deadlineUs;
+    };
+
+    static void* run(void* arg);
+    void doWork();
+    int pickJob();
+    bool isBusy(const void* key);
+
+    int mThreadCount;
+    int mMaxPending;
+    std::vector<pthread_t> mThreads;
+    std::vector<Job> mJobs;
+    std::vector<const void*> mBusyKeys;
+    bool mRunning = false;
+
+    pthread_mutex_t mLock;
+    pthread_cond_t mCond;
+    pthread_cond_t mIdleCond;
+
+    PoolStats mStats;
+};
+
+#endif // UTILS_PIPELINEWORKERPOOL_H
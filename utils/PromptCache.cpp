@@ -0,0 +1,466 @@
+//
+// Created by ljliu on 19-3-18.
+//
+
+#include "utils/PromptCache.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <utime.h>
+
+#include <algorithm>
+#include <vector>
+
+#define LOG_TAG "PromptCache"
+#include "utils/LogUtils.h"
+#include "utils/TimeUtils.h"
+
+PromptCache::PromptCache() :
+    mMemoryCap(kPromptMemoryBytes),
+    mDiskCap(kPromptDiskBytes),
+    mUseClock(0),
+    mPrewarming(false),
+    mAbort(false),
+    mPrewarmKeys(NULL),
+    mPrewarmCount(0),
+    mSynth(NULL),
+    mSynthCtx(NULL)
+{
+  pthread_mutex_init(&mLock, NULL);
+  memset(&mStats, 0, sizeof(mStats));
+}
+
+PromptCache::~PromptCache()
+{
+  stopPrewarm();
+  for (std::map<uint64_t, Entry*>::iterator it = mEntries.begin();
+       it != mEntries.end(); ++it) {
+    if (it->second->refs > 0) {
+      ALOGW("prompt %016llx still in use", (unsigned long long)it->first);
+    }
+    freeEntry(it->second);
+  }
+  pthread_mutex_destroy(&mLock);
+}
+
+int PromptCache::open(const char* dir, size_t memoryBytes, size_t diskBytes)
+{
+  if (mkdir(dir, 0755) != 0 && errno != EEXIST) {
+    ALOGE("cannot create %s: %s", dir, strerror(errno));
+    return -1;
+  }
+  pthread_mutex_lock(&mLock);
+  mDir = dir;
+  mMemoryCap = memoryBytes;
+  mDiskCap = diskBytes;
+  evictLocked();
+  pthread_mutex_unlock(&mLock);
+  trimDisk();
+  return 0;
+}
+
+/*static*/ uint64_t PromptCache::key(const std::string& text,
+                                     const std::string& language,
+                                     const std::string& speaker)
+{
+  uint64_t hash = 14695981039346656037ULL;
+  const std::string* parts[3] = {&text, &language, &speaker};
+  for (int i = 0; i < 3; i++) {
+    // The terminating NUL keeps ("ab", "c") apart from ("a", "bc").
+    const unsigned char* p = (const unsigned char*)parts[i]->c_str();
+    for (size_t n = 0; n <= parts[i]->size(); n++) {
+      hash ^= p[n];
+      hash *= 1099511628211ULL;
+    }
+  }
+  return hash;
+}
+
+const PromptPcm* PromptCache::acquire(uint64_t key)
+{
+  return find(key, true);
+}
+
+const PromptPcm* PromptCache::find(uint64_t key, bool counted)
+{
+  pthread_mutex_lock(&mLock);
+  if (counted) {
+    mStats.lookups++;
+  }
+  std::map<uint64_t, Entry*>::iterator it = mEntries.find(key);
+  if (it != mEntries.end()) {
+    Entry* entry = it->second;
+    entry->refs++;
+    entry->lastUse = ++mUseClock;
+    if (counted) {
+      mStats.memoryHits++;
+    }
+    pthread_mutex_unlock(&mLock);
+    return &entry->pcm;
+  }
+  bool disk = !mDir.empty();
+  pthread_mutex_unlock(&mLock);
+  if (!disk) {
+    return NULL;
+  }
+
+  // Map outside the lock, the pages are touched in there.
+  Entry* entry = loadFile(key);
+  if (entry == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&mLock);
+  it = mEntries.find(key);
+  if (it != mEntries.end()) {
+    // Loaded meanwhile by another thread.
+    freeEntry(entry);
+    entry = it->second;
+  } else {
+    insertLocked(entry);
+  }
+  entry->refs++;
+  entry->lastUse = ++mUseClock;
+  if (counted) {
+    mStats.diskHits++;
+  }
+  evictLocked();
+  pthread_mutex_unlock(&mLock);
+  return &entry->pcm;
+}
+
+void PromptCache::release(const PromptPcm* pcm)
+{
+  if (pcm == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&mLock);
+  std::map<uint64_t, Entry*>::iterator it = mEntries.find(pcm->key);
+  if (it != mEntries.end() && &it->second->pcm == pcm) {
+    it->second->refs--;
+  }
+  evictLocked();
+  pthread_mutex_unlock(&mLock);
+}
+
+int PromptCache::store(uint64_t key, const char* data, int size)
+{
+  if (size <= 0) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&mLock);
+  bool cached = mEntries.find(key) != mEntries.end();
+  bool disk = !mDir.empty();
+  pthread_mutex_unlock(&mLock);
+
+  // Same key, same content: only a missing tier is filled in.
+  int ret = 0;
+  if (disk && access(pathOf(key).c_str(), F_OK) != 0) {
+    ret = writeFile(key, data, size);
+    if (ret == 0) {
+      trimDisk();
+    }
+  }
+  if (cached) {
+    return ret;
+  }
+
+  Entry* entry = new Entry();
+  entry->buffer = new char[size];
+  memcpy(entry->buffer, data, size);
+  entry->map = NULL;
+  entry->mapSize = 0;
+  entry->pcm.key = key;
+  entry->pcm.data = entry->buffer;
+  entry->pcm.size = size;
+  entry->refs = 0;
+
+  pthread_mutex_lock(&mLock);
+  if (mEntries.find(key) != mEntries.end()) {
+    freeEntry(entry);
+  } else {
+    entry->lastUse = ++mUseClock;
+    insertLocked(entry);
+    mStats.stores++;
+    evictLocked();
+  }
+  pthread_mutex_unlock(&mLock);
+  return ret;
+}
+
+int PromptCache::prewarm(const uint64_t* keys, int count, prompt_synth synth,
+                         void* ctx)
+{
+  if (mPrewarming || count <= 0) {
+    return -1;
+  }
+  mPrewarmKeys = new uint64_t[count];
+  memcpy(mPrewarmKeys, keys, count * sizeof(uint64_t));
+  mPrewarmCount = count;
+  mSynth = synth;
+  mSynthCtx = ctx;
+  mAbort = false;
+  if (pthread_create(&mThread, NULL, run, this) != 0) {
+    ALOGE("failed to start the prewarm thread");
+    delete [] mPrewarmKeys;
+    mPrewarmKeys = NULL;
+    return -1;
+  }
+  mPrewarming = true;
+  return 0;
+}
+
+void PromptCache::stopPrewarm()
+{
+  if (!mPrewarming) {
+    return;
+  }
+  // A synthesis under way is finished, not cut.
+  mAbort = true;
+  pthread_join(mThread, NULL);
+  mPrewarming = false;
+  delete [] mPrewarmKeys;
+  mPrewarmKeys = NULL;
+}
+
+/*static*/ void* PromptCache::run(void* arg)
+{
+  ((PromptCache*)arg)->doPrewarm();
+  return NULL;
+}
+
+void PromptCache::doPrewarm()
+{
+  int64_t begin = monotonic_us();
+  unsigned int ready = 0;
+  unsigned int synthesized = 0;
+  for (int i = 0; i < mPrewarmCount && !mAbort; i++) {
+    // Not a lookup for the hit rate.
+    const PromptPcm* pcm = find(mPrewarmKeys[i], false);
+    if (pcm != NULL) {
+      release(pcm);
+      ready++;
+    } else if (mSynth(mSynthCtx, i) == 0) {
+      ready++;
+      synthesized++;
+    }
+  }
+  int64_t us = monotonic_us() - begin;
+  pthread_mutex_lock(&mLock);
+  mStats.prewarmed = ready;
+  mStats.synthesized = synthesized;
+  mStats.prewarmUs = us;
+  pthread_mutex_unlock(&mLock);
+  ALOGD("prewarmed %u of %d prompts (%u synthesized) in %lld ms", ready,
+        mPrewarmCount, synthesized, (long long)(us / 1000));
+}
+
+void PromptCache::recordStart(int64_t us)
+{
+  pthread_mutex_lock(&mLock);
+  mStats.starts++;
+  mStats.startUs += us;
+  if (us > mStats.maxStartUs) {
+    mStats.maxStartUs = us;
+  }
+  pthread_mutex_unlock(&mLock);
+}
+
+PromptCache::Entry* PromptCache::loadFile(uint64_t key)
+{
+  std::string path = pathOf(key);
+  int fd = ::open(path.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return NULL;
+  }
+  struct stat info;
+  if (fstat(fd, &info) != 0 || info.st_size <= 0 ||
+      info.st_size % sizeof(short) != 0) {
+    ALOGW("ignoring bad prompt file %s", path.c_str());
+    close(fd);
+    return NULL;
+  }
+  size_t size = info.st_size;
+  void* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    ALOGE("cannot map %s: %s", path.c_str(), strerror(errno));
+    return NULL;
+  }
+  // Fault it in now instead of on the player's time.
+  madvise(map, size, MADV_WILLNEED);
+  volatile char sum = 0;
+  long page = sysconf(_SC_PAGESIZE);
+  for (size_t off = 0; off < size; off += page) {
+    sum += ((const char*)map)[off];
+  }
+  (void)sum;
+  // Recently used files survive trimDisk().
+  utime(path.c_str(), NULL);
+
+  Entry* entry = new Entry();
+  entry->buffer = NULL;
+  entry->map = map;
+  entry->mapSize = size;
+  entry->pcm.key = key;
+  entry->pcm.data = (const char*)map;
+  entry->pcm.size = (int)size;
+  entry->refs = 0;
+  entry->lastUse = 0;
+  return entry;
+}
+
+void PromptCache::insertLocked(Entry* entry)
+{
+  mEntries[entry->pcm.key] = entry;
+  mStats.entries++;
+  mStats.memoryBytes += entry->pcm.size;
+}
+
+void PromptCache::evictLocked()
+{
+  while (mStats.memoryBytes > mMemoryCap) {
+    std::map<uint64_t, Entry*>::iterator victim = mEntries.end();
+    for (std::map<uint64_t, Entry*>::iterator it = mEntries.begin();
+         it != mEntries.end(); ++it) {
+      if (it->second->refs == 0 &&
+          (victim == mEntries.end() ||
+           it->second->lastUse < victim->second->lastUse)) {
+        victim = it;
+      }
+    }
+    if (victim == mEntries.end()) {
+      // Everything left is in use; retried on release().
+      return;
+    }
+    mStats.entries--;
+    mStats.memoryBytes -= victim->second->pcm.size;
+    mStats.evictions++;
+    freeEntry(victim->second);
+    mEntries.erase(victim);
+  }
+}
+
+void PromptCache::freeEntry(Entry* entry)
+{
+  if (entry->map != NULL) {
+    munmap(entry->map, entry->mapSize);
+  }
+  delete [] entry->buffer;
+  delete entry;
+}
+
+std::string PromptCache::pathOf(uint64_t key) const
+{
+  char name[32];
+  snprintf(name, sizeof(name), "/%016llx.pcm", (unsigned long long)key);
+  return mDir + name;
+}
+
+int PromptCache::writeFile(uint64_t key, const char* data, int size)
+{
+  // Written aside and renamed, a reader never maps half a prompt.
+  std::string path = pathOf(key);
+  std::string temp = path + ".tmp";
+  FILE* fp = fopen(temp.c_str(), "wb");
+  if (fp == NULL) {
+    ALOGE("cannot create %s: %s", temp.c_str(), strerror(errno));
+    return -1;
+  }
+  size_t written = fwrite(data, 1, size, fp);
+  if (fclose(fp) != 0 || written != (size_t)size ||
+      rename(temp.c_str(), path.c_str()) != 0) {
+    ALOGE("cannot write %s", path.c_str());
+    unlink(temp.c_str());
+    return -1;
+  }
+  return 0;
+}
+
+void PromptCache::trimDisk()
+{
+  struct File {
+    time_t mtime;
+    size_t size;
+    std::string path;
+    bool operator<(const File& other) const { return mtime < other.mtime; }
+  };
+
+  pthread_mutex_lock(&mLock);
+  std::string dir = mDir;
+  pthread_mutex_unlock(&mLock);
+  DIR* dp = opendir(dir.c_str());
+  if (dp == NULL) {
+    return;
+  }
+  std::vector<File> files;
+  size_t total = 0;
+  struct dirent* ent;
+  while ((ent = readdir(dp)) != NULL) {
+    size_t len = strlen(ent->d_name);
+    if (len < 4 || strcmp(ent->d_name + len - 4, ".pcm") != 0) {
+      continue;
+    }
+    File file;
+    file.path = dir + "/" + ent->d_name;
+    struct stat info;
+    if (stat(file.path.c_str(), &info) != 0) {
+      continue;
+    }
+    file.mtime = info.st_mtime;
+    file.size = info.st_size;
+    total += file.size;
+    files.push_back(file);
+  }
+  closedir(dp);
+
+  // Oldest first. A mapped file stays readable after unlink().
+  std::sort(files.begin(), files.end());
+  unsigned int deleted = 0;
+  for (size_t i = 0; i < files.size() && total > mDiskCap; i++) {
+    if (unlink(files[i].path.c_str()) == 0) {
+      total -= files[i].size;
+      deleted++;
+    }
+  }
+
+  pthread_mutex_lock(&mLock);
+  mStats.diskBytes = total;
+  mStats.deletions += deleted;
+  pthread_mutex_unlock(&mLock);
+}
+
+void PromptCache::getStats(PromptStats* stats)
+{
+  pthread_mutex_lock(&mLock);
+  *stats = mStats;
+  pthread_mutex_unlock(&mLock);
+}
+
+void PromptCache::dumpStats()
+{
+  PromptStats stats;
+  getStats(&stats);
+  unsigned int hits = stats.memoryHits + stats.diskHits;
+  printf("[prompt_cache] %u lookups, hit rate %.1f%% (%u memory, %u disk); "
+         "%d entries, %zu KB in memory, %zu KB on disk; %u stored, "
+         "%u evicted, %u files deleted\n",
+         stats.lookups,
+         stats.lookups > 0 ? 100.0 * hits / stats.lookups : 0.0,
+         stats.memoryHits, stats.diskHits, stats.entries,
+         stats.memoryBytes / 1024, stats.diskBytes / 1024, stats.stores,
+         stats.evictions, stats.deletions);
+  printf("[prompt_cache] prewarm: %u ready (%u synthesized) in %lld ms; "
+         "hit start: avg %lld us, max %lld us over %u\n",
+         stats.prewarmed, stats.synthesized,
+         (long long)(stats.prewarmUs / 1000),
+         (long long)(stats.starts > 0 ? stats.startUs / stats.starts : 0),
+         (long long)stats.maxStartUs, stats.starts);
+}
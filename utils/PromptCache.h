@@ -0,0 +1,128 @@
+//
+// Created by ljliu on 19-3-18.
+//
+
+#ifndef UTILS_PROMPTCACHE_H
+#define UTILS_PROMPTCACHE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <atomic>
+#include <map>
+#include <string>
+
+// Memory tier cap, mapped files included.
+#define kPromptMemoryBytes (4 << 20)
+// Disk tier cap; least recently used files are deleted past it.
+#define kPromptDiskBytes (32 << 20)
+
+// Synthesized PCM of one prompt, valid until handed back to release().
+struct PromptPcm {
+    uint64_t key;
+    const char* data;
+    int size;
+};
+
+// Synthesizes prompt |index| of a prewarm() list and store()s it. Runs on
+// the prewarm thread; returns 0 or -1.
+typedef int (*prompt_synth)(void* ctx, int index);
+
+struct PromptStats {
+    unsigned int lookups;
+    unsigned int memoryHits;
+    unsigned int diskHits;     // mapped from a file
+    unsigned int stores;
+    unsigned int evictions;    // memory tier
+    unsigned int deletions;    // disk tier
+    int entries;
+    size_t memoryBytes;
+    size_t diskBytes;
+    unsigned int prewarmed;    // prewarm() keys ready in memory
+    unsigned int synthesized;  // of those, not found in any tier
+    int64_t prewarmUs;
+    // recordStart() of cache hits: lookup to the first buffer queued.
+    unsigned int starts;
+    int64_t startUs;
+    int64_t maxStartUs;
+};
+
+// Content addressed cache of synthesized prompt audio, keyed by key() of
+// (text, language, speaker). Two tiers: entries in memory, LRU evicted past
+// the memory cap, and one raw PCM file per key under the cache directory,
+// mmap()ed back in on a memory miss. Thread safe; an entry handed out by
+// acquire() stays valid until release(), eviction waits for it.
+class PromptCache {
+public:
+    PromptCache();
+    ~PromptCache();
+
+    // Uses |dir| (created if missing) as the disk tier and trims it to
+    // |diskBytes|. Without open() the cache is memory only.
+    int open(const char* dir, size_t memoryBytes, size_t diskBytes);
+
+    // 64 bit FNV-1a over the three strings.
+    static uint64_t key(const std::string& text, const std::string& language,
+                        const std::string& speaker);
+
+    // The PCM for |key| from memory, or from disk into memory; NULL on a
+    // miss.
+    const PromptPcm* acquire(uint64_t key);
+    void release(const PromptPcm* pcm);
+
+    // Adds (or replaces) |key| in both tiers. Returns 0 or -1.
+    int store(uint64_t key, const char* data, int size);
+
+    // On a background thread: brings each of |keys| into memory, from disk
+    // when there, otherwise through |synth|. |keys| is copied.
+    int prewarm(const uint64_t* keys, int count, prompt_synth synth,
+                void* ctx);
+    void stopPrewarm();
+
+    void recordStart(int64_t us);
+
+    void getStats(PromptStats* stats);
+    void dumpStats();
+
+private:
+    struct Entry {
+        PromptPcm pcm;
+        char* buffer;          // heap copy, or
+        void* map;             // the mapped file
+        size_t mapSize;
+        int refs;
+        unsigned int lastUse;
+    };
+
+    static void* run(void* arg);
+    void doPrewarm();
+
+    const PromptPcm* find(uint64_t key, bool counted);
+    Entry* loadFile(uint64_t key);
+    void insertLocked(Entry* entry);
+    void evictLocked();
+    void freeEntry(Entry* entry);
+    std::string pathOf(uint64_t key) const;
+    int writeFile(uint64_t key, const char* data, int size);
+    void trimDisk();
+
+    pthread_mutex_t mLock;
+    std::map<uint64_t, Entry*> mEntries;
+    std::string mDir;
+    size_t mMemoryCap;
+    size_t mDiskCap;
+    unsigned int mUseClock;
+
+    pthread_t mThread;
+    bool mPrewarming;
+    std::atomic<bool> mAbort;
+    uint64_t* mPrewarmKeys;
+    int mPrewarmCount;
+    prompt_synth mSynth;
+    void* mSynthCtx;
+
+    PromptStats mStats;
+};
+
+#endif // UTILS_PROMPTCACHE_H
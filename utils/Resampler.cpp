@@ -0,0 +1,328 @@
+//
+// Created by ljliu on 19-3-22.
+//
+
+#include "utils/Resampler.h"
+
+#include <math.h>
+#include <string.h>
+
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define RESAMPLE_NEON
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#define RESAMPLE_SSE2
+#endif
+
+#define LOG_TAG "Resampler"
+#include "utils/LogUtils.h"
+
+static int gcd(int a, int b) {
+  while (b != 0) {
+    int t = a % b;
+    a = b;
+    b = t;
+  }
+  return a;
+}
+
+// Zeroth order modified Bessel function of the first kind.
+static double bessel_i0(double x) {
+  double sum = 1;
+  double term = 1;
+  for (int k = 1; k < 50; k++) {
+    term *= (x / (2 * k)) * (x / (2 * k));
+    sum += term;
+    if (term < sum * 1e-12) {
+      break;
+    }
+  }
+  return sum;
+}
+
+static inline short saturate16(int v) {
+  return v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+}
+
+// |taps| is a multiple of 8 for all of these.
+static int dot_s16_scalar(const short* x, const short* h, int taps) {
+  int sum = 0;
+  for (int k = 0; k < taps; k++) {
+    sum += x[k] * h[k];
+  }
+  return sum;
+}
+
+static float dot_f32_scalar(const float* x, const float* h, int taps) {
+  float sum = 0;
+  for (int k = 0; k < taps; k++) {
+    sum += x[k] * h[k];
+  }
+  return sum;
+}
+
+static int dot_s16(const short* x, const short* h, int taps) {
+#if defined(RESAMPLE_NEON)
+  int32x4_t acc = vdupq_n_s32(0);
+  for (int k = 0; k < taps; k += 8) {
+    int16x8_t xv = vld1q_s16(x + k);
+    int16x8_t hv = vld1q_s16(h + k);
+    acc = vmlal_s16(acc, vget_low_s16(xv), vget_low_s16(hv));
+    acc = vmlal_s16(acc, vget_high_s16(xv), vget_high_s16(hv));
+  }
+  int32x2_t sum = vadd_s32(vget_low_s32(acc), vget_high_s32(acc));
+  return vget_lane_s32(vpadd_s32(sum, sum), 0);
+#elif defined(RESAMPLE_SSE2)
+  __m128i acc = _mm_setzero_si128();
+  for (int k = 0; k < taps; k += 8) {
+    acc = _mm_add_epi32(acc, _mm_madd_epi16(
+        _mm_loadu_si128((const __m128i*)(x + k)),
+        _mm_loadu_si128((const __m128i*)(h + k))));
+  }
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  acc = _mm_add_epi32(acc, _mm_shuffle_epi32(acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  return _mm_cvtsi128_si32(acc);
+#else
+  return dot_s16_scalar(x, h, taps);
+#endif
+}
+
+static float dot_f32(const float* x, const float* h, int taps) {
+#if defined(RESAMPLE_NEON)
+  float32x4_t acc0 = vdupq_n_f32(0);
+  float32x4_t acc1 = vdupq_n_f32(0);
+  for (int k = 0; k < taps; k += 8) {
+    acc0 = vmlaq_f32(acc0, vld1q_f32(x + k), vld1q_f32(h + k));
+    acc1 = vmlaq_f32(acc1, vld1q_f32(x + k + 4), vld1q_f32(h + k + 4));
+  }
+  acc0 = vaddq_f32(acc0, acc1);
+  float32x2_t sum = vadd_f32(vget_low_f32(acc0), vget_high_f32(acc0));
+  return vget_lane_f32(vpadd_f32(sum, sum), 0);
+#elif defined(RESAMPLE_SSE2)
+  __m128 acc0 = _mm_setzero_ps();
+  __m128 acc1 = _mm_setzero_ps();
+  for (int k = 0; k < taps; k += 8) {
+    acc0 = _mm_add_ps(acc0, _mm_mul_ps(_mm_loadu_ps(x + k),
+                                       _mm_loadu_ps(h + k)));
+    acc1 = _mm_add_ps(acc1, _mm_mul_ps(_mm_loadu_ps(x + k + 4),
+                                       _mm_loadu_ps(h + k + 4)));
+  }
+  acc0 = _mm_add_ps(acc0, acc1);
+  acc0 = _mm_add_ps(acc0, _mm_movehl_ps(acc0, acc0));
+  acc0 = _mm_add_ss(acc0, _mm_shuffle_ps(acc0, acc0, 1));
+  return _mm_cvtss_f32(acc0);
+#else
+  return dot_f32_scalar(x, h, taps);
+#endif
+}
+
+Resampler::Resampler() :
+    mInRate(0),
+    mOutRate(0),
+    mChannels(0),
+    mUp(1),
+    mDown(1),
+    mTaps(0),
+    mCoefFloat(NULL),
+    mCoefShort(NULL),
+    mWorkShort(NULL),
+    mWorkFloat(NULL),
+    mPhase(0),
+    mNext(0),
+    mScalar(false)
+{
+}
+
+Resampler::~Resampler()
+{
+  release();
+}
+
+void Resampler::release()
+{
+  delete [] mCoefFloat;
+  delete [] mCoefShort;
+  mCoefFloat = NULL;
+  mCoefShort = NULL;
+  for (int c = 0; c < mChannels; c++) {
+    delete [] mWorkShort[c];
+    delete [] mWorkFloat[c];
+  }
+  delete [] mWorkShort;
+  delete [] mWorkFloat;
+  mWorkShort = NULL;
+  mWorkFloat = NULL;
+  mChannels = 0;
+}
+
+/*static*/ bool Resampler::vectorized()
+{
+#if defined(RESAMPLE_NEON) || defined(RESAMPLE_SSE2)
+  return true;
+#else
+  return false;
+#endif
+}
+
+int Resampler::init(int inRate, int outRate, int channels)
+{
+  release();
+  if (inRate <= 0 || outRate <= 0 || channels <= 0) {
+    return -1;
+  }
+
+  int common = gcd(inRate, outRate);
+  mUp = outRate / common;
+  mDown = inRate / common;
+  if (mUp > kResampleMaxPhases) {
+    ALOGE("%d -> %d needs %d phases", inRate, outRate, mUp);
+    return -1;
+  }
+
+  mInRate = inRate;
+  mOutRate = outRate;
+  mTaps = kResampleTaps;
+  if (mDown > mUp) {
+    mTaps = (kResampleTaps * mDown + mUp - 1) / mUp;
+  }
+  mTaps = (mTaps + 7) / 8 * 8;
+
+  mCoefFloat = new float[mUp * mTaps];
+  mCoefShort = new short[mUp * mTaps];
+  design();
+
+  mChannels = channels;
+  int workFrames = mTaps - 1 + kResampleBlock;
+  mWorkShort = new short*[channels];
+  mWorkFloat = new float*[channels];
+  for (int c = 0; c < channels; c++) {
+    mWorkShort[c] = new short[workFrames];
+    mWorkFloat[c] = new float[workFrames];
+  }
+  reset();
+
+  ALOGD("%d -> %d: %d/%d, %d taps per phase", inRate, outRate, mUp, mDown,
+        mTaps);
+  return 0;
+}
+
+// Prototype at mUp times the input rate, mTaps * mUp long. Its transition
+// band ends at the lower Nyquist rate; each phase is then scaled to unity
+// DC gain, so a constant input comes out constant.
+void Resampler::design()
+{
+  int length = mTaps * mUp;
+  double center = (length - 1) / 2.0;
+  // Kaiser estimate of the transition width for the window's attenuation,
+  // in cycles per input sample.
+  double attenuation = kResampleBeta / 0.1102 + 8.7;
+  double transition = (attenuation - 7.95) / (14.36 * (length - 1)) * mUp;
+  double nyquist = 0.5 * (mUp < mDown ? (double)mUp / mDown : 1.0);
+  double cutoff = nyquist - transition / 2;
+  double i0beta = bessel_i0(kResampleBeta);
+
+  for (int p = 0; p < mUp; p++) {
+    double sum = 0;
+    float* coef = mCoefFloat + p * mTaps;
+    // Tap k of phase p weighs input frame base - k; stored oldest first.
+    for (int k = 0; k < mTaps; k++) {
+      int i = p + k * mUp;
+      double t = (i - center) / mUp;
+      double x = 2 * cutoff * t;
+      double sinc = fabs(x) < 1e-9 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+      double r = 2.0 * i / (length - 1) - 1;
+      double window = bessel_i0(kResampleBeta * sqrt(fmax(0.0, 1 - r * r))) /
+                      i0beta;
+      coef[mTaps - 1 - k] = (float)(2 * cutoff * sinc * window);
+      sum += coef[mTaps - 1 - k];
+    }
+    for (int k = 0; k < mTaps; k++) {
+      coef[k] = (float)(coef[k] / sum);
+      long q = lround(coef[k] * 32768.0);
+      mCoefShort[p * mTaps + k] = saturate16((int)q);
+    }
+  }
+}
+
+void Resampler::reset()
+{
+  for (int c = 0; c < mChannels; c++) {
+    memset(mWorkShort[c], 0, (mTaps - 1) * sizeof(short));
+    memset(mWorkFloat[c], 0, (mTaps - 1) * sizeof(float));
+  }
+  mPhase = 0;
+  mNext = 0;
+}
+
+int Resampler::maxOutFrames(int inFrames) const
+{
+  return (int)((int64_t)inFrames * mUp / mDown) + 1;
+}
+
+double Resampler::delayFrames() const
+{
+  return (mTaps * mUp - 1) / (2.0 * mUp);
+}
+
+int Resampler::filter(const short* x, int phase) const
+{
+  const short* coef = mCoefShort + phase * mTaps;
+  int sum = mScalar ? dot_s16_scalar(x, coef, mTaps)
+                    : dot_s16(x, coef, mTaps);
+  return saturate16((sum + (1 << 14)) >> 15);
+}
+
+float Resampler::filter(const float* x, int phase) const
+{
+  const float* coef = mCoefFloat + phase * mTaps;
+  return mScalar ? dot_f32_scalar(x, coef, mTaps) : dot_f32(x, coef, mTaps);
+}
+
+// Each block is deinterleaved behind the history, so every output is one
+// contiguous dot product per channel.
+template <typename T>
+int Resampler::processBlocks(const T* in, int inFrames, T* out, T** work)
+{
+  int history = mTaps - 1;
+  int total = 0;
+  while (inFrames > 0) {
+    int n = inFrames < kResampleBlock ? inFrames : kResampleBlock;
+    for (int c = 0; c < mChannels; c++) {
+      T* dst = work[c] + history;
+      for (int i = 0; i < n; i++) {
+        dst[i] = in[i * mChannels + c];
+      }
+    }
+
+    while (mNext < n) {
+      T* frame = out + total * mChannels;
+      for (int c = 0; c < mChannels; c++) {
+        // History starts mTaps - 1 frames before the block.
+        frame[c] = filter(work[c] + mNext, mPhase);
+      }
+      total++;
+      mPhase += mDown;
+      mNext += mPhase / mUp;
+      mPhase %= mUp;
+    }
+    mNext -= n;
+
+    for (int c = 0; c < mChannels; c++) {
+      memmove(work[c], work[c] + n, history * sizeof(T));
+    }
+    in += n * mChannels;
+    inFrames -= n;
+  }
+  return total;
+}
+
+int Resampler::process(const short* in, int inFrames, short* out)
+{
+  return processBlocks(in, inFrames, out, mWorkShort);
+}
+
+int Resampler::process(const float* in, int inFrames, float* out)
+{
+  return processBlocks(in, inFrames, out, mWorkFloat);
+}
@@ -0,0 +1,83 @@
+//
+// Created by ljliu on 19-3-22.
+//
+
+#ifndef UTILS_RESAMPLER_H
+#define UTILS_RESAMPLER_H
+
+#include <stdint.h>
+
+// Taps per phase when upsampling; downsampling scales them by the ratio so
+// the transition band keeps its width at the output rate.
+#define kResampleTaps 48
+// Kaiser window beta, about 80 dB stopband.
+#define kResampleBeta 8.0
+// Largest reduced interpolation factor (output rate / gcd), e.g. 441 for
+// 16k to 44.1k.
+#define kResampleMaxPhases 1024
+// Input frames filtered per pass; longer inputs are split.
+#define kResampleBlock 256
+
+// Streaming polyphase FIR resampler from one rate to another, any rational
+// ratio, for interleaved int16 or float. The prototype is a Kaiser windowed
+// sinc cut off below the lower of the two Nyquist rates, split into one
+// phase per output position; each output sample is one dot product,
+// vectorized with NEON or SSE2 where built for it.
+//
+// Output frame n is the input at time n * inRate / outRate, delayed by
+// delayFrames() input frames. Feeding k * (inRate / gcd) frames yields
+// exactly k * (outRate / gcd) frames, so fixed size blocks stay fixed size.
+class Resampler {
+public:
+    Resampler();
+    ~Resampler();
+
+    // Returns 0, or -1 when the rates are out of range or need more than
+    // kResampleMaxPhases phases.
+    int init(int inRate, int outRate, int channels);
+    // Back to silence history and phase 0, e.g. at a new stream.
+    void reset();
+
+    // Both return the frames written to |out|, which must hold
+    // maxOutFrames(inFrames) frames. Use one sample type per instance.
+    int process(const short* in, int inFrames, short* out);
+    int process(const float* in, int inFrames, float* out);
+
+    int maxOutFrames(int inFrames) const;
+    double delayFrames() const;
+    int inRate() const { return mInRate; }
+    int outRate() const { return mOutRate; }
+    int taps() const { return mTaps; }
+
+    // For benchmarks: plain C dot products instead of the vector ones.
+    void setScalar(bool scalar) { mScalar = scalar; }
+    static bool vectorized();
+
+private:
+    void release();
+    void design();
+    template <typename T>
+    int processBlocks(const T* in, int inFrames, T* out, T** work);
+    int filter(const short* x, int phase) const;
+    float filter(const float* x, int phase) const;
+
+    int mInRate;
+    int mOutRate;
+    int mChannels;
+    int mUp;                   // L, output rate / gcd
+    int mDown;                 // M, input rate / gcd
+    int mTaps;                 // per phase, a multiple of 8
+    // mUp phases of mTaps each, in input order (oldest sample first).
+    float* mCoefFloat;
+    short* mCoefShort;         // Q15
+    // Per channel: mTaps - 1 frames of history, then one block.
+    short** mWorkShort;
+    float** mWorkFloat;
+    // Next output: its phase and its newest input frame, relative to the
+    // start of the next block.
+    int mPhase;
+    int mNext;
+    bool mScalar;
+};
+
+#endif // UTILS_RESAMPLER_H
@@ -0,0 +1,251 @@
+//
+// Created by ljliu on 19-3-8.
+//
+
+#include "utils/StageGraph.h"
+
+#include <ctype.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_TAG "StageGraph"
+#include "utils/LogUtils.h"
+#include "utils/TimeUtils.h"
+
+static const char* layoutName(ChannelLayout layout) {
+  switch (layout) {
+    case kLayoutMicInterleaved:
+      return "mic";
+    case kLayoutBeamPlanar:
+      return "beam";
+    default:
+      return "none";
+  }
+}
+
+StageGraph::StageGraph() :
+    mCount(0),
+    mOwner(NULL)
+{
+}
+
+int StageGraph::build(const char* spec, const StageDesc* table, int tableSize,
+                      void* owner, ChannelLayout sourceLayout)
+{
+  mCount = 0;
+  mOwner = owner;
+  ChannelLayout layout = sourceLayout;
+
+  const char* p = spec;
+  while (*p) {
+    while (*p == ',' || isspace(*p)) {
+      p++;
+    }
+    const char* end = p;
+    while (*end && *end != ',' && !isspace(*end)) {
+      end++;
+    }
+    if (end == p) {
+      break;
+    }
+
+    int len = end - p;
+    const StageDesc* desc = NULL;
+    for (int i = 0; i < tableSize; i++) {
+      if ((int)strlen(table[i].name) == len &&
+          strncmp(table[i].name, p, len) == 0) {
+        desc = &table[i];
+        break;
+      }
+    }
+    if (desc == NULL) {
+      ALOGE("unknown stage '%.*s'", len, p);
+      return -1;
+    }
+    if (mCount >= kMaxStages) {
+      ALOGE("too many stages");
+      return -1;
+    }
+    if (desc->input != kLayoutNone && desc->input != layout) {
+      ALOGE("stage %s expects %s input but gets %s", desc->name,
+            layoutName(desc->input), layoutName(layout));
+      return -1;
+    }
+    if (desc->output != kLayoutNone) {
+      layout = desc->output;
+    }
+
+    Stage& stage = mStages[mCount++];
+    stage.desc = desc;
+    stage.enabled = true;
+    p = end;
+  }
+
+  for (int i = 0; i < mCount; i++) {
+    if (checkNeeds(i) != 0) {
+      return -1;
+    }
+  }
+
+  resetStats();
+  for (int i = 0; i < mCount; i++) {
+    ALOGD("stage %d: %s (%s -> %s)", i, mStages[i].desc->name,
+          layoutName(mStages[i].desc->input),
+          layoutName(mStages[i].desc->output));
+  }
+  return mCount > 0 ? 0 : -1;
+}
+
+int StageGraph::run(FrameContext* ctx)
+{
+  for (int i = 0; i < mCount; i++) {
+    Stage& stage = mStages[i];
+    if (!stage.enabled.load(std::memory_order_relaxed)) {
+      continue;
+    }
+
+    int64_t begin = monotonic_us();
+    int ret = stage.desc->func(mOwner, ctx);
+    int64_t spent = monotonic_us() - begin;
+
+    stage.calls.fetch_add(1, std::memory_order_relaxed);
+    stage.totalUs.fetch_add(spent, std::memory_order_relaxed);
+    if (spent > stage.maxUs.load(std::memory_order_relaxed)) {
+      stage.maxUs.store(spent, std::memory_order_relaxed);
+    }
+
+    if (ret != 0) {
+      return ret;
+    }
+  }
+  return 0;
+}
+
+int StageGraph::find(const char* name) const
+{
+  return findPrefix(name, strlen(name));
+}
+
+// Stage named by the first |len| characters of |name|.
+int StageGraph::findPrefix(const char* name, int len) const
+{
+  for (int i = 0; i < mCount; i++) {
+    const char* stage = mStages[i].desc->name;
+    if ((int)strlen(stage) == len && strncmp(stage, name, len) == 0) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+// Every stage in StageDesc::needs of stage |index| is in the graph (unless
+// optional) and runs before it.
+int StageGraph::checkNeeds(int index) const
+{
+  const StageDesc* desc = mStages[index].desc;
+  const char* p = desc->needs;
+  while (p != NULL && *p) {
+    const char* end = strchr(p, ',');
+    if (end == NULL) {
+      end = p + strlen(p);
+    }
+    bool optional = *p == '?';
+    const char* name = optional ? p + 1 : p;
+    int len = end - name;
+    int found = findPrefix(name, len);
+    if (found < 0 && !optional) {
+      ALOGE("stage %s needs %.*s", desc->name, len, name);
+      return -1;
+    }
+    if (found > index) {
+      ALOGE("stage %s has to run after %.*s", desc->name, len, name);
+      return -1;
+    }
+    p = *end ? end + 1 : end;
+  }
+  return 0;
+}
+
+bool StageGraph::contains(const char* name) const
+{
+  return find(name) >= 0;
+}
+
+int StageGraph::setEnabled(const char* name, bool enabled)
+{
+  int index = find(name);
+  if (index < 0) {
+    return -1;
+  }
+  mStages[index].enabled = enabled;
+  return 0;
+}
+
+void StageGraph::getStats(StageStats* stats, int maxStats) const
+{
+  for (int i = 0; i < mCount && i < maxStats; i++) {
+    stats[i].name = mStages[i].desc->name;
+    stats[i].enabled = mStages[i].enabled;
+    stats[i].calls = mStages[i].calls;
+    stats[i].totalUs = mStages[i].totalUs;
+    stats[i].maxUs = mStages[i].maxUs;
+  }
+}
+
+void StageGraph::resetStats()
+{
+  for (int i = 0; i < mCount; i++) {
+    mStages[i].calls = 0;
+    mStages[i].totalUs = 0;
+    mStages[i].maxUs = 0;
+  }
+}
+
+void StageGraph::dumpStats(const char* tag) const
+{
+  int64_t total = 0;
+  for (int i = 0; i < mCount; i++) {
+    total += mStages[i].totalUs;
+  }
+
+  for (int i = 0; i < mCount; i++) {
+    const Stage& stage = mStages[i];
+    int64_t calls = stage.calls;
+    int64_t spent = stage.totalUs;
+    printf("%s %-14s %s calls %8lld avg %7.1f us max %6lld us %5.1f%%\n",
+           tag, stage.desc->name, stage.enabled ? "on " : "off",
+           (long long)calls, calls ? (double)spent / calls : 0.0,
+           (long long)stage.maxUs.load(),
+           total ? 100.0 * spent / total : 0.0);
+  }
+}
+
+int load_stage_spec(const char* path, char* spec, int specSize)
+{
+  FILE* fp = fopen(path, "r");
+  if (fp == NULL) {
+    return -1;
+  }
+
+  int ret = -1;
+  char line[512];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "PipelineParam:", 14) != 0) {
+      continue;
+    }
+    // Values are in the last [...] of the line.
+    char* open = strrchr(line, '[');
+    char* close = open ? strchr(open, ']') : NULL;
+    if (close == NULL || close - open - 1 >= specSize) {
+      break;
+    }
+    int len = close - open - 1;
+    memcpy(spec, open + 1, len);
+    spec[len] = '\0';
+    ret = 0;
+    break;
+  }
+
+  fclose(fp);
+  return ret;
+}
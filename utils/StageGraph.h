@@ -0,0 +1,106 @@
+//
+// Created by ljliu on 19-3-8.
+//
+
+#ifndef UTILS_STAGEGRAPH_H
+#define UTILS_STAGEGRAPH_H
+
+#include <stdint.h>
+
+#include <atomic>
+
+#define kMaxStages 16
+
+// Channel layout a stage reads or writes. kLayoutNone means the stage does
+// not look at (input) or does not change (output) the audio.
+enum ChannelLayout {
+    kLayoutNone,
+    kLayoutMicInterleaved,   // kMicNum channels, sample-interleaved
+    kLayoutBeamPlanar,       // kOutNum channels, one block per channel
+};
+
+struct FrameMeta;
+
+// Per-frame state handed from stage to stage. Buffers are owned by the
+// pipeline and preallocated; stages only fill in fields.
+struct FrameContext {
+    FrameMeta* meta;
+    const short* mic;
+    int micSamples;
+    short* beams;
+    int samplesPerChannel;
+    unsigned int frameIndex;
+    int energySlot;
+    int doaAngle;       // -1 until a DOA stage ran
+    int noiseIdx;       // -1 when no noise beam is selected
+    int steerAngle;     // -1 unless a steered beam follows the beams
+    unsigned int refEnergy;  // played reference, 0 without echo_ref
+    bool postAecActive;
+    int64_t startUs;    // monotonic_us() when the frame entered the graph
+};
+
+typedef int (*stage_func)(void* owner, FrameContext* ctx);
+
+struct StageDesc {
+    const char* name;
+    ChannelLayout input;
+    ChannelLayout output;
+    stage_func func;
+    // Comma separated stages whose results this one reads, so they have to
+    // run earlier in the chain. A leading '?' makes one optional: it may be
+    // left out, but if present it still has to come first. NULL for none.
+    const char* needs;
+};
+
+struct StageStats {
+    const char* name;
+    bool enabled;
+    int64_t calls;
+    int64_t totalUs;
+    int64_t maxUs;
+};
+
+// Ordered chain of stages picked by name from a table, checked once at
+// build time for matching channel layouts and StageDesc::needs, then run
+// frame by frame with per-stage timing.
+class StageGraph {
+public:
+    StageGraph();
+
+    // |spec| is a comma separated list of stage names from |table|.
+    int build(const char* spec, const StageDesc* table, int tableSize,
+              void* owner, ChannelLayout sourceLayout);
+    int run(FrameContext* ctx);
+
+    bool contains(const char* name) const;
+    // Safe to call from any thread; takes effect at the next frame.
+    int setEnabled(const char* name, bool enabled);
+
+    int stageCount() const { return mCount; }
+    void getStats(StageStats* stats, int maxStats) const;
+    void resetStats();
+    void dumpStats(const char* tag) const;
+
+private:
+    struct Stage {
+        const StageDesc* desc;
+        std::atomic<bool> enabled;
+        std::atomic<int64_t> calls;
+        std::atomic<int64_t> totalUs;
+        std::atomic<int64_t> maxUs;
+    };
+
+    int find(const char* name) const;
+    int findPrefix(const char* name, int len) const;
+    int checkNeeds(int index) const;
+
+    Stage mStages[kMaxStages];
+    int mCount;
+    void* mOwner;
+};
+
+// Reads "PipelineParam: [stages] = [a, b, c]" from a config file in the
+// uplink.cfg format into |spec| as "a,b,c". Returns -1 if not found.
+int load_stage_spec(const char* path, char* spec, int specSize);
+
+#endif // UTILS_STAGEGRAPH_H
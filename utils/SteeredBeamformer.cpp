@@ -0,0 +1,483 @@
+//
+// Created by ljliu on 19-3-14.
+//
+
+#include "utils/SteeredBeamformer.h"
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LOG_TAG "SteeredBeamformer"
+#include "utils/LogUtils.h"
+#include "utils/TimeUtils.h"
+
+// Ring geometry in the convention of the weight tables: a beam towards
+// theta is distortionless when
+//   sum_m w_m * exp(-j * omega * r / c * cos(theta - kMicAngle[m])) = 1
+// and is applied as y = sum_m w_m * X_m.
+static const double kMicAngle[kSteerMics] = { 90, 270, 30, 210, 330, 150 };
+static const double kRingRadius = 0.04;
+static const double kSoundSpeed = 343.0;
+
+// Stored beams must meet the constraint above this closely, or the file
+// is for another array.
+static const double kFitTolerance = 0.01;
+// Diagonal loading search for the white noise gain floor.
+static const double kMinLoading = 1e-4;
+static const double kMaxLoading = 1e2;
+static const int kLoadingSteps = 24;
+
+#define kWeightCount (kSteerMics * kSteerBins)
+
+static int quantize_angle(int angle)
+{
+  angle = ((angle % 360) + 360) % 360;
+  return (angle + kSteerAngleStep / 2) / kSteerAngleStep * kSteerAngleStep
+      % 360;
+}
+
+static void steering_vector(double theta, int bin, double* re, double* im)
+{
+  double omega = 2.0 * M_PI * bin * kSteerRate / kSteerFftSize;
+  for (int m = 0; m < kSteerMics; m++) {
+    double phase = -omega * kRingRadius / kSoundSpeed *
+        cos((theta - kMicAngle[m]) * M_PI / 180.0);
+    re[m] = cos(phase);
+    im[m] = sin(phase);
+  }
+}
+
+// Solves A x = b for the symmetric positive definite |a|, in place.
+static bool cholesky_solve(double a[kSteerMics][kSteerMics],
+                           double* b1, double* b2)
+{
+  const int n = kSteerMics;
+  for (int j = 0; j < n; j++) {
+    double d = a[j][j];
+    for (int k = 0; k < j; k++) {
+      d -= a[j][k] * a[j][k];
+    }
+    if (d <= 0.0) {
+      return false;
+    }
+    a[j][j] = sqrt(d);
+    for (int i = j + 1; i < n; i++) {
+      double s = a[i][j];
+      for (int k = 0; k < j; k++) {
+        s -= a[i][k] * a[j][k];
+      }
+      a[i][j] = s / a[j][j];
+    }
+  }
+  double* rhs[2] = { b1, b2 };
+  for (int r = 0; r < 2; r++) {
+    double* b = rhs[r];
+    for (int i = 0; i < n; i++) {
+      for (int k = 0; k < i; k++) {
+        b[i] -= a[i][k] * b[k];
+      }
+      b[i] /= a[i][i];
+    }
+    for (int i = n - 1; i >= 0; i--) {
+      for (int k = i + 1; k < n; k++) {
+        b[i] -= a[k][i] * b[k];
+      }
+      b[i] /= a[i][i];
+    }
+  }
+  return true;
+}
+
+// Superdirective weights for one bin with diagonal loading |mu|. Returns
+// sum |w|^2, the inverse of the white noise gain.
+static double superdirective(double gamma[kSteerMics][kSteerMics],
+                             const double* dr, const double* di, double mu,
+                             Complex* w)
+{
+  double a[kSteerMics][kSteerMics];
+  double xr[kSteerMics];
+  double xi[kSteerMics];
+  for (int i = 0; i < kSteerMics; i++) {
+    for (int j = 0; j < kSteerMics; j++) {
+      a[i][j] = gamma[i][j] + (i == j ? mu : 0.0);
+    }
+    xr[i] = dr[i];
+    xi[i] = -di[i];
+  }
+  if (!cholesky_solve(a, xr, xi)) {
+    return HUGE_VAL;
+  }
+
+  // Normalize to sum_m w_m d_m = 1.
+  double nr = 0.0;
+  double ni = 0.0;
+  for (int m = 0; m < kSteerMics; m++) {
+    nr += xr[m] * dr[m] - xi[m] * di[m];
+    ni += xr[m] * di[m] + xi[m] * dr[m];
+  }
+  double norm = nr * nr + ni * ni;
+  double power = 0.0;
+  for (int m = 0; m < kSteerMics; m++) {
+    double re = (xr[m] * nr + xi[m] * ni) / norm;
+    double im = (xi[m] * nr - xr[m] * ni) / norm;
+    w[m * kSteerBins].re = (float)re;
+    w[m * kSteerBins].im = (float)im;
+    power += re * re + im * im;
+  }
+  return power;
+}
+
+SteeredBeamformer::SteeredBeamformer() :
+    mUseClock(0),
+    mAngle(-1),
+    mFft(kSteerFftSize)
+{
+  pthread_mutex_init(&mLock, NULL);
+  memset(&mStats, 0, sizeof(mStats));
+  // Square root Hann on both ends, the product overlap-adds to one.
+  for (int i = 0; i < kSteerFftSize; i++) {
+    mWindow[i] = (float)sqrt(0.5 - 0.5 * cos(2.0 * M_PI * i / kSteerFftSize));
+  }
+  reset();
+}
+
+SteeredBeamformer::~SteeredBeamformer()
+{
+  pthread_mutex_destroy(&mLock);
+}
+
+int SteeredBeamformer::load(const char* weightFile)
+{
+  FILE* fp = fopen(weightFile, "r");
+  if (fp == NULL) {
+    ALOGE("failed to open %s", weightFile);
+    return -1;
+  }
+
+  std::vector<Weights> table;
+  std::vector<int> counts;
+  int part = -1;
+  char line[1024];
+  while (fgets(line, sizeof(line), fp) != NULL) {
+    if (strncmp(line, "//", 2) == 0) {
+      int angle = 0;
+      if (sscanf(line, "// W_%d_", &angle) == 1) {
+        Weights entry;
+        entry.angle = quantize_angle(angle);
+        entry.lastUse = 0;
+        entry.w.assign(kWeightCount, Complex());
+        table.push_back(entry);
+        counts.push_back(0);
+        counts.push_back(0);
+        part = -1;
+      } else if (strstr(line, "re") != NULL) {
+        part = 0;
+      } else if (strstr(line, "im") != NULL) {
+        part = 1;
+      }
+      continue;
+    }
+    // The angle list on the first line comes before any block.
+    if (table.empty() || part < 0) {
+      continue;
+    }
+
+    int* count = &counts[2 * (table.size() - 1) + part];
+    Complex* w = &table.back().w[0];
+    char* p = line;
+    while (*p != '\0') {
+      char* end = NULL;
+      float value = strtof(p, &end);
+      if (end == p) {
+        p++;
+        continue;
+      }
+      if (*count < kWeightCount) {
+        if (part == 0) {
+          w[*count].re = value;
+        } else {
+          w[*count].im = value;
+        }
+      }
+      (*count)++;
+      p = end;
+    }
+  }
+  fclose(fp);
+
+  if (table.empty()) {
+    ALOGE("no beams in %s", weightFile);
+    return -1;
+  }
+  for (size_t i = 0; i < table.size(); i++) {
+    if (counts[2 * i] != kWeightCount || counts[2 * i + 1] != kWeightCount) {
+      ALOGE("beam %d in %s has %d/%d weights, expected %d",
+            table[i].angle, weightFile, counts[2 * i], counts[2 * i + 1],
+            kWeightCount);
+      return -1;
+    }
+
+    double worst = 0.0;
+    for (int k = 0; k < kSteerBins; k++) {
+      double dr[kSteerMics];
+      double di[kSteerMics];
+      steering_vector(table[i].angle, k, dr, di);
+      double re = 0.0;
+      double im = 0.0;
+      for (int m = 0; m < kSteerMics; m++) {
+        const Complex& w = table[i].w[m * kSteerBins + k];
+        re += w.re * dr[m] - w.im * di[m];
+        im += w.re * di[m] + w.im * dr[m];
+      }
+      double error = hypot(re - 1.0, im);
+      if (error > worst) {
+        worst = error;
+      }
+    }
+    if (worst > kFitTolerance) {
+      ALOGE("beam %d in %s does not fit the %d mic ring (error %.3f)",
+            table[i].angle, weightFile, kSteerMics, worst);
+      return -1;
+    }
+  }
+
+  pthread_mutex_lock(&mLock);
+  mTable.swap(table);
+  mCache.clear();
+  mCache.reserve(kSteerCacheSize);
+  mActive.assign(kWeightCount, Complex());
+  mAngle = -1;
+  pthread_mutex_unlock(&mLock);
+  ALOGD("loaded %zu beams from %s", mTable.size(), weightFile);
+  return 0;
+}
+
+const SteeredBeamformer::Weights* SteeredBeamformer::lookupLocked(int angle)
+{
+  for (size_t i = 0; i < mTable.size(); i++) {
+    if (mTable[i].angle == angle) {
+      mStats.tableHits++;
+      return &mTable[i];
+    }
+  }
+  for (size_t i = 0; i < mCache.size(); i++) {
+    if (mCache[i].angle == angle) {
+      mCache[i].lastUse = ++mUseClock;
+      mStats.cacheHits++;
+      return &mCache[i];
+    }
+  }
+  return NULL;
+}
+
+int SteeredBeamformer::steer(int angle)
+{
+  if (!loaded()) {
+    return -1;
+  }
+  int quantized = quantize_angle(angle);
+
+  pthread_mutex_lock(&mLock);
+  mStats.steers++;
+  if (quantized == mAngle) {
+    pthread_mutex_unlock(&mLock);
+    return quantized;
+  }
+  const Weights* hit = lookupLocked(quantized);
+  if (hit != NULL) {
+    mActive = hit->w;
+    mAngle = quantized;
+    pthread_mutex_unlock(&mLock);
+    return quantized;
+  }
+  pthread_mutex_unlock(&mLock);
+
+  // Design without the lock, the frame thread keeps the old beam meanwhile.
+  std::vector<Complex> w(kWeightCount);
+  int64_t startUs = monotonic_us();
+  design(quantized, &w[0]);
+  int64_t designUs = monotonic_us() - startUs;
+
+  pthread_mutex_lock(&mLock);
+  mStats.designs++;
+  mStats.lastDesignUs = designUs;
+  if (designUs > mStats.maxDesignUs) {
+    mStats.maxDesignUs = designUs;
+  }
+  size_t slot = mCache.size();
+  if (slot >= kSteerCacheSize) {
+    slot = 0;
+    for (size_t i = 1; i < mCache.size(); i++) {
+      if (mCache[i].lastUse < mCache[slot].lastUse) {
+        slot = i;
+      }
+    }
+  } else {
+    mCache.push_back(Weights());
+  }
+  mCache[slot].angle = quantized;
+  mCache[slot].lastUse = ++mUseClock;
+  mCache[slot].w.swap(w);
+  mActive = mCache[slot].w;
+  mAngle = quantized;
+  pthread_mutex_unlock(&mLock);
+  ALOGD("designed beam %d in %lld us", quantized, (long long)designUs);
+  return quantized;
+}
+
+int SteeredBeamformer::angle() const
+{
+  return mAngle;
+}
+
+// Diffuse noise coherence with loading raised until the white noise gain is
+// back at 0 dB, as in the stored tables. At low frequencies that is what
+// limits the directivity, above a few kHz the plain design already meets it.
+void SteeredBeamformer::design(int angle, Complex* w)
+{
+  double dist[kSteerMics][kSteerMics];
+  for (int i = 0; i < kSteerMics; i++) {
+    for (int j = 0; j < kSteerMics; j++) {
+      double half = (kMicAngle[i] - kMicAngle[j]) * M_PI / 360.0;
+      dist[i][j] = 2.0 * kRingRadius * fabs(sin(half));
+    }
+  }
+
+  for (int k = 0; k < kSteerBins; k++) {
+    double omega = 2.0 * M_PI * k * kSteerRate / kSteerFftSize;
+    double gamma[kSteerMics][kSteerMics];
+    for (int i = 0; i < kSteerMics; i++) {
+      for (int j = 0; j < kSteerMics; j++) {
+        double x = omega * dist[i][j] / kSoundSpeed;
+        gamma[i][j] = x > 0.0 ? sin(x) / x : 1.0;
+      }
+    }
+    double dr[kSteerMics];
+    double di[kSteerMics];
+    steering_vector(angle, k, dr, di);
+
+    if (superdirective(gamma, dr, di, kMinLoading, w + k) <= 1.0) {
+      continue;
+    }
+    // Bisect the loading on a log scale, keeping the feasible end.
+    double lo = log(kMinLoading);
+    double hi = log(kMaxLoading);
+    for (int step = 0; step < kLoadingSteps; step++) {
+      double mid = 0.5 * (lo + hi);
+      if (superdirective(gamma, dr, di, exp(mid), w + k) <= 1.0) {
+        hi = mid;
+      } else {
+        lo = mid;
+      }
+    }
+    superdirective(gamma, dr, di, exp(hi), w + k);
+  }
+}
+
+int SteeredBeamformer::process(const short* mic, int frames, short* out)
+{
+  if (!loaded()) {
+    return -1;
+  }
+  for (int done = 0; done < frames;) {
+    int n = frames - done;
+    if (n > kSteerHop - mFill) {
+      n = kSteerHop - mFill;
+    }
+    const short* in = mic + done * kSteerMics;
+    for (int i = 0; i < n; i++) {
+      for (int m = 0; m < kSteerMics; m++) {
+        mInput[m][kSteerHop + mFill + i] = in[i * kSteerMics + m];
+      }
+    }
+    memcpy(out + done, mOutput + mFill, n * sizeof(short));
+    mFill += n;
+    done += n;
+    if (mFill < kSteerHop) {
+      break;
+    }
+
+    int64_t startUs = monotonic_us();
+    pthread_mutex_lock(&mLock);
+    if (mAngle >= 0) {
+      runHop(&mActive[0]);
+    }
+    mStats.hops++;
+    mStats.processUs += monotonic_us() - startUs;
+    pthread_mutex_unlock(&mLock);
+    for (int m = 0; m < kSteerMics; m++) {
+      memcpy(mInput[m], mInput[m] + kSteerHop, kSteerHop * sizeof(float));
+    }
+    mFill = 0;
+  }
+  return frames;
+}
+
+void SteeredBeamformer::runHop(const Complex* w)
+{
+  memset(mBeam, 0, sizeof(mBeam));
+  for (int m = 0; m < kSteerMics; m++) {
+    for (int i = 0; i < kSteerFftSize; i++) {
+      mFrame[i] = mInput[m][i] * mWindow[i];
+    }
+    mFft.forwardReal(mFrame, mSpectrum);
+    const Complex* wm = w + m * kSteerBins;
+    for (int k = 0; k < kSteerBins; k++) {
+      mBeam[k].re += wm[k].re * mSpectrum[k].re - wm[k].im * mSpectrum[k].im;
+      mBeam[k].im += wm[k].re * mSpectrum[k].im + wm[k].im * mSpectrum[k].re;
+    }
+  }
+  mFft.inverseReal(mBeam, mFrame);
+
+  for (int i = 0; i < kSteerHop; i++) {
+    float sample = mOverlap[i] + mFrame[i] * mWindow[i];
+    if (sample > 32767.0f) {
+      sample = 32767.0f;
+    } else if (sample < -32768.0f) {
+      sample = -32768.0f;
+    }
+    mOutput[i] = (short)lrintf(sample);
+    mOverlap[i] = mFrame[kSteerHop + i] * mWindow[kSteerHop + i];
+  }
+}
+
+void SteeredBeamformer::reset()
+{
+  memset(mInput, 0, sizeof(mInput));
+  memset(mOverlap, 0, sizeof(mOverlap));
+  memset(mOutput, 0, sizeof(mOutput));
+  mFill = 0;
+}
+
+void SteeredBeamformer::getStats(SteerStats* stats)
+{
+  pthread_mutex_lock(&mLock);
+  *stats = mStats;
+  stats->angle = mAngle;
+  stats->tableBytes = mTable.size() * kWeightCount * sizeof(Complex);
+  stats->cacheBytes = mCache.size() * kWeightCount * sizeof(Complex);
+  // Overlap buffers, the active weights and the FFT's twiddles and scratch.
+  stats->stateBytes = sizeof(*this) +
+      mActive.capacity() * sizeof(Complex) +
+      3 * kSteerFftSize * sizeof(Complex);
+  pthread_mutex_unlock(&mLock);
+}
+
+void SteeredBeamformer::dumpStats()
+{
+  SteerStats stats;
+  getStats(&stats);
+  printf("[steer] angle %d, %u steers: %u table, %u cached, %u designed "
+         "(last %lld us, max %lld us)\n",
+         stats.angle, stats.steers, stats.tableHits, stats.cacheHits,
+         stats.designs, (long long)stats.lastDesignUs,
+         (long long)stats.maxDesignUs);
+  printf("[steer] %u hops, avg %lld us per %d ms; memory: table %zu, "
+         "cache %zu (%d max), state %zu bytes\n",
+         stats.hops,
+         stats.hops > 0 ? (long long)(stats.processUs / stats.hops) : 0LL,
+         kSteerHop * 1000 / kSteerRate, stats.tableBytes, stats.cacheBytes,
+         kSteerCacheSize, stats.stateBytes);
+}
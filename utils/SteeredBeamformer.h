@@ -0,0 +1,110 @@
+//
+// Created by ljliu on 19-3-14.
+//
+
+#ifndef UTILS_STEEREDBEAMFORMER_H
+#define UTILS_STEEREDBEAMFORMER_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <vector>
+
+#include "utils/Fft.h"
+
+// Geometry of the 6 mic, 80 mm ring the weight tables were designed for.
+#define kSteerMics 6
+#define kSteerRate 16000
+// Filter-and-sum in the DSP's STFT domain: 320 point frames, 50% overlap,
+// so one hop is 10 ms and the output lags the input by one hop.
+#define kSteerFftSize 320
+#define kSteerBins (kSteerFftSize / 2 + 1)
+#define kSteerHop (kSteerFftSize / 2)
+// Look directions are cached in steps of this many degrees.
+#define kSteerAngleStep 5
+#define kSteerCacheSize 8
+
+struct SteerStats {
+    int angle;                 // current look direction, -1 when unset
+    unsigned int steers;
+    unsigned int cacheHits;
+    unsigned int tableHits;    // served from the stored weight file
+    unsigned int designs;
+    int64_t lastDesignUs;
+    int64_t maxDesignUs;
+    unsigned int hops;
+    int64_t processUs;         // total over |hops|
+    size_t tableBytes;
+    size_t cacheBytes;
+    size_t stateBytes;
+};
+
+// One beam at any look direction, built from the raw mics. On the 30 degree
+// grid of the weight file the stored weights are used as they are; between
+// grid points the weights are designed from the ring geometry the same way
+// the tables were (superdirective, distortionless towards the look
+// direction, white noise gain held at 0 dB or above). Weights are cached
+// per kSteerAngleStep, least recently used out.
+//
+// steer() may be called from any thread and does the design work itself,
+// process() belongs to the frame thread.
+class SteeredBeamformer {
+public:
+    SteeredBeamformer();
+    ~SteeredBeamformer();
+
+    // Reads a weight file in the 6mic_ring_80mm_weights.txt layout and
+    // checks every stored beam against the ring geometry. Returns 0 on
+    // success, -1 when the file is unreadable or does not fit the ring.
+    int load(const char* weightFile);
+    bool loaded() const { return !mTable.empty(); }
+
+    // Selects the look direction in degrees, same convention as the DSP's
+    // DOA and fixed beams. Returns the quantized angle, -1 if not loaded.
+    int steer(int angle);
+    int angle() const;
+
+    // |mic| holds |frames| samples of kSteerMics interleaved channels.
+    // Writes |frames| beam samples to |out|; before steer() the output is
+    // silence. Returns |frames|, -1 if not loaded.
+    int process(const short* mic, int frames, short* out);
+
+    // Drops the overlap state, e.g. between unrelated streams.
+    void reset();
+
+    void getStats(SteerStats* stats);
+    void dumpStats();
+
+private:
+    struct Weights {
+        int angle;
+        unsigned int lastUse;
+        std::vector<Complex> w;    // [mic][bin]
+    };
+
+    const Weights* lookupLocked(int angle);
+    void design(int angle, Complex* w);
+    void runHop(const Complex* w);
+
+    std::vector<Weights> mTable;
+    std::vector<Weights> mCache;
+    pthread_mutex_t mLock;
+    unsigned int mUseClock;
+    int mAngle;
+    std::vector<Complex> mActive;
+    SteerStats mStats;
+
+    // Frame thread state.
+    Fft mFft;
+    float mWindow[kSteerFftSize];
+    float mInput[kSteerMics][kSteerFftSize];
+    float mFrame[kSteerFftSize];
+    Complex mSpectrum[kSteerBins];
+    Complex mBeam[kSteerBins];
+    float mOverlap[kSteerHop];
+    short mOutput[kSteerHop];
+    int mFill;
+};
+
+#endif // UTILS_STEEREDBEAMFORMER_H
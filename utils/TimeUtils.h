@@ -0,0 +1,19 @@
+//
+// Created by ljliu on 19-3-4.
+//
+
+#ifndef UTILS_TIMEUTILS_H
+#define UTILS_TIMEUTILS_H
+
+#include <stdint.h>
+#include <time.h>
+
+// Monotonic clock in microseconds, used for deadlines and profiling.
+static inline int64_t monotonic_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+#endif // UTILS_TIMEUTILS_H
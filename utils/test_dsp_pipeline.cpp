@@ -3,23 +3,76 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+#include <algorithm>
 
 #include "MobPipeline.h"
 
-static void speechCallback(void* ud, char* buffer, int length)
+static double cpuSeconds()
 {
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec +
+           (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
 }
 
-int main()
+static void speechCallback(void* ud, const BeamFrame& frame,
+                           const FrameMeta& meta)
+{
+}
+
+// test_dsp_pipeline [doa_decimation]: run once with 1 and once with the
+// default and compare the doa line of 'p'.
+int main(int argc, char* argv[])
 {
     printf("mob dsp demp\n");
-    MobPipeline* pipeline = new MobPipeline(speechCallback, NULL);
+    MobPipelineConfig config;
+    if (argc > 1) {
+        config.doaDecimation = atoi(argv[1]);
+    }
+    MobPipeline* pipeline = new MobPipeline(config, speechCallback, NULL);
     pipeline->start();
 
+    bool lowPower = false;
     char c;
     while((c = getchar()) > 0) {
         if (c == 'q' || c == 'Q') {
             break;
+        } else if (c == 'r' || c == 'R') {
+            // Pick up edits to uplink.cfg / weights without restarting.
+            printf("reload dsp config: %d\n", pipeline->reload());
+        } else if (c == 'p' || c == 'P') {
+            pipeline->dumpStageStats();
+        } else if (c == 'l' || c == 'L') {
+            lowPower = !lowPower;
+            pipeline->setLowPower(lowPower);
+            printf("low power %s\n", lowPower ? "on" : "off");
+        } else if (c == 'u' || c == 'U') {
+            // Average CPU of the whole process over 10 s, run once in a
+            // quiet room with low power on and once with it off.
+            double before = cpuSeconds();
+            sleep(10);
+            printf("cpu %.1f%% (%s)\n", (cpuSeconds() - before) * 10,
+                   pipeline->sleeping() ? "sleeping" : "awake");
+            pipeline->dumpStageStats();
+        } else if (c == 'c' || c == 'C') {
+            // Restart cycle, as done on every config change.
+            long long maxStart = 0, maxStop = 0, sumStart = 0, sumStop = 0;
+            const int cycles = 10;
+            for (int i = 0; i < cycles; i++) {
+                pipeline->stop();
+                pipeline->start();
+                usleep(200 * 1000);
+                sumStart += pipeline->lastStartUs();
+                sumStop += pipeline->lastStopUs();
+                maxStart = std::max(maxStart, (long long)pipeline->lastStartUs());
+                maxStop = std::max(maxStop, (long long)pipeline->lastStopUs());
+            }
+            printf("start avg %lld us max %lld us, stop avg %lld us max %lld us\n",
+                   sumStart / cycles, maxStart, sumStop / cycles, maxStop);
         }
     }
 
@@ -0,0 +1,308 @@
+//
+// Created by ljliu on 19-3-23.
+//
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <string>
+#include <vector>
+
+#include "utils/AudioPlayer.h"
+#include "utils/AudioRecord.h"
+#include "utils/EchoReference.h"
+#include "utils/LatencyCalibrator.h"
+#include "utils/MobPipeline.h"
+#include "utils/TimeUtils.h"
+
+// Capture and playback block, as the pipeline's default frame.
+#define kBlockMs 10
+#define kBlockSamples (kBlockMs * kCalibRate / 1000)
+
+// Both ways of getting a loopback end in the same files in |dir|: mic.pcm,
+// kMicNum interleaved 16k mics, and ref.pcm, the reference the echo_ref
+// stage would have read for them at no delay. replay() measures from those.
+struct LoopbackFiles {
+  FILE* mic;
+  FILE* ref;
+};
+
+static int openFiles(const std::string& dir, const char* mode,
+                     LoopbackFiles* files)
+{
+  files->mic = fopen((dir + "/mic.pcm").c_str(), mode);
+  files->ref = fopen((dir + "/ref.pcm").c_str(), mode);
+  if (files->mic == NULL || files->ref == NULL) {
+    printf("cannot open mic.pcm / ref.pcm in %s\n", dir.c_str());
+    if (files->mic) fclose(files->mic);
+    if (files->ref) fclose(files->ref);
+    return -1;
+  }
+  return 0;
+}
+
+static void closeFiles(LoopbackFiles* files)
+{
+  fclose(files->mic);
+  fclose(files->ref);
+}
+
+static double noise(double rms)
+{
+  // Sum of uniforms, close enough to gaussian.
+  double sum = 0;
+  for (int i = 0; i < 12; i++) {
+    sum += (double)rand() / RAND_MAX;
+  }
+  return (sum - 6) * rms;
+}
+
+// Simulated loopback: a player publishing each block as it "starts
+// playing" on a simulated clock, a room that delays the played stream by
+// |delayMs| (plus up to |jitterMs| either way, changing per probe period)
+// into kMicNum mics with noise, and a capture side stamping each block a
+// little after its end, the way the recorder callback does.
+int simulate(const std::string& dir, CalibProbe probe, double delayMs,
+             double jitterMs, double noiseRms)
+{
+  LoopbackFiles files;
+  if (openFiles(dir, "wb", &files) != 0) {
+    return -1;
+  }
+  FILE* playedFile = fopen((dir + "/played.pcm").c_str(), "wb");
+
+  LatencyCalibrator calibrator(probe, kCalibRepeats, kMicNum);
+  EchoReference echoRef;
+  int period = kCalibPeriodMs * kCalibRate / 1000;
+  int total = calibrator.totalSamples() + calibrator.tailSamples();
+
+  std::vector<short> played;
+  std::vector<int> delays;
+  for (int p = 0; p * period < total; p++) {
+    double d = delayMs + jitterMs * (2.0 * rand() / RAND_MAX - 1);
+    delays.push_back((int)(d * kCalibRate / 1000 + 0.5));
+  }
+  float gains[kMicNum];
+  for (int c = 0; c < kMicNum; c++) {
+    gains[c] = 0.3f + 0.05f * c;
+  }
+
+  // Capture runs a little ahead of playback, clocks are arbitrary.
+  int64_t playStartUs = 1000000000LL;
+  int64_t captureStartUs = playStartUs - 23000;
+  int captureOffset = 23000 * kCalibRate / 1000000;
+  short block[kBlockSamples];
+  short mic[kBlockSamples * kMicNum];
+  short ref[kBlockSamples];
+  for (int n = 0; n < total; n += kBlockSamples) {
+    // Player: the next block starts playing.
+    int64_t startUs = playStartUs + n * 1000000LL / kCalibRate;
+    int rendered = calibrator.renderProbe(block, kBlockSamples);
+    if (rendered > 0) {
+      echoRef.publish(block, rendered, startUs);
+      played.insert(played.end(), block, block + rendered);
+      fwrite(block, sizeof(short), rendered, playedFile);
+    }
+
+    // Room: mic sample m hears what played d samples before.
+    for (int i = 0; i < kBlockSamples; i++) {
+      int m = n + i;
+      int source = m - captureOffset - delays[m / period];
+      double echo = source >= 0 && source < (int)played.size()
+          ? played[source] : 0;
+      for (int c = 0; c < kMicNum; c++) {
+        double v = echo * gains[c] + noise(noiseRms);
+        v = v > 32767 ? 32767 : (v < -32768 ? -32768 : v);
+        mic[i * kMicNum + c] = (short)v;
+      }
+    }
+
+    // Capture: the block is handed over up to 1 ms after its end.
+    int64_t endUs = captureStartUs + (n + kBlockSamples) * 1000000LL /
+                    kCalibRate;
+    int64_t lateUs = rand() % 1000;
+    echoRef.read(endUs + lateUs - kBlockMs * 1000, ref, kBlockSamples);
+    fwrite(mic, sizeof(short), kBlockSamples * kMicNum, files.mic);
+    fwrite(ref, sizeof(short), kBlockSamples, files.ref);
+  }
+
+  fclose(playedFile);
+  closeFiles(&files);
+  printf("simulated %d ms of loopback, delay %.1f +- %.1f ms, noise %.0f\n",
+         total * 1000 / kCalibRate, delayMs, jitterMs, noiseRms);
+  return 0;
+}
+
+struct PlayerArgs {
+  AudioPlayer* player;
+  LatencyCalibrator* calibrator;
+};
+
+static void* playProbes(void* arg)
+{
+  PlayerArgs* args = (PlayerArgs*)arg;
+  AudioPlayer* player = args->player;
+  char* buffer = NULL;
+  while (player->lease(&buffer, true) > 0) {
+    int samples = args->calibrator->renderProbe(
+        (short*)buffer, player->bufferSize() / sizeof(short));
+    player->commit(buffer, samples * sizeof(short));
+    if (samples == 0) {
+      break;
+    }
+  }
+  player->drain(2000);
+  return NULL;
+}
+
+// The real loopback: probes through a streaming player publishing to an
+// EchoReference, kMicNum mics through AudioRecord the way MobPipeline
+// opens it (48k stereo carrying 16k channels).
+int record(const std::string& dir, CalibProbe probe)
+{
+  LoopbackFiles files;
+  if (openFiles(dir, "wb", &files) != 0) {
+    return -1;
+  }
+
+  LatencyCalibrator calibrator(probe, kCalibRepeats, kMicNum);
+  EchoReference echoRef;
+  AudioPlayer* player = new AudioPlayer(STREAMING);
+  player->createStreamingAudioPlayer(kCalibRate, 1,
+                                     kBlockSamples * sizeof(short));
+  player->setEchoReference(&echoRef);
+
+  int blockBytes = kBlockSamples * kMicNum * sizeof(short);
+  AudioRecord* recorder = new AudioRecord(48000, 2, blockBytes);
+  recorder->startRecording();
+  player->start();
+
+  PlayerArgs args = { player, &calibrator };
+  pthread_t thread;
+  pthread_create(&thread, NULL, playProbes, &args);
+
+  int total = calibrator.totalSamples() + calibrator.tailSamples();
+  short ref[kBlockSamples];
+  for (int n = 0; n < total; ) {
+    char* buffer = NULL;
+    int64_t captureUs = 0;
+    int size = recorder->obtainBuffer(&buffer, true, &captureUs);
+    if (size <= 0) {
+      continue;
+    }
+    echoRef.read(captureUs - kBlockMs * 1000, ref, kBlockSamples);
+    fwrite(buffer, 1, size, files.mic);
+    fwrite(ref, sizeof(short), kBlockSamples, files.ref);
+    recorder->releaseBuffer(buffer);
+    n += kBlockSamples;
+  }
+
+  pthread_join(thread, NULL);
+  recorder->stop();
+  player->stop();
+  player->dumpStats();
+  player->destoryAudioPlayer();
+  delete player;
+  delete recorder;
+  closeFiles(&files);
+  return 0;
+}
+
+// Measures mic.pcm against ref.pcm; saves to |savePath| unless NULL.
+int replay(const std::string& dir, CalibProbe probe, const char* savePath)
+{
+  LoopbackFiles files;
+  if (openFiles(dir, "rb", &files) != 0) {
+    return -1;
+  }
+
+  LatencyCalibrator calibrator(probe, kCalibRepeats, kMicNum);
+  short mic[kBlockSamples * kMicNum];
+  short ref[kBlockSamples];
+  while (fread(mic, sizeof(short) * kMicNum, kBlockSamples, files.mic) ==
+             kBlockSamples &&
+         fread(ref, sizeof(short), kBlockSamples, files.ref) ==
+             kBlockSamples) {
+    calibrator.addCapture(mic, ref, kBlockSamples);
+  }
+  closeFiles(&files);
+
+  int64_t begin = monotonic_us();
+  LatencyResult result;
+  int ret = calibrator.measure(&result);
+  printf("measured %d ms of capture in %lld us\n",
+         calibrator.capturedSamples() * 1000 / kCalibRate,
+         (long long)(monotonic_us() - begin));
+  LatencyCalibrator::dump(result);
+  if (ret != 0) {
+    printf("calibration failed\n");
+    return -1;
+  }
+
+  if (savePath != NULL) {
+    if (LatencyCalibrator::save(savePath, result) != 0) {
+      return -1;
+    }
+    printf("saved to %s\n", savePath);
+  }
+  return 0;
+}
+
+int main(int argc, char* argv[])
+{
+  std::string dir = ".";
+  std::string save = MobPipelineConfig().dspConfigDir + "/" + kLatencyFile;
+  const char* mode = NULL;
+  CalibProbe probe = kProbeMls;
+  bool saving = false;
+  double delayMs = 40;
+  double jitterMs = 1;
+  double noiseRms = 200;
+
+  argv++;
+  while (*argv) {
+    if (strcmp(*argv, "-sim") == 0 || strcmp(*argv, "-device") == 0 ||
+        strcmp(*argv, "-replay") == 0) {
+      mode = *argv;
+    } else if (strcmp(*argv, "-chirp") == 0) {
+      probe = kProbeChirp;
+    } else if (strcmp(*argv, "-dir") == 0 && argv[1]) {
+      dir = *++argv;
+    } else if (strcmp(*argv, "-save") == 0) {
+      saving = true;
+      if (argv[1] && argv[1][0] != '-') {
+        save = *++argv;
+      }
+    } else if (strcmp(*argv, "-delay") == 0 && argv[1]) {
+      delayMs = atof(*++argv);
+    } else if (strcmp(*argv, "-jitter") == 0 && argv[1]) {
+      jitterMs = atof(*++argv);
+    } else if (strcmp(*argv, "-noise") == 0 && argv[1]) {
+      noiseRms = atof(*++argv);
+    }
+    argv++;
+  }
+
+  if (mode == NULL) {
+    printf("usage: test_loopback -sim [-delay ms] [-jitter ms] [-noise rms] "
+           "| -device | -replay\n"
+           "  [-chirp] [-dir <dir for mic.pcm, ref.pcm>] [-save [file]]\n"
+           "-device records a loopback, -sim simulates one; both measure it "
+           "like -replay.\n-save writes the result, by default to %s\n",
+           save.c_str());
+    return 1;
+  }
+
+  int ret = 0;
+  if (strcmp(mode, "-sim") == 0) {
+    ret = simulate(dir, probe, delayMs, jitterMs, noiseRms);
+  } else if (strcmp(mode, "-device") == 0) {
+    ret = record(dir, probe);
+  }
+  if (ret == 0) {
+    ret = replay(dir, probe, saving ? save.c_str() : NULL);
+  }
+  return ret == 0 ? 0 : 1;
+}
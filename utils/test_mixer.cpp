@@ -0,0 +1,209 @@
+//
+// Created by ljliu on 19-3-21.
+//
+
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <algorithm>
+
+#include "utils/AudioMixer.h"
+#include "utils/AudioPlayer.h"
+#include "utils/TimeUtils.h"
+
+// One player buffer, 80 ms at 16k.
+#define kBenchSamples (16 * 80)
+
+typedef void (*mix_func)(short* out, const short* in, int samples,
+                         int gainFrom, int gainTo);
+
+// Time to clear one buffer and mix |streams| into it, in ns.
+static double benchMix(mix_func mix, short** inputs, int streams,
+                       int count, bool ramp)
+{
+  short out[kBenchSamples];
+  int64_t begin = monotonic_us();
+  for (int n = 0; n < count; n++) {
+    memset(out, 0, sizeof(out));
+    for (int s = 0; s < streams; s++) {
+      int gain = 20000 + s * 1000;
+      mix(out, inputs[s], kBenchSamples, ramp ? gain / 4 : gain, gain);
+    }
+  }
+  int64_t us = monotonic_us() - begin;
+  // Keeps the loop from being optimized away.
+  if (out[0] == 12345) {
+    printf(" ");
+  }
+  return us * 1000.0 / count;
+}
+
+// Mix cost per stream and buffer, vector kernel against the scalar one,
+// after checking both give the same samples.
+void benchMixer(int count)
+{
+  short* inputs[kMaxMixStreams];
+  for (int s = 0; s < kMaxMixStreams; s++) {
+    inputs[s] = new short[kBenchSamples];
+    for (int i = 0; i < kBenchSamples; i++) {
+      // Loud enough to clip once a few streams add up.
+      inputs[s][i] = (short)(rand() % 65536 - 32768);
+    }
+  }
+
+  int mismatches = 0;
+  short a[kBenchSamples + 5];
+  short b[kBenchSamples + 5];
+  int gains[][2] = { {kMixUnity, kMixUnity}, {16384, 16384},
+                     {kMixUnity, 8192}, {0, 32767}, {12345, kMixUnity} };
+  for (unsigned int g = 0; g < sizeof(gains) / sizeof(gains[0]); g++) {
+    // An odd length for the scalar tail of the vector path.
+    int samples = kBenchSamples + 5;
+    for (int i = 0; i < samples; i++) {
+      a[i] = b[i] = (short)(rand() % 65536 - 32768);
+    }
+    AudioMixer::mixQ15(a, inputs[g % kMaxMixStreams], samples - 5,
+                       gains[g][0], gains[g][1]);
+    AudioMixer::mixQ15Scalar(b, inputs[g % kMaxMixStreams], samples - 5,
+                             gains[g][0], gains[g][1]);
+    mismatches += memcmp(a, b, sizeof(a)) != 0 ? 1 : 0;
+  }
+  printf("vector and scalar mix: %s\n",
+         mismatches == 0 ? "identical" : "DIFFERENT");
+
+  printf("%d buffers of %d samples, ns per buffer (per stream):\n", count,
+         kBenchSamples);
+  for (int streams = 1; streams <= kMaxMixStreams; streams++) {
+    double vec = benchMix(AudioMixer::mixQ15, inputs, streams, count,
+                          false);
+    double scalar = benchMix(AudioMixer::mixQ15Scalar, inputs, streams,
+                             count, false);
+    double ramp = benchMix(AudioMixer::mixQ15, inputs, streams, count,
+                           true);
+    printf("  %d streams: vector %.0f (%.0f), ramp %.0f (%.0f), "
+           "scalar %.0f (%.0f), %.1fx\n",
+           streams, vec, vec / streams, ramp, ramp / streams, scalar,
+           scalar / streams, vec > 0 ? scalar / vec : 0.0);
+  }
+
+  for (int s = 0; s < kMaxMixStreams; s++) {
+    delete [] inputs[s];
+  }
+}
+
+static AudioMixer* sMixer;
+
+// An 880 Hz beep every second on a ducking stream.
+static void* earconLoop(void* arg)
+{
+  int beeps = *(int*)arg;
+  short tone[16 * 300];
+  for (int i = 0; i < 16 * 300; i++) {
+    tone[i] = (short)(8000 * sin(2 * M_PI * 880 * i / 16000.0));
+  }
+
+  for (int n = 0; n < beeps; n++) {
+    usleep(1000 * 1000);
+    int id = sMixer->openStream(1.0f, true);
+    PcmQueue* queue = sMixer->queue(id);
+    if (queue == NULL) {
+      continue;
+    }
+    int offset = 0;
+    char* buffer = NULL;
+    int room;
+    while (offset < (int)sizeof(tone) &&
+           (room = queue->acquireWrite(&buffer)) > 0) {
+      int size = std::min(room, (int)sizeof(tone) - offset);
+      memcpy(buffer, (char*)tone + offset, size);
+      queue->commitWrite(size);
+      offset += size;
+    }
+    queue->close();
+    sMixer->waitStream(id, 2000);
+  }
+  return NULL;
+}
+
+// Plays |file| with beeps ducking it, all through one player.
+void playMixed(const char* file, int beeps)
+{
+  FILE* fd = fopen(file, "rb");
+  if (fd == NULL) {
+    printf("can not open %s\n", file);
+    return;
+  }
+
+  AudioPlayer* player = new AudioPlayer(STREAMING);
+  player->createStreamingAudioPlayer(16000, 1, 16 * 2 * 80);
+  sMixer = new AudioMixer(player);
+  sMixer->start();
+
+  int id = sMixer->openStream(0.8f, false);
+  pthread_t earcons;
+  pthread_create(&earcons, NULL, earconLoop, &beeps);
+
+  PcmQueue* queue = sMixer->queue(id);
+  char* buffer = NULL;
+  int room;
+  while ((room = queue->acquireWrite(&buffer)) > 0) {
+    int size = fread(buffer, 1, room, fd);
+    if (size <= 0) {
+      break;
+    }
+    queue->commitWrite(size);
+  }
+  queue->close();
+  sMixer->waitStream(id, 60 * 1000);
+  pthread_join(earcons, NULL);
+
+  sMixer->stop();
+  sMixer->dumpStats();
+  player->dumpStats();
+  delete sMixer;
+  player->destoryAudioPlayer();
+  delete player;
+  fclose(fd);
+}
+
+int main(int argc, char* argv[])
+{
+  char* rawFile = NULL;
+  int beeps = 3;
+  int bench = 0;
+  while (*argv) {
+    if (strcmp(*argv, "-raw") == 0) {
+      argv++;
+      if (*argv) {
+        rawFile = *argv;
+      }
+    } else if (strcmp(*argv, "-beeps") == 0) {
+      argv++;
+      if (*argv) {
+        beeps = atoi(*argv);
+      }
+    } else if (strcmp(*argv, "-bench") == 0) {
+      argv++;
+      if (*argv) {
+        bench = atoi(*argv);
+      }
+    }
+    if (*argv)
+      argv++;
+  }
+
+  if (bench > 0) {
+    benchMixer(bench);
+  } else if (rawFile != NULL) {
+    playMixed(rawFile, beeps);
+  } else {
+    printf("usage: %s -bench <buffers> | -raw <16k mono pcm> "
+           "[-beeps <n>]\n", "test_mixer");
+  }
+
+  return 1;
+}
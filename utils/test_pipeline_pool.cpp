@@ -0,0 +1,163 @@
+//
+// Created by ljliu on 19-3-4.
+//
+
+// Replays one raw capture (16k, kMicNum channels interleaved) through 1..N
+// pipelines that share a worker pool, paced in real time, and prints how
+// the pool keeps up as the stream count grows, for each frame length.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <vector>
+
+#include "MobPipeline.h"
+#include "PipelineWorkerPool.h"
+#include "TimeUtils.h"
+
+struct ReplayStream {
+  MobPipeline* pipeline;
+  const char* data;
+  int frames;
+  int cursor;
+  int64_t busyUs;
+};
+
+static void speechCallback(void* ud, const BeamFrame& frame,
+                           const FrameMeta& meta)
+{
+}
+
+static void replayFrame(void* arg)
+{
+  ReplayStream* stream = (ReplayStream*)arg;
+  int64_t begin = monotonic_us();
+  int bytes = stream->pipeline->micFrameBytes();
+  stream->pipeline->process(stream->data + bytes * stream->cursor, bytes);
+  stream->cursor = (stream->cursor + 1) % stream->frames;
+  stream->busyUs += monotonic_us() - begin;
+}
+
+static void runStreams(const std::vector<char>& pcm, int frameMs,
+                       int streams, int threads, int seconds)
+{
+  PipelineWorkerPool pool(threads, streams * 8);
+  pool.start();
+
+  std::vector<ReplayStream> replay(streams);
+  for (int i = 0; i < streams; i++) {
+    MobPipelineConfig config;
+    config.serialDevice = "";
+    config.capture = false;
+    config.pool = &pool;
+    config.frameMs = frameMs;
+    replay[i].pipeline = new MobPipeline(config, speechCallback, NULL);
+    replay[i].pipeline->start();
+    replay[i].data = &pcm[0];
+    replay[i].frames = pcm.size() / replay[i].pipeline->micFrameBytes();
+    replay[i].cursor = 0;
+    replay[i].busyUs = 0;
+  }
+
+  int64_t period = frameMs * 1000LL;
+  int frames = seconds * 1000 / frameMs;
+  int64_t base = monotonic_us();
+  for (int k = 0; k < frames; k++) {
+    int64_t due = base + k * period;
+    int64_t now = monotonic_us();
+    if (due > now) {
+      usleep(due - now);
+    }
+    for (int i = 0; i < streams; i++) {
+      pool.submit(replay[i].pipeline, replayFrame, &replay[i], due + period);
+    }
+  }
+
+  PoolStats stats;
+  do {
+    usleep(10000);
+    pool.getStats(&stats);
+  } while (stats.jobs + stats.dropped < (int64_t)frames * streams);
+  int64_t wall = monotonic_us() - base;
+
+  int64_t busy = 0;
+  for (int i = 0; i < streams; i++) {
+    replay[i].pipeline->stop();
+    delete replay[i].pipeline;
+    busy += replay[i].busyUs;
+  }
+  pool.stop();
+
+  // CPU per second of audio is what compares across frame lengths.
+  printf("frame %2d ms streams %2d threads %d: frames %lld, "
+         "misses %lld (%.2f%%), dropped %lld, max late %.1f ms, "
+         "avg frame %.2f ms, cpu %.1f ms/s per stream, load %.1f%%\n",
+         frameMs, streams, threads, (long long)stats.jobs,
+         (long long)stats.deadlineMisses,
+         100.0 * stats.deadlineMisses / (stats.jobs ? stats.jobs : 1),
+         (long long)stats.dropped, stats.maxLatenessUs / 1000.0,
+         busy / 1000.0 / (stats.jobs ? stats.jobs : 1),
+         busy / 1000.0 / ((double)frames * frameMs / 1000) / streams,
+         100.0 * busy / wall / threads);
+}
+
+int main(int argc, char* argv[])
+{
+  const char* rawFile = NULL;
+  int maxStreams = 4;
+  int threads = sysconf(_SC_NPROCESSORS_ONLN);
+  int seconds = 10;
+  const char* frameList = "10,16,20,32";
+  for (int i = 1; i + 1 < argc; i += 2) {
+    if (strcmp(argv[i], "-raw") == 0) {
+      rawFile = argv[i + 1];
+    } else if (strcmp(argv[i], "-streams") == 0) {
+      maxStreams = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-threads") == 0) {
+      threads = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-seconds") == 0) {
+      seconds = atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "-frame_ms") == 0) {
+      frameList = argv[i + 1];
+    }
+  }
+
+  if (rawFile == NULL) {
+    printf("usage: %s -raw <16k %d-mic pcm> [-streams N] [-threads T] "
+           "[-seconds S] [-frame_ms 10,16,20,32]\n", argv[0], kMicNum);
+    return 1;
+  }
+
+  FILE* fp = fopen(rawFile, "rb");
+  if (fp == NULL) {
+    printf("can not open %s\n", rawFile);
+    return 1;
+  }
+  std::vector<char> pcm;
+  char chunk[4096];
+  size_t got;
+  while ((got = fread(chunk, 1, sizeof(chunk), fp)) > 0) {
+    pcm.insert(pcm.end(), chunk, chunk + got);
+  }
+  fclose(fp);
+  if (pcm.size() < (size_t)16 * kMaxFrameMs * kMicNum * 2) {
+    printf("%s is shorter than one frame\n", rawFile);
+    return 1;
+  }
+
+  const char* p = frameList;
+  while (*p) {
+    int frameMs = atoi(p);
+    for (int streams = 1; streams <= maxStreams; streams++) {
+      runStreams(pcm, frameMs, streams, threads, seconds);
+    }
+    p = strchr(p, ',');
+    if (p == NULL) {
+      break;
+    }
+    p++;
+  }
+  return 0;
+}
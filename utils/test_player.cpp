@@ -3,10 +3,13 @@
 //
 
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 #include <pthread.h>
 
 #include "AudioPlayer.h"
+#include "TimeUtils.h"
 
 void playPCM(const char* file)
 {
@@ -16,13 +19,20 @@ void playPCM(const char* file)
   player->createStreamingAudioPlayer(16000, 1, 16 * 2 * 80);
   player->start();
 
-  char buffer[2048];
+  // Read straight into the player's queue buffers.
+  char* buffer = NULL;
   int size = 0;
-  while((size = fread(buffer, 1, sizeof(buffer), fd)) > 0) {
-    player->write(buffer, size, true);
+  while (player->lease(&buffer, true) > 0) {
+    size = fread(buffer, 1, player->bufferSize(), fd);
+    player->commit(buffer, size > 0 ? size : 0);
+    if (size <= 0) {
+      break;
+    }
   }
 
+  player->drain(2000);
   player->stop();
+  player->dumpStats();
   player->destoryAudioPlayer();
   delete player;
 
@@ -69,10 +79,58 @@ void playUri(const char* uri)
   pthread_mutex_destroy(&sMutex);
 }
 
+// Time one create/realize of a streaming player, as done per prompt.
+static int64_t createPlayerUs()
+{
+  int64_t begin = monotonic_us();
+  AudioPlayer* player = new AudioPlayer(STREAMING);
+  player->createStreamingAudioPlayer(16000, 1, 16 * 2 * 80);
+  int64_t us = monotonic_us() - begin;
+  player->destoryAudioPlayer();
+  delete player;
+  return us;
+}
+
+// Player creation cost with a cold engine (every object used to bring up
+// its own engine and output mix) against the shared, already realized one.
+void benchCreate(int count)
+{
+  int64_t coldUs = createPlayerUs();
+
+  // Keep one user alive so the engine and mix stay realized.
+  AudioPlayer* keeper = new AudioPlayer(STREAMING);
+  keeper->createStreamingAudioPlayer(16000, 1, 16 * 2 * 80);
+
+  int64_t totalUs = 0;
+  int64_t worstUs = 0;
+  for (int i = 0; i < count; i++) {
+    int64_t us = createPlayerUs();
+    totalUs += us;
+    if (us > worstUs) {
+      worstUs = us;
+    }
+  }
+
+  AudioEngineStats stats;
+  NativeAudioBase::getEngineStats(&stats);
+  printf("cold create: %lld us (engine %lld us, output mix %lld us)\n",
+         (long long)coldUs, (long long)stats.engineCreateUs,
+         (long long)stats.mixCreateUs);
+  printf("warm create: avg %lld us, worst %lld us over %d players\n",
+         (long long)(count > 0 ? totalUs / count : 0), (long long)worstUs,
+         count);
+  printf("engine created %u times, output mix %u times\n",
+         stats.engineCreates, stats.mixCreates);
+
+  keeper->destoryAudioPlayer();
+  delete keeper;
+}
+
 int main(int argc, char* argv[])
 {
   char* rawFile = NULL;
   char* uri = NULL;
+  int bench = 0;
   while (*argv) {
     if (strcmp(*argv, "-raw") == 0) {
       argv++;
@@ -85,12 +143,19 @@ int main(int argc, char* argv[])
         uri = *argv;
         printf("uri: %s\n",uri);
       }
+    } else if (strcmp(*argv, "-bench") == 0) {
+      argv++;
+      if (*argv) {
+        bench = atoi(*argv);
+      }
     }
     if (*argv)
       argv++;
   }
 
-  if (rawFile != NULL) {
+  if (bench > 0) {
+    benchCreate(bench);
+  } else if (rawFile != NULL) {
     playPCM(rawFile);
   } else if (uri != NULL){
     playUri(uri);
@@ -0,0 +1,188 @@
+//
+// Created by ljliu on 19-3-22.
+//
+
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <vector>
+
+#include "utils/Resampler.h"
+#include "utils/TimeUtils.h"
+
+static const int kRates[][2] = {
+  {16000, 48000}, {48000, 16000}, {16000, 44100}, {44100, 16000},
+  {8000, 16000}, {22050, 16000},
+};
+
+// A |freq| Hz sine through |inRate| -> |outRate|, compared with the ideal
+// output at the filter delay. Returns the SNR in dB; the first and last
+// taps' worth of frames are skipped.
+static double sineSnr(int inRate, int outRate, double freq, bool fixed)
+{
+  Resampler resampler;
+  if (resampler.init(inRate, outRate, 1) != 0) {
+    return 0;
+  }
+
+  int inFrames = inRate;     // 1 s
+  double amplitude = 0.5;
+  std::vector<float> inF(inFrames);
+  std::vector<short> inS(inFrames);
+  for (int i = 0; i < inFrames; i++) {
+    inF[i] = (float)(amplitude * sin(2 * M_PI * freq * i / inRate));
+    inS[i] = (short)lrint(inF[i] * 32767);
+  }
+
+  std::vector<float> outF(resampler.maxOutFrames(inFrames));
+  std::vector<short> outS(outF.size());
+  // Odd chunks, to cover the block carry-over.
+  int produced = 0;
+  for (int offset = 0; offset < inFrames; offset += 333) {
+    int n = inFrames - offset < 333 ? inFrames - offset : 333;
+    produced += fixed
+        ? resampler.process(&inS[offset], n, &outS[produced])
+        : resampler.process(&inF[offset], n, &outF[produced]);
+  }
+
+  double delay = resampler.delayFrames();
+  int skip = resampler.taps() * 2;
+  double signal = 0;
+  double noise = 0;
+  for (int n = skip; n < produced - skip; n++) {
+    double t = (double)n * inRate / outRate - delay;
+    double ideal = amplitude * sin(2 * M_PI * freq * t / inRate);
+    double got = fixed ? outS[n] / 32767.0 : outF[n];
+    signal += ideal * ideal;
+    noise += (got - ideal) * (got - ideal);
+  }
+  return 10 * log10(signal / (noise > 0 ? noise : 1e-20));
+}
+
+// Level of a tone above the output Nyquist rate after downsampling, dB
+// relative to the input.
+static double aliasRejection(int inRate, int outRate, double freq)
+{
+  Resampler resampler;
+  resampler.init(inRate, outRate, 1);
+  int inFrames = inRate;
+  std::vector<float> in(inFrames);
+  for (int i = 0; i < inFrames; i++) {
+    in[i] = (float)(0.5 * sin(2 * M_PI * freq * i / inRate));
+  }
+  std::vector<float> out(resampler.maxOutFrames(inFrames));
+  int produced = resampler.process(&in[0], inFrames, &out[0]);
+  double energy = 0;
+  int skip = resampler.taps() * 2;
+  for (int n = skip; n < produced - skip; n++) {
+    energy += out[n] * out[n];
+  }
+  energy /= produced - 2 * skip;
+  return 10 * log10(energy / 0.125 + 1e-20);
+}
+
+void benchQuality()
+{
+  static const double kTones[] = { 440, 1000, 3000, 6000 };
+  printf("SNR of a sine, dB (int16 / float):\n");
+  for (unsigned int r = 0; r < sizeof(kRates) / sizeof(kRates[0]); r++) {
+    int inRate = kRates[r][0];
+    int outRate = kRates[r][1];
+    printf("  %5d -> %5d:", inRate, outRate);
+    for (unsigned int t = 0; t < sizeof(kTones) / sizeof(kTones[0]); t++) {
+      double tone = kTones[t];
+      if (tone * 2 > 0.8 * (inRate < outRate ? inRate : outRate)) {
+        continue;
+      }
+      printf("  %g Hz %.1f / %.1f", tone, sineSnr(inRate, outRate, tone, true),
+             sineSnr(inRate, outRate, tone, false));
+    }
+    printf("\n");
+  }
+
+  printf("aliased tone level, dB below the input:\n");
+  printf("  48000 -> 16000, 10 kHz tone: %.1f\n",
+         aliasRejection(48000, 16000, 10000));
+  printf("  44100 -> 16000, 12 kHz tone: %.1f\n",
+         aliasRejection(44100, 16000, 12000));
+}
+
+// Seconds of |channels| channel audio converted per second, and ns per
+// output frame.
+static void benchSpeed(int inRate, int outRate, int channels, bool fixed,
+                       bool scalar, int seconds)
+{
+  Resampler resampler;
+  resampler.init(inRate, outRate, channels);
+  resampler.setScalar(scalar);
+
+  // 10 ms blocks, the way capture and playback call it.
+  int block = inRate / 100;
+  std::vector<short> inS(block * channels);
+  std::vector<float> inF(block * channels);
+  for (int i = 0; i < block * channels; i++) {
+    inS[i] = (short)(rand() % 20000 - 10000);
+    inF[i] = inS[i] / 32768.0f;
+  }
+  std::vector<short> outS(resampler.maxOutFrames(block) * channels);
+  std::vector<float> outF(outS.size());
+
+  int64_t frames = 0;
+  int64_t begin = monotonic_us();
+  for (int n = 0; n < seconds * 100; n++) {
+    frames += fixed ? resampler.process(&inS[0], block, &outS[0])
+                    : resampler.process(&inF[0], block, &outF[0]);
+  }
+  int64_t us = monotonic_us() - begin;
+  printf("  %5d -> %5d x%d %s %s: %.0fx realtime, %.1f ns per frame\n",
+         inRate, outRate, channels, fixed ? "int16" : "float",
+         scalar ? "scalar" : "vector",
+         us > 0 ? seconds * 1e6 / us : 0.0,
+         frames > 0 ? us * 1000.0 / frames : 0.0);
+}
+
+void benchThroughput(int seconds)
+{
+  printf("throughput over %d s of audio (%s build):\n", seconds,
+         Resampler::vectorized() ? "vector" : "scalar only");
+  for (unsigned int r = 0; r < sizeof(kRates) / sizeof(kRates[0]); r++) {
+    for (int fixed = 1; fixed >= 0; fixed--) {
+      for (int scalar = 0; scalar <= 1; scalar++) {
+        benchSpeed(kRates[r][0], kRates[r][1], 1, fixed, scalar, seconds);
+      }
+    }
+  }
+  // The capture format: 48k stereo.
+  benchSpeed(44100, 48000, 2, true, false, seconds);
+}
+
+int main(int argc, char* argv[])
+{
+  int seconds = 10;
+  bool quality = true;
+  bool speed = true;
+  while (*argv) {
+    if (strcmp(*argv, "-seconds") == 0) {
+      argv++;
+      if (*argv) {
+        seconds = atoi(*argv);
+      }
+    } else if (strcmp(*argv, "-quality") == 0) {
+      speed = false;
+    } else if (strcmp(*argv, "-speed") == 0) {
+      quality = false;
+    }
+    if (*argv)
+      argv++;
+  }
+
+  if (quality) {
+    benchQuality();
+  }
+  if (speed) {
+    benchThroughput(seconds);
+  }
+  return 1;
+}